@@ -6,16 +6,33 @@
 
 #define SIP_LV_HIGH 2
 #define SIP_LV_LOW 1
+
+/* The level-specialized library builds (see library/Makefile) define
+   SIP_LIB_LEVEL and only carry the policy for that level; the test for the
+   other level is then a compile-time constant. */
+#if defined(SIP_LIB_LEVEL) && SIP_LIB_LEVEL == SIP_LV_LOW
+#define SIP_IS_HIGHI 0
+#else
 #define SIP_IS_HIGHI (SIP_LV_HIGH == sip_level())
+#endif
+
+#if defined(SIP_LIB_LEVEL) && SIP_LIB_LEVEL == SIP_LV_HIGH
+#define SIP_IS_LOWI 0
+#else
 #define SIP_IS_LOWI (SIP_LV_LOW == sip_level())
+#endif
+
 #define sip_level_min(lvl1, lvl2) (lvl1 < lvl2 ? lvl1 : lvl2)
 
 int sip_fd_to_level(int fd);
 int sip_downgrade_fd(int fd);
 int sip_can_downgrade_buf(struct stat *sbuf);
+int sip_stat_buf_to_level(struct stat *sb);
 int sip_path_to_level(const char* path);
+int sip_pathat_to_level(int dirfd, const char* path);
 int sip_uid_to_level(uid_t uid);
 int sip_gid_to_level(uid_t uid);
 int sip_level();
+int sip_level_refresh();
 
 #endif
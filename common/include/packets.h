@@ -4,167 +4,279 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <stddef.h>
 #include <limits.h>
 #include <utime.h>
 
-#define SIP_DATA_SZ 75
 #define SYS_fstatat SYS_fstatat64
 #define SYS_delegatortest 400
 #define SYS_statvfs 401
+#define SYS_compound 402
+#define SYS_readdirplus 403
+#define SYS_subtree 404
 
 #define SIP_PREPARE_RES(varname) struct sip_response varname
 
-/* example use: SIP_PREPARE_PKT(openat, request); */
-#define SIP_PREPARE_REQ(name, vname) 						\
-	struct sip_request_ ##name vname = { 					\
-		.head.size = sizeof(struct sip_request_ ##name), 	\
-		.head.callno = SYS_ ##name							\
-	}														\
+/**
+ * Wire protocol. A connection starts with a handshake: the client sends a
+ * struct sip_hello with the range of versions it speaks and the daemon
+ * answers with the version it picked (min_version == max_version), or with
+ * both set to 0 if it speaks none of them and is about to hang up. The
+ * flags ask for optional features; the daemon echoes the ones it accepted.
+ *
+ * After that, every request is a struct sip_header followed by the fields
+ * of the call in the order they are listed in SIP_FIELDS_<name>, without
+ * padding. VAL and PAIR fields are sent as raw bytes; STR fields as an
+ * unsigned short length (including the terminating NUL) followed by the
+ * string. PATH fields are a signed char followed by a string: the index of
+ * the directory descriptor the path is relative to among the descriptors
+ * sent with the request (SCM_RIGHTS), or -1 for an absolute path. An empty
+ * path refers to the descriptor itself.
+ *
+ * A response is a struct sip_response truncated after size bytes of buf,
+ * and carries the ID of the request it answers. Descriptors returned by the
+ * call are attached to the same message (nfds of them). Requests on the
+ * same connection may be answered in any order.
+ *
+ * A SYS_compound request runs a short sequence of delegated calls in one
+ * round trip. After the header comes an unsigned char with the number of
+ * steps, then each step: a struct sip_step followed by the fields of its
+ * call. In the PATH fields of a step, index SIP_MAX_FDS + i refers to the
+ * descriptor returned by step i. The steps run in order until one fails;
+ * the result is a struct sip_compound_result in buf.
+ *
+ * A client that sets SIP_HELLO_NOTICES is also sent a notice whenever a
+ * delegated call, from any client, may have changed a file. A notice is a
+ * struct sip_response with ID SIP_NOTICE_ID. Its buf holds the absolute
+ * path of the file; the change may affect everything below it too. If
+ * size is 0 (also used for paths that don't fit), anything may have
+ * changed. Notices go over the socket also
+ * when rings are used. They are dropped if the client doesn't keep up.
+ * Every message carries in notices the number of notices meant for the
+ * client so far, so that the client can tell that it missed some.
+ *
+ * A notice for a path is only meant for clients that read it, or a file
+ * below it, with an absolute path and a call in SIP_CALL_SHAREABLE in the
+ * last 2 * SIP_RESULT_TTL_NS. Clients must not keep such results longer
+ * than SIP_RESULT_TTL_NS.
+ */
+#define SIP_PROTO_MAGIC 0x31504953 	/* "SIP1" */
+#define SIP_PROTO_VERSION 9 		/* 2: request IDs, 3: hello flags, 4: dirfds,
+									   5: descriptors attached to responses,
+									   6: compound requests, 7: readdirplus,
+									   8: subtree operations,
+									   9: invalidation notices */
+#define SIP_MAX_FDS 2 				/* max. descriptors sent with a message */
+#define SIP_HELLO_RING 1 			/* shared-memory rings, see ring.h */
+#define SIP_HELLO_NOTICES 2 		/* invalidation notices */
+#define SIP_NOTICE_ID 0 			/* never used for a request */
+#define SIP_RESULT_TTL_NS (1000 * 1000000L) 	/* see notices above */
 
-struct sip_header {
-	int callno; 			/* syscall number */
-	int size; 				/* packet size, in bytes */
+struct sip_hello {
+	unsigned int magic; 			/* SIP_PROTO_MAGIC */
+	unsigned short min_version;
+	unsigned short max_version;
+	unsigned int flags; 			/* SIP_HELLO_* */
 };
 
-struct sip_response {
-	int rv;    			   	/* return value */
-	int err; 			   	/* error number (0 if successful) */
-	char buf[SIP_DATA_SZ]; 	/* buffer for extra data */
+struct sip_header {
+	unsigned short callno; 	/* syscall number */
+	unsigned short size; 	/* packet size, in bytes */
+	unsigned int id; 		/* echoed in the response */
+	unsigned int nfds; 		/* descriptors sent with the request */
 };
 
-/* test syscall */
-struct sip_request_test {
-	struct sip_header head;
-	int err;
-};
+#define SIP_MAX_STEPS 8 			/* max. steps in a compound request */
+#define SIP_COMPOUND_SZ 16384 		/* max. size of a compound request */
+#define SIP_STEP_EXIST_OK 1 		/* EEXIST does not stop the sequence */
 
-/* faccessat */
-struct sip_request_faccessat {
-	struct sip_header head;
-	char pathname[PATH_MAX];
-	int mode;
-	int flags;
+struct sip_step {
+	unsigned short callno; 	/* syscall number */
+	unsigned short flags; 	/* SIP_STEP_* */
 };
 
-/* fchmodat */
-struct sip_request_fchmodat {
-	struct sip_header head;
-	char pathname[PATH_MAX];
-	mode_t mode;
-	int flags;
-};
+/**
+ * SYS_readdirplus lists a directory along with the attributes of its
+ * entries (from lstat; the integrity level follows from them). The entries
+ * are returned in a memfd as consecutive struct sip_dirent records, up to
+ * SIP_READDIR_BATCH per call; a listing that doesn't fit is continued by
+ * passing the returned cookie back in.
+ */
+#define SIP_READDIR_BATCH 1024
 
-/* fchownat */
-struct sip_request_fchownat {
-	struct sip_header head;
-	char pathname[PATH_MAX];
-	uid_t owner;
-	gid_t group;
-	int flags;
+struct sip_dirent {
+	struct stat stat; 				/* st_mode is 0 if lstat failed */
+	unsigned short reclen; 			/* bytes to the next record */
+	unsigned char type; 			/* d_type */
+	char name[]; 					/* NUL-terminated */
 };
 
-/* fstatat */
-struct sip_request_fstatat {
-	struct sip_header head;
-	char pathname[PATH_MAX];
-	int flags;
+struct sip_readdir_result {
+	unsigned int count; 			/* records in the memfd */
+	int eof; 						/* 1 if the listing is complete */
+	long cookie; 					/* where the next batch starts */
 };
 
-/* statvfs */
-struct sip_request_statvfs {
-	struct sip_header head;
-	char path[PATH_MAX];
-};
+/**
+ * SYS_subtree applies one operation to every file under a path, without
+ * following symbolic links: SIP_SUBTREE_REMOVE removes the tree bottom-up,
+ * SIP_SUBTREE_CHMOD sets the mode of every file but the symlinks and
+ * SIP_SUBTREE_CHOWN changes the owner and group of every file. Each file is
+ * subject to the policy of the corresponding single-file call. Files the
+ * policy rejects are left in place and counted in the result; the response's
+ * rv is 0 if none was, and -1 otherwise, with err set by the first failure.
+ * The path must name a directory below a top-level one (EPERM for "/" and
+ * e.g. "/usr"). After SIP_SUBTREE_MAX_NODES files, the rest of the tree is
+ * left alone and the request fails with E2BIG.
+ */
+#define SIP_SUBTREE_REMOVE 1
+#define SIP_SUBTREE_CHMOD 2
+#define SIP_SUBTREE_CHOWN 3
 
-/* linkat */
-struct sip_request_linkat {
-	struct sip_header head;
-	char oldpath[PATH_MAX];
-	char newpath[PATH_MAX];
-	int flags;
-};
+#define SIP_SUBTREE_DIR_SETID 1 	/* chmod: keep the set-user-ID and
+									   set-group-ID bits of directories */
+#define SIP_SUBTREE_MAX_DEPTH 64 	/* deeper directories are left alone */
+#define SIP_SUBTREE_MAX_NODES 100000 	/* files handled per request */
 
-/* mkdirat */
-struct sip_request_mkdirat {
-	struct sip_header head;
-	char pathname[PATH_MAX];
-	mode_t mode;
+struct sip_subtree_result {
+	unsigned long nodes; 			/* files the operation was applied to */
+	unsigned long failed; 			/* ... and failed for */
 };
 
-/* mknodat */
-struct sip_request_mknodat {
-	struct sip_header head;
-	char pathname[PATH_MAX];
-	mode_t mode;
-	dev_t dev;
+/* Data returned by a single call. */
+union sip_call_data {
+	struct stat stat;
+	struct statvfs statvfs;
+	struct sip_readdir_result readdir;
+	struct sip_subtree_result subtree;
 };
 
-/* openat */
-struct sip_request_openat {
-	struct sip_header head;
-	char file[PATH_MAX];
-	int flags;
-	mode_t mode;
+/* Result of a compound request. The response's rv is 0 if every step
+   succeeded and -1 otherwise, with err set by the step that failed. */
+struct sip_compound_result {
+	unsigned int steps; 			/* steps that ran */
+	int rv[SIP_MAX_STEPS]; 			/* their return values; for a returned
+									   descriptor, its index among the
+									   ones attached to the response */
+	union sip_call_data data; 		/* data of the last step returning any */
 };
 
-/* renameat2 */
-struct sip_request_renameat2 {
-	struct sip_header head;
-	char oldpath[PATH_MAX];
-	char newpath[PATH_MAX];
-	unsigned int flags;
+/* Largest result returned in a response. */
+union sip_payload {
+	union sip_call_data call;
+	struct sip_compound_result compound;
 };
 
-/* symlinkat */
-struct sip_request_symlinkat {
-	struct sip_header head;
-	char target[PATH_MAX];
-	char linkpath[PATH_MAX];
-};
+#define SIP_DATA_SZ sizeof(union sip_payload)
 
-/* unlinkat */
-struct sip_request_unlinkat {
-	struct sip_header head;
-	char pathname[PATH_MAX];
-	int flags;
+struct sip_response {
+	int rv;    			   	/* return value */
+	int err; 			   	/* error number (0 if successful) */
+	unsigned int id; 		/* ID of the request */
+	unsigned int nfds; 		/* descriptors attached to the response */
+	unsigned int notices; 	/* notices meant for the client so far */
+	unsigned int size; 		/* bytes of buf in use */
+	char buf[SIP_DATA_SZ]; 	/* buffer for extra data */
 };
 
-/* utime */
-struct sip_request_utime {
-	struct sip_header head;
-	char path[PATH_MAX];
-	struct utimbuf times;
-};
+/* Calls that only read and return no descriptors. Identical requests for
+   them may share one result (see bridge.c and the daemon's coalesce.c).
+   Their first field is the path they read. */
+#define SIP_CALL_SHAREABLE(callno) \
+	((callno) == SYS_fstatat || (callno) == SYS_faccessat || (callno) == SYS_statvfs)
 
-/* utimes */
-struct sip_request_utimes {
-	struct sip_header head;
-	char filename[PATH_MAX];
-	struct timeval times[2];
-};
+/* Bytes of a response that go on the wire. */
+#define SIP_RESPONSE_SIZE(response) (offsetof(struct sip_response, buf) + (response)->size)
 
-/* utimensat */
-struct sip_request_utimensat {
-	struct sip_header head;
-	char pathname[PATH_MAX];
-	struct timespec times[2];
-	int flags;
-};
+/**
+ * Table of delegated calls. The request structs below, the handler prototypes
+ * and dispatch switch in the daemon, and the client-side sip_delegate_<name>()
+ * stubs in the library are all generated from it. Each entry has the form
+ * X(name, call number, 1 if the response carries a descriptor), and the
+ * request fields are listed in SIP_FIELDS_<name>(F) as F(kind, type, field):
+ *
+ *   PATH  path name, sent with its directory descriptor
+ *   STR   string passed through verbatim
+ *   VAL   value of the given type
+ *   PAIR  two-element array of the given type
+ *
+ * To delegate a new call, add it here and write handle_<name>() in the daemon.
+ */
+#define SIP_DELEGATED_CALLS(X) \
+	X(test, SYS_delegatortest, 0) \
+	X(faccessat, SYS_faccessat, 0) \
+	X(fchmodat, SYS_fchmodat, 0) \
+	X(fchownat, SYS_fchownat, 0) \
+	X(fstatat, SYS_fstatat, 0) \
+	X(statvfs, SYS_statvfs, 0) \
+	X(linkat, SYS_linkat, 0) \
+	X(mkdirat, SYS_mkdirat, 0) \
+	X(mknodat, SYS_mknodat, 0) \
+	X(openat, SYS_openat, 1) \
+	X(renameat2, SYS_renameat2, 0) \
+	X(symlinkat, SYS_symlinkat, 0) \
+	X(unlinkat, SYS_unlinkat, 0) \
+	X(utime, SYS_utime, 0) \
+	X(utimes, SYS_utimes, 0) \
+	X(utimensat, SYS_utimensat, 0) \
+	X(bind, SYS_bind, 1) \
+	X(connect, SYS_connect, 1) \
+	X(readdirplus, SYS_readdirplus, 1) \
+	X(subtree, SYS_subtree, 0)
 
-/* bind */
-struct sip_request_bind {
-	struct sip_header head;
-	struct sockaddr addr;
-	int socktype;			/* needed for server side socket(2) call. */
-	socklen_t addrlen;
-};
+#define SIP_FIELDS_test(F) F(VAL, int, err)
+#define SIP_FIELDS_faccessat(F) F(PATH, char, pathname) F(VAL, int, mode) F(VAL, int, flags)
+#define SIP_FIELDS_fchmodat(F) F(PATH, char, pathname) F(VAL, mode_t, mode) F(VAL, int, flags)
+#define SIP_FIELDS_fchownat(F) F(PATH, char, pathname) F(VAL, uid_t, owner) F(VAL, gid_t, group) F(VAL, int, flags)
+#define SIP_FIELDS_fstatat(F) F(PATH, char, pathname) F(VAL, int, flags)
+#define SIP_FIELDS_statvfs(F) F(PATH, char, path)
+#define SIP_FIELDS_linkat(F) F(PATH, char, oldpath) F(PATH, char, newpath) F(VAL, int, flags)
+#define SIP_FIELDS_mkdirat(F) F(PATH, char, pathname) F(VAL, mode_t, mode)
+#define SIP_FIELDS_mknodat(F) F(PATH, char, pathname) F(VAL, mode_t, mode) F(VAL, dev_t, dev)
+#define SIP_FIELDS_openat(F) F(PATH, char, file) F(VAL, int, flags) F(VAL, mode_t, mode)
+#define SIP_FIELDS_renameat2(F) F(PATH, char, oldpath) F(PATH, char, newpath) F(VAL, unsigned int, flags)
+#define SIP_FIELDS_symlinkat(F) F(STR, char, target) F(PATH, char, linkpath)
+#define SIP_FIELDS_unlinkat(F) F(PATH, char, pathname) F(VAL, int, flags)
+#define SIP_FIELDS_utime(F) F(PATH, char, path) F(VAL, struct utimbuf, times)
+#define SIP_FIELDS_utimes(F) F(PATH, char, filename) F(PAIR, struct timeval, times)
+#define SIP_FIELDS_utimensat(F) F(PATH, char, pathname) F(PAIR, struct timespec, times) F(VAL, int, flags)
+#define SIP_FIELDS_bind(F) F(VAL, struct sockaddr, addr) F(VAL, int, socktype) F(VAL, socklen_t, addrlen)
+#define SIP_FIELDS_connect(F) F(VAL, struct sockaddr, addr) F(VAL, int, socktype) F(VAL, socklen_t, addrlen)
+#define SIP_FIELDS_readdirplus(F) F(PATH, char, path) F(VAL, long, cookie)
+#define SIP_FIELDS_subtree(F) F(PATH, char, path) F(VAL, int, op) F(VAL, mode_t, mode) F(VAL, uid_t, owner) F(VAL, gid_t, group) F(VAL, int, flags)
+
+/* Decoded requests, as seen by the daemon's handlers: struct sip_request_<name>.
+   Strings point into the received packet. Each PATH field comes with the
+   descriptor it is relative to in field_dirfd (AT_FDCWD if it is absolute). */
+#define SIP_STRUCT_FIELD(kind, type, field) SIP_STRUCT_ ##kind(type, field)
+#define SIP_STRUCT_PATH(type, field) int field ##_dirfd; const type *field;
+#define SIP_STRUCT_STR(type, field) const type *field;
+#define SIP_STRUCT_VAL(type, field) type field;
+#define SIP_STRUCT_PAIR(type, field) type field[2];
+#define SIP_REQUEST_STRUCT(name, nr, returns_fd) 		\
+	struct sip_request_ ##name { 							\
+		SIP_FIELDS_ ##name(SIP_STRUCT_FIELD) 				\
+	};
+
+SIP_DELEGATED_CALLS(SIP_REQUEST_STRUCT)
 
-/* connect */
-struct sip_request_connect {
-	struct sip_header head;
-	struct sockaddr addr;
-	int socktype;			/* needed for server side socket(2) call. */
-	socklen_t addrlen;
+/* Upper bound on the encoded size of a request: SIP_WIRE_MAX(name). */
+#define SIP_WIRE_FIELD(kind, type, field) + SIP_WIRE_ ##kind(type)
+#define SIP_WIRE_PATH(type) sizeof(signed char) + sizeof(unsigned short) + PATH_MAX
+#define SIP_WIRE_STR(type) sizeof(unsigned short) + PATH_MAX
+#define SIP_WIRE_VAL(type) sizeof(type)
+#define SIP_WIRE_PAIR(type) 2 * sizeof(type)
+#define SIP_WIRE_MAX(name) (sizeof(struct sip_header) SIP_FIELDS_ ##name(SIP_WIRE_FIELD))
+
+#define SIP_WIRE_BOUND(name, nr, returns_fd) char name[SIP_WIRE_MAX(name)];
+union sip_wire_bound {
+	SIP_DELEGATED_CALLS(SIP_WIRE_BOUND)
+	char compound[SIP_COMPOUND_SZ];
 };
 
+/* Largest request the daemon has to accept. */
+#define SIP_MAX_PACKET sizeof(union sip_wire_bound)
+
 #endif
@@ -0,0 +1,45 @@
+#ifndef _SIP_RING_H
+#define _SIP_RING_H
+
+#include "packets.h"
+
+/**
+ * Shared-memory transport. A client that asks for it in the handshake passes
+ * the daemon a sealed memfd holding a struct sip_rings: a submission queue
+ * of encoded requests and a completion queue of responses. Descriptors
+ * returned by handlers still travel over the socket, in the order of their
+ * completions, which is also how each side notices the other hanging up.
+ *
+ * Each queue has one producer and one consumer at a time (the sides
+ * serialize their own threads). Head and tail only ever increase; a side
+ * sleeps on the counter it is waiting for with a futex after a short spin,
+ * and the other side wakes it only if its waiting flag is set.
+ */
+#define SIP_RING_ENTRIES 16 			/* must be a power of two */
+#define SIP_RING_SPIN 200 				/* polls before sleeping (SMP only) */
+#define SIP_RING_WAIT_MS 100 			/* max. sleep between liveness checks */
+
+struct sip_ring {
+	unsigned int head; 					/* next entry to consume */
+	unsigned int tail; 					/* next entry to produce */
+	unsigned int head_waiting; 			/* producer sleeps on head */
+	unsigned int tail_waiting; 			/* consumer sleeps on tail */
+} __attribute__((aligned(64)));
+
+struct sip_ring_request {
+	unsigned int size;
+	char packet[SIP_MAX_PACKET];
+};
+
+struct sip_rings {
+	struct sip_ring sq;
+	struct sip_ring cq;
+	struct sip_ring_request sqe[SIP_RING_ENTRIES];
+	struct sip_response cqe[SIP_RING_ENTRIES];
+};
+
+int sip_ring_wait(unsigned int *word, unsigned int *waiting, unsigned int old);
+void sip_ring_publish(unsigned int *word, unsigned int *waiting, unsigned int value);
+int sip_peer_alive(int sockfd);
+
+#endif
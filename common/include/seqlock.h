@@ -0,0 +1,34 @@
+#ifndef _SIP_SEQLOCK_H
+#define _SIP_SEQLOCK_H
+
+/**
+ * Sequence counters for the lock-free tables in the library and the daemon.
+ * A slot's counter is odd while a writer owns the slot. Readers copy the
+ * slot and then check that the counter is even and unchanged; otherwise they
+ * treat the read as a miss. Writers that can't claim a slot either skip
+ * their update (caches) or retry (tables that must stay accurate).
+ */
+
+static inline unsigned sip_seq_read_begin(unsigned *seq) {
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+static inline int sip_seq_read_valid(unsigned *seq, unsigned start) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return !(start & 1) && __atomic_load_n(seq, __ATOMIC_RELAXED) == start;
+}
+
+static inline int sip_seq_write_begin(unsigned *seq) {
+	unsigned start = __atomic_load_n(seq, __ATOMIC_RELAXED);
+
+	if (start & 1)
+		return 0;
+	return __atomic_compare_exchange_n(seq, &start, start + 1, 0,
+									   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void sip_seq_write_end(unsigned *seq) {
+	__atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -4,9 +4,12 @@
 #include <sys/socket.h>
 
 char *sip_fd_to_path(int fd);
+char *sip_fd_to_path_r(int fd, char *resolved);
 char *sip_abs_path(int dirfd, const char *pathname);
+char *sip_abs_path_r(int dirfd, const char *pathname, char *resolved);
+char *sip_join_path_r(const char *dir, const char *pathname, char *resolved);
 int sip_is_named_sock(const struct sockaddr* addr, socklen_t addrlen);
 int sip_is_daemon();
-int sip_send_fd(int sockfd, int fd);
+ssize_t sip_send_fds(int sockfd, const void *data, size_t size, const int *fds, int nfds, int flags);
 
 #endif
@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/syscall.h>
 
 #include "common.h"
@@ -15,7 +16,7 @@
  * @param struct stat* sb
  * @return SIP_LV_HIGH or SIP_LV_LOW
  */
-static int sip_stat_buf_to_level(struct stat* sb) {
+int sip_stat_buf_to_level(struct stat* sb) {
 	/* World-writable FIFOs and special files should be considered lowi. */
 	if ((S_ISREG(sb->st_mode) || S_ISFIFO(sb->st_mode)) && (sb->st_mode & S_IWOTH)) {
 		return SIP_LV_LOW;
@@ -59,6 +60,23 @@ int sip_path_to_level(const char* path) {
 	return sip_stat_buf_to_level(&sbuf);
 }
 
+/**
+ * Determine the integrity level of a file given a path relative to a
+ * directory descriptor. Symbolic links are followed.
+ *
+ * @param int dirfd Directory descriptor, or AT_FDCWD.
+ * @param const char* path File path.
+ * @return -1 on error, otherwise SIP_LV_HIGH or SIP_LV_LOW
+ */
+int sip_pathat_to_level(int dirfd, const char* path) {
+	struct stat sbuf;
+
+	if ((fstatat(dirfd, path, &sbuf, 0)) == -1)
+		return -1;
+
+	return sip_stat_buf_to_level(&sbuf);
+}
+
 /**
  * Get the integrity level of the given user.
  *
@@ -144,16 +162,55 @@ int sip_downgrade_fd(int fd) {
 	return 0;
 }
 
+/* Cached integrity level of the calling process (0 until first use). The
+   level is derived from the real UID, which changes only through the setuid
+   family of calls, so it is refreshed there rather than on every query.
+
+   A vfork child shares the cache with its parent, and must not change it:
+   a child that drops to the untrusted user before exec would turn off the
+   parent's policy. Only the process that owns the cache (sip_cached_pid)
+   updates it. fork children get a copy, which they take over. */
+static int sip_cached_level = 0;
+static long sip_cached_pid = 0;
+
+static void sip_level_forked() {
+	sip_cached_pid = syscall(SYS_getpid);
+}
+
+__attribute__((constructor))
+static void sip_level_init() {
+	sip_cached_pid = syscall(SYS_getpid);
+	pthread_atfork(NULL, NULL, &sip_level_forked);
+}
+
 /**
- * Get the integrity level of the calling process by checking the real user ID.
+ * Re-read the real user ID of the calling process and update the cached
+ * integrity level. Must be called after any change of credentials. In a
+ * vfork child, the level is only returned.
  *
  * @return SIP_LV_HIGH or SIP_LV_LOW
  */
-int sip_level() {
+int sip_level_refresh() {
 	long uid = syscall(SYS_getuid32); /* use syscall(2) to avoid interception */
-	
-	if (uid == SIP_UNTRUSTED_USERID)
-		return SIP_LV_LOW;
-	
-	return SIP_LV_HIGH;
+	int level = (uid == SIP_UNTRUSTED_USERID) ? SIP_LV_LOW : SIP_LV_HIGH;
+
+	if (syscall(SYS_getpid) == sip_cached_pid)
+		__atomic_store_n(&sip_cached_level, level, __ATOMIC_RELAXED);
+
+	return level;
+}
+
+/**
+ * Get the integrity level of the calling process. The real user ID is only
+ * read on first use; afterwards the cached level is returned.
+ *
+ * @return SIP_LV_HIGH or SIP_LV_LOW
+ */
+int sip_level() {
+	int level = __atomic_load_n(&sip_cached_level, __ATOMIC_RELAXED);
+
+	if (level == 0)
+		level = sip_level_refresh();
+
+	return level;
 }
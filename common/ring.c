@@ -0,0 +1,89 @@
+/**
+ * Doorbells for the shared-memory rings (see ring.h).
+ */
+
+#define _GNU_SOURCE /* POLLRDHUP */
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define sip_cpu_relax() __builtin_ia32_pause()
+#else
+#define sip_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* Spinning only helps if the other side can run at the same time. */
+static int sip_ring_spin() {
+	static int spin = -1;
+
+	if (spin < 0)
+		spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SIP_RING_SPIN : 0;
+	return spin;
+}
+
+/**
+ * Wait for a ring counter to move past a value, spinning briefly before
+ * sleeping. The futex is shared between processes, so the private futex
+ * operations can't be used.
+ *
+ * @param unsigned int* word Counter to wait on (head or tail).
+ * @param unsigned int* waiting Waiting flag for word.
+ * @param unsigned int old Value the counter had.
+ * @return 0 once the counter has changed, -1 if it hasn't after
+ *         SIP_RING_WAIT_MS; the caller should then check that the other
+ *         side is still there.
+ */
+int sip_ring_wait(unsigned int *word, unsigned int *waiting, unsigned int old) {
+	struct timespec timeout = { 0, SIP_RING_WAIT_MS * 1000000L };
+	int i, spin = sip_ring_spin();
+
+	for (i = 0; i < spin; i++) {
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old)
+			return 0;
+		sip_cpu_relax();
+	}
+
+	/* Publish the flag before the final check, so that a producer either
+	   sees the flag or we see its update. */
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == old)
+		syscall(SYS_futex, word, FUTEX_WAIT, old, &timeout, NULL, 0);
+
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(word, __ATOMIC_ACQUIRE) != old ? 0 : -1;
+}
+
+/**
+ * Publish a new value of a ring counter and wake the other side if it sleeps
+ * on it. Each side keeps its own copy of the counters it owns, so a peer
+ * scribbling over the shared ones can't confuse it.
+ */
+void sip_ring_publish(unsigned int *word, unsigned int *waiting, unsigned int value) {
+	__atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Check whether the other end of a connection is still there.
+ *
+ * @return 1 if it is, 0 if it hung up.
+ */
+int sip_peer_alive(int sockfd) {
+	struct pollfd pfd = { sockfd, POLLRDHUP, 0 };
+
+	if (poll(&pfd, 1, 0) < 0)
+		return 1;
+
+	return !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL));
+}
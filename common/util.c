@@ -12,22 +12,23 @@
 #include <sys/un.h>
 
 #include "util.h"
+#include "packets.h"   // SIP_MAX_FDS
 #include "logger.h"
 #include "level.h"
 #include "common.h"
 
 /**
- * Resolve the given link to a pathname and return it in an appropriately
- * sized dynamically allocated buffer.
+ * Resolve the given link to a pathname and store it in resolved, which must
+ * be at least PATH_MAX bytes long.
  *
  * @param char* linkname
- * @return Pointer to resolved path name, or NULL on error.
+ * @param char* resolved
+ * @return resolved, or NULL on error.
  */
-static char* sip_readlink(char* linkname) {
-	char resolved_path[PATH_MAX];
+static char* sip_readlink_r(char* linkname, char* resolved) {
 	int rd;
 
-	rd = readlink(linkname, resolved_path, PATH_MAX);
+	rd = readlink(linkname, resolved, PATH_MAX);
 
 	if (rd == -1) {
 		sip_error("Failed to read link %s: %s\n", linkname, strerror(errno));
@@ -38,7 +39,24 @@ static char* sip_readlink(char* linkname) {
 		return NULL;
 	}
 
-	resolved_path[rd] = '\0';
+	resolved[rd] = '\0';
+
+	return resolved;
+}
+
+/**
+ * Resolve the given link to a pathname and return it in an appropriately
+ * sized dynamically allocated buffer.
+ *
+ * @param char* linkname
+ * @return Pointer to resolved path name, or NULL on error.
+ */
+static char* sip_readlink(char* linkname) {
+	char resolved_path[PATH_MAX];
+
+	if (sip_readlink_r(linkname, resolved_path) == NULL) {
+		return NULL;
+	}
 
 	return strdup(resolved_path);
 }
@@ -48,28 +66,18 @@ static char* sip_readlink(char* linkname) {
  * use the /proc pseudo-filesystem to obtain a symbolic link to the open
  * file, then resolve this link using readlink(2).
  *
- * NOTE: The buffer returned by this function is dynamically allocated
- * and should be freed by the caller.
- *
  * @param int fd File descriptor.
- * @return char* Resolved path name on success, NULL on error.
+ * @param char* resolved Buffer of at least PATH_MAX bytes for the result.
+ * @return char* resolved on success, NULL on error.
  */
-char* sip_fd_to_path(int fd) {
-	char linkname[PATH_MAX], *resolved;
-	int len = 0;
+char* sip_fd_to_path_r(int fd, char* resolved) {
+	char linkname[32];
 
 	/* Construct link name */
-	len = snprintf(linkname, PATH_MAX, "/proc/self/fd/%d", fd);
-	
-	if (len >= PATH_MAX) {
-		sip_error("Failed to convert %d to path: maximum link length exceeded.\n", fd);
-		return NULL;
-	}
+	snprintf(linkname, sizeof(linkname), "/proc/self/fd/%d", fd);
 
 	/* Resolve link name to path */
-	resolved = sip_readlink(linkname);
-
-	if (resolved == NULL) {
+	if (sip_readlink_r(linkname, resolved) == NULL) {
 		sip_error("Failed to convert %d to path: readlink error.\n", fd);
 		return NULL;
 	}
@@ -77,6 +85,25 @@ char* sip_fd_to_path(int fd) {
 	return resolved;
 }
 
+/**
+ * Convert the given file descriptor to a file path (see sip_fd_to_path_r).
+ *
+ * NOTE: The buffer returned by this function is dynamically allocated
+ * and should be freed by the caller.
+ *
+ * @param int fd File descriptor.
+ * @return char* Resolved path name on success, NULL on error.
+ */
+char* sip_fd_to_path(int fd) {
+	char resolved[PATH_MAX];
+
+	if (sip_fd_to_path_r(fd, resolved) == NULL) {
+		return NULL;
+	}
+
+	return strdup(resolved);
+}
+
 /**
  * Is the socket with the given addr and addrlen a named socket?
  *
@@ -119,79 +146,113 @@ int sip_is_daemon() {
 	return 0;
 }
 
+/**
+ * Join the directory dir and the relative pathname and store the result in
+ * resolved, which must be at least PATH_MAX bytes long. The result is
+ * canonicalized with realpath(3) when the target exists; otherwise (e.g. a
+ * file about to be created) the joined path is returned.
+ *
+ * @return resolved on success, NULL on error.
+ */
+char *sip_join_path_r(const char *dir, const char *pathname, char *resolved) {
+	char temppath[PATH_MAX];
+
+	if (snprintf(temppath, PATH_MAX, "%s/%s", dir, pathname) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	if (realpath(temppath, resolved) == NULL)
+		strcpy(resolved, temppath);
+
+	return resolved;
+}
+
 /**
  * If the given pathname is relative, interpret it relative to the directory
- * referred to by dirfd and return the absolute path. If dirfd has the special
- * value AT_FDCWD and the path is relative, interpret it relative to the current
- * working directory. If the pathname is absolute, return it unmodified.
+ * referred to by dirfd and store the absolute path in resolved, which must be
+ * at least PATH_MAX bytes long. If dirfd has the special value AT_FDCWD and
+ * the path is relative, interpret it relative to the current working
+ * directory. If the pathname is absolute, copy it unmodified.
  *
- * NOTE: The buffer returned by this function is dynamically allocated and must
- * be freed.
+ * @return resolved on success, NULL on error.
  */
-char *sip_abs_path(int dirfd, const char *pathname) {
+char *sip_abs_path_r(int dirfd, const char *pathname, char *resolved) {
+	char dirpath[PATH_MAX];
+
 	if (pathname[0] == '/') { 	/* absolute path */
-		return strdup(pathname);
+		if (strlen(pathname) >= PATH_MAX) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+		return strcpy(resolved, pathname);
 	}
 
-	char temppath[PATH_MAX] = {0};
-
 	if (dirfd != AT_FDCWD) {	/* interpret path relative to dirfd */
-		char *cwd = sip_fd_to_path(dirfd);
-		
-		if (cwd != NULL) {
-			strncpy(temppath, cwd, PATH_MAX);
-			free(cwd);
-		}
+		if (sip_fd_to_path_r(dirfd, dirpath) == NULL)
+			return NULL;
+	} else if (getcwd(dirpath, PATH_MAX) == NULL) {
+		return NULL;
 	}
 
-	strncat(temppath, pathname, PATH_MAX);
+	return sip_join_path_r(dirpath, pathname, resolved);
+}
+
+/**
+ * Dynamically allocating version of sip_abs_path_r.
+ *
+ * NOTE: The buffer returned by this function is dynamically allocated and must
+ * be freed.
+ */
+char *sip_abs_path(int dirfd, const char *pathname) {
+	char resolved[PATH_MAX];
+
+	if (sip_abs_path_r(dirfd, pathname, resolved) == NULL)
+		return NULL;
 
-	return realpath(temppath, NULL);
+	return strdup(resolved);
 }
 
 /**
- * Send descriptor fd over the socket referred to by descriptor sockfd.
+ * Send a message over the socket referred to by sockfd with nfds descriptors
+ * attached. The message must be at least one byte long.
  *
- * @return 0 on success, -1 on error
+ * @param int flags Passed to sendmsg(2), e.g. MSG_DONTWAIT.
+ * @return Same as sendmsg(2).
  */
-int sip_send_fd(int sockfd, int fd) {
-	
-	/* prepare struct msghdr */
+ssize_t sip_send_fds(int sockfd, const void *data, size_t size, const int *fds, int nfds, int flags) {
 	struct msghdr msg = {0};
 	struct cmsghdr *cmsg;
-	char *data = "test";
 	struct iovec iov[1];
-	int myfd[1], *fdptr;
-
-	myfd[0] = fd;
-
-	iov[0].iov_base = &data;
-	iov[0].iov_len = 5;
 
 	union {
 	   /* ancillary data buffer, wrapped in a union in order to ensure
 	      it is suitably aligned */
-	   char buf[CMSG_SPACE(sizeof myfd)];
+	   char buf[CMSG_SPACE(SIP_MAX_FDS * sizeof(int))];
 	   struct cmsghdr align;
 	} u;
 
+	if (nfds < 0 || nfds > SIP_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	iov[0].iov_base = (void *) data;
+	iov[0].iov_len = size;
+
 	msg.msg_iov = iov;
 	msg.msg_iovlen = 1;
-	msg.msg_control = u.buf;
-	msg.msg_controllen = sizeof u.buf;
-
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-	fdptr = (int *) CMSG_DATA(cmsg);
-	memcpy(fdptr, &myfd, sizeof(int));
-
-	/* send */
-	if (sendmsg(sockfd, &msg, 0) <= 0) {
-		sip_error("Failed to send file descriptor: %s\n", strerror(errno));
-		return -1;
+
+	if (nfds > 0) {
+		msg.msg_control = u.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
 	}
 
-	return 0;
+	return sendmsg(sockfd, &msg, flags);
 }
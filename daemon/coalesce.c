@@ -0,0 +1,170 @@
+/**
+ * Sharing of read-only calls between clients.
+ *
+ * During a parallel build, many clients stat or access the same protected
+ * files at the same moment, and each request would otherwise cost its own
+ * syscall. Requests for the calls in SIP_CALL_SHAREABLE with absolute paths
+ * don't depend on who sent them, so identical ones share a result: a
+ * request that arrives while an identical one is running waits for its
+ * result, and one that arrives within SIP_COALESCE_WINDOW_NS after it
+ * finished reuses it.
+ *
+ * A result is only shared if no other call that may change the file system
+ * ran since it was started. Such calls bump a generation number before and
+ * after they run, and a result is tagged with the generation it started in.
+ * Changes made outside the daemon are only picked up once the window ends.
+ *
+ * Each request maps to one slot by the hash of its fields. If the slot is
+ * in use by a different request, the call simply runs unshared.
+ */
+
+#define _GNU_SOURCE /* CLOCK_MONOTONIC_COARSE */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "coalesce.h"
+
+#define SIP_FLIGHT_RUNNING 1
+#define SIP_FLIGHT_DONE 2
+
+struct sip_flight {
+	int state; 						/* 0 if unused, else SIP_FLIGHT_* */
+	int waiters; 					/* requests waiting for the result */
+	unsigned long generation; 		/* when the call started */
+	long done; 						/* ns, when it finished */
+	unsigned short callno;
+	size_t size;
+	char fields[SIP_MAX_PACKET]; 	/* the request, after the header */
+	struct sip_response response;
+	pthread_cond_t cond;
+};
+
+/* The lock protects everything below. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sip_flight flights[SIP_COALESCE_SLOTS];
+static unsigned long generation = 0;
+static int initialized = 0;
+
+static long sip_coalesce_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* FNV-1a */
+static uint64_t sip_coalesce_hash(unsigned short callno, const char *fields, size_t size) {
+	uint64_t hash = 14695981039346656037ULL ^ callno;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= (unsigned char) fields[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/* Copy the result of a call, leaving the ID of the request alone. */
+static void sip_coalesce_copy(struct sip_response *dest, const struct sip_response *src) {
+	dest->rv = src->rv;
+	dest->err = src->err;
+	dest->nfds = 0;
+	dest->size = src->size;
+	memcpy(dest->buf, src->buf, src->size);
+}
+
+/**
+ * Look for a result to share before running a shareable call.
+ *
+ * @param char* fields, size_t size The request after its header.
+ * @param struct sip_response* response Receives the shared result.
+ * @param struct sip_flight** flight If the call has to be run, receives the
+ *                                   slot to publish its result in with
+ *                                   sip_coalesce_end(), or NULL.
+ * @return 1 if response holds a shared result, 0 if the caller must run
+ *         the call.
+ */
+int sip_coalesce_begin(unsigned short callno, const char *fields, size_t size,
+					   struct sip_response *response, struct sip_flight **flight) {
+	struct sip_flight *slot;
+	int i;
+
+	*flight = NULL;
+
+	if (size > SIP_MAX_PACKET)
+		return 0;
+
+	pthread_mutex_lock(&lock);
+
+	if (!initialized) {
+		for (i = 0; i < SIP_COALESCE_SLOTS; i++)
+			pthread_cond_init(&flights[i].cond, NULL);
+		initialized = 1;
+	}
+
+	slot = &flights[sip_coalesce_hash(callno, fields, size) % SIP_COALESCE_SLOTS];
+
+	if (slot->state != 0 && slot->generation == generation && slot->callno == callno &&
+		slot->size == size && memcmp(slot->fields, fields, size) == 0) {
+
+		if (slot->state == SIP_FLIGHT_RUNNING) {
+			slot->waiters++;
+			while (slot->state == SIP_FLIGHT_RUNNING)
+				pthread_cond_wait(&slot->cond, &lock);
+			slot->waiters--;
+
+			sip_coalesce_copy(response, &slot->response);
+			pthread_mutex_unlock(&lock);
+			return 1;
+		}
+
+		if (sip_coalesce_now() - slot->done < SIP_COALESCE_WINDOW_NS) {
+			sip_coalesce_copy(response, &slot->response);
+			pthread_mutex_unlock(&lock);
+			return 1;
+		}
+	}
+
+	/* Take the slot over, unless another call is running in it or requests
+	   are still waiting to copy its result. */
+	if (slot->state != SIP_FLIGHT_RUNNING && slot->waiters == 0) {
+		slot->state = SIP_FLIGHT_RUNNING;
+		slot->generation = generation;
+		slot->callno = callno;
+		slot->size = size;
+		memcpy(slot->fields, fields, size);
+		*flight = slot;
+	}
+
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/**
+ * Publish the result of a call started with sip_coalesce_begin() and wake
+ * the requests waiting for it.
+ */
+void sip_coalesce_end(struct sip_flight *flight, const struct sip_response *response) {
+	pthread_mutex_lock(&lock);
+
+	sip_coalesce_copy(&flight->response, response);
+	flight->state = SIP_FLIGHT_DONE;
+	flight->done = sip_coalesce_now();
+	pthread_cond_broadcast(&flight->cond);
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Note that a call that may change the file system is about to run, or has
+ * just run. Results started before are no longer shared.
+ */
+void sip_coalesce_write() {
+	pthread_mutex_lock(&lock);
+	generation++;
+	pthread_mutex_unlock(&lock);
+}
@@ -1,24 +1,50 @@
+#define _GNU_SOURCE /* O_PATH, memfd_create */
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/statvfs.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/openat2.h>
+#include <dirent.h>
 #include <utime.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
 #include "handlers.h"
 #include "logger.h"
 #include "level.h"
+#include "resolve.h"
 #include "common.h"
+#include "util.h"
+
+#define SIP_OPEN_TRIES 4 	/* see sip_resolve_open() */
+
+/**
+ * Prepare to submit a call made through one or two handles to the io_uring
+ * engine, which keeps their descriptors open until complete_call().
+ *
+ * @param struct sip_handle* other Second handle, or NULL.
+ * @return 1 if the call can be submitted, 0 if it must run synchronously.
+ */
+static int sip_submit_handle(struct sip_uring_op *op, struct sip_handle *handle, struct sip_handle *other) {
+	if (op == NULL)
+		return 0;
+
+	op->handles[0] = handle->owned ? handle->fd : -1;
+	op->handles[1] = other != NULL && other->owned ? other->fd : -1;
+	return 1;
+}
 
 /**
  * Handler for SYS_delegatortest. Simply sets the return value to 0
  * and sets errno to the given value.
  */
-void handle_delegatortest(struct sip_request_test *request, struct sip_response *response) {
+void handle_test(struct sip_request_test *request, struct sip_response *response) {
 	response->rv = 0;
 	response->err = request->err;
 }
@@ -29,14 +55,26 @@ void handle_delegatortest(struct sip_request_test *request, struct sip_response
  * Policy: Deny write access on high integrity files.
  */
 void handle_faccessat(struct sip_request_faccessat *request, struct sip_response *response) {
-	if (SIP_LV_HIGH == sip_path_to_level(request->pathname) && (request->mode & W_OK)) {
+	struct sip_handle file;
+
+	if (sip_resolve(&file, request->pathname_dirfd, request->pathname,
+					(request->flags & AT_SYMLINK_NOFOLLOW) ? O_NOFOLLOW : 0) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return;
+	}
+
+	if (SIP_LV_HIGH == sip_stat_buf_to_level(&file.st) && (request->mode & W_OK)) {
+		sip_release(&file);
+
 		response->rv = -1;
 		response->err = EACCES;
 		return;
 	}
 	
-	response->rv = faccessat(AT_FDCWD, request->pathname, request->mode, request->flags);
+	response->rv = faccessat(AT_FDCWD, file.proc, request->mode, request->flags & AT_EACCESS);
 	response->err = errno;
+	sip_release(&file);
 }
 
 /**
@@ -47,9 +85,16 @@ void handle_faccessat(struct sip_request_faccessat *request, struct sip_response
  */
 void handle_fchmodat(struct sip_request_fchmodat *request, struct sip_response *response) {
 
-	struct stat sbuf;
+	struct sip_handle file;
 
-	if (stat(request->pathname, &sbuf) < 0) {
+	if (request->flags & ~AT_SYMLINK_NOFOLLOW) {
+		response->rv = -1;
+		response->err = EINVAL;
+		return;
+	}
+
+	if (sip_resolve(&file, request->pathname_dirfd, request->pathname,
+					(request->flags & AT_SYMLINK_NOFOLLOW) ? O_NOFOLLOW : 0) < 0) {
 		sip_error("Failed to stat %s.\n", request->pathname);
 		
 		response->rv = -1;
@@ -57,11 +102,21 @@ void handle_fchmodat(struct sip_request_fchmodat *request, struct sip_response *
 		return;
 	}
 
+	/* Symlinks have no mode of their own to change. */
+	if (S_ISLNK(file.st.st_mode)) {
+		sip_release(&file);
+
+		response->rv = -1;
+		response->err = EOPNOTSUPP;
+		return;
+	}
+
 	/* If file is high integrity but can't be downgraded, don't proceed. */
-	int high_level = SIP_LV_HIGH == sip_path_to_level(request->pathname);
+	int high_level = SIP_LV_HIGH == sip_stat_buf_to_level(&file.st);
 	
-	if (high_level && !sip_can_downgrade_buf(&sbuf)) {
-		sip_error("Can't downgrade %s: blocking fchmodat.\n");
+	if (high_level && !sip_can_downgrade_buf(&file.st)) {
+		sip_error("Can't downgrade %s: blocking fchmodat.\n", request->pathname);
+		sip_release(&file);
 
 		response->rv = -1;
 		response->err = EACCES;
@@ -69,11 +124,12 @@ void handle_fchmodat(struct sip_request_fchmodat *request, struct sip_response *
 	}
 
 	/* If file is high integrity, downgrade before change. */
-	gid_t orig_group = sbuf.st_gid;
+	gid_t orig_group = file.st.st_gid;
 
 	if (high_level) {
-		if (lchown(request->pathname, -1, SIP_UNTRUSTED_USERID) < 0) {
-			sip_error("Couldn't lchown %s: aborting.\n", request->pathname);
+		if (fchownat(file.fd, "", -1, SIP_UNTRUSTED_USERID, AT_EMPTY_PATH) < 0) {
+			sip_error("Couldn't chown %s: aborting.\n", request->pathname);
+			sip_release(&file);
 
 			response->rv = -1;
 			response->err = EACCES;
@@ -81,14 +137,16 @@ void handle_fchmodat(struct sip_request_fchmodat *request, struct sip_response *
 		}
 	}
 
-	/* Perform operation. */
-	response->rv = fchmodat(AT_FDCWD, request->pathname, request->mode, request->flags);
+	/* Perform operation. There is no fchmod(2) for O_PATH descriptors. */
+	response->rv = chmod(file.proc, request->mode);
 	response->err = errno;
 
 	/* If failure and file was high integrity, restore original integrity label. */
 	if (response->rv == -1 && high_level) {
-		lchown(request->pathname, -1, orig_group);
+		fchownat(file.fd, "", -1, orig_group, AT_EMPTY_PATH);
 	}
+
+	sip_release(&file);
 }
 
 /**
@@ -99,10 +157,21 @@ void handle_fchmodat(struct sip_request_fchmodat *request, struct sip_response *
  */
 void handle_fchownat(struct sip_request_fchownat *request, struct sip_response *response) {
 	
-	int orig_level = sip_path_to_level(request->pathname);
+	struct sip_handle file;
+
+	if (sip_resolve(&file, request->pathname_dirfd, request->pathname,
+					(request->flags & AT_SYMLINK_NOFOLLOW) ? O_NOFOLLOW : 0) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return;
+	}
+
+	int orig_level = sip_stat_buf_to_level(&file.st);
 
 	/* If target file is benign, deny outright. */
 	if (SIP_LV_HIGH == orig_level) {
+		sip_release(&file);
+
 		response->rv = -1;
 		response->err = EACCES;
 		return;
@@ -114,13 +183,16 @@ void handle_fchownat(struct sip_request_fchownat *request, struct sip_response *
 	int glevel = sip_gid_to_level(request->group);
 
 	if (sip_level_min(olevel, glevel) != orig_level) { /* Integrity label would change! */
+		sip_release(&file);
+
 		response->rv = -1;
 		response->err = EACCES;
 		return;
 	}
 
-	response->rv = fchownat(AT_FDCWD, request->pathname, request->owner, request->group, request->flags);
+	response->rv = fchownat(file.fd, "", request->owner, request->group, AT_EMPTY_PATH);
 	response->err = errno;
+	sip_release(&file);
 }
 
 /**
@@ -131,15 +203,21 @@ void handle_fchownat(struct sip_request_fchownat *request, struct sip_response *
  */
 void handle_fstatat(struct sip_request_fstatat *request, struct sip_response *response) {
 
-	struct stat sbuf;
-
-	response->rv = fstatat(AT_FDCWD, request->pathname, &sbuf, request->flags);
-	response->err = errno;
+	struct sip_handle file;
 
-	/* If successful, we need to copy the stat buf into response->buf */
-	if (response->rv == 0) {
-		memcpy(&response->buf, &sbuf, sizeof(struct stat));
+	/* Resolving the path stats the file already. */
+	if (sip_resolve(&file, request->pathname_dirfd, request->pathname,
+					(request->flags & AT_SYMLINK_NOFOLLOW) ? O_NOFOLLOW : 0) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return;
 	}
+
+	memcpy(&response->buf, &file.st, sizeof(struct stat));
+	response->size = sizeof(struct stat);
+	response->rv = 0;
+	response->err = 0;
+	sip_release(&file);
 }
 
 /**
@@ -151,13 +229,23 @@ void handle_fstatat(struct sip_request_fstatat *request, struct sip_response *re
 void handle_statvfs(struct sip_request_statvfs *request, struct sip_response *response) {
 	
 	struct statvfs sbuf;
+	struct sip_handle file;
+
+	/* There is no statvfsat(2): resolve the path to a handle instead. */
+	if (sip_resolve(&file, request->path_dirfd, request->path, 0) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return;
+	}
 
-	response->rv = statvfs(request->path, &sbuf);
+	response->rv = fstatvfs(file.fd, &sbuf);
 	response->err = errno;
+	sip_release(&file);
 
 	/* If successful, copy buf to response->buf */
 	if (response->rv == 0) {
 		memcpy(&response->buf, &sbuf, sizeof(struct statvfs));
+		response->size = sizeof(struct statvfs);
 	}
 }
 
@@ -166,16 +254,44 @@ void handle_statvfs(struct sip_request_statvfs *request, struct sip_response *re
  *
  * Policy: Deny if oldpath is high integrity.
  */
-void handle_linkat(struct sip_request_linkat *request, struct sip_response *response) {
+int submit_linkat(struct sip_request_linkat *request, struct sip_response *response, struct sip_uring_op *op) {
 	
-	if (SIP_LV_HIGH == sip_path_to_level(request->oldpath)){
+	struct sip_handle file, dir;
+
+	if (sip_resolve(&file, request->oldpath_dirfd, request->oldpath,
+					(request->flags & AT_SYMLINK_FOLLOW) ? 0 : O_NOFOLLOW) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return 0;
+	}
+
+	if (SIP_LV_HIGH == sip_stat_buf_to_level(&file.st)){
+		sip_release(&file);
+
 		response->rv = -1;
 		response->err = EACCES;
-		return;
+		return 0;
+	}
+
+	if (sip_resolve_dir(&dir, request->newpath_dirfd, request->newpath) < 0) {
+		sip_release(&file);
+
+		response->rv = -1;
+		response->err = errno;
+		return 0;
 	}
+
+	/* Linking a descriptor with AT_EMPTY_PATH takes CAP_DAC_READ_SEARCH; its
+	   /proc link doesn't, and leads to a symlink itself too. */
+	if (sip_submit_handle(op, &file, &dir) &&
+		sip_uring_linkat(op, AT_FDCWD, file.proc, dir.fd, dir.name, AT_SYMLINK_FOLLOW) == 0)
+		return 1;
 	
-	response->rv = linkat(AT_FDCWD, request->oldpath, AT_FDCWD, request->newpath, request->flags);
+	response->rv = linkat(AT_FDCWD, file.proc, dir.fd, dir.name, AT_SYMLINK_FOLLOW);
 	response->err = errno;
+	sip_release(&dir);
+	sip_release(&file);
+	return 0;
 }
 
 /**
@@ -183,9 +299,22 @@ void handle_linkat(struct sip_request_linkat *request, struct sip_response *resp
  *
  * Policy: Carry out operation with trusted credentials and return result.
  */
-void handle_mkdirat(struct sip_request_mkdirat *request, struct sip_response *response) {
-	response->rv = mkdirat(AT_FDCWD, request->pathname, request->mode);
+int submit_mkdirat(struct sip_request_mkdirat *request, struct sip_response *response, struct sip_uring_op *op) {
+	struct sip_handle dir;
+
+	if (sip_resolve_dir(&dir, request->pathname_dirfd, request->pathname) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return 0;
+	}
+
+	if (sip_submit_handle(op, &dir, NULL) && sip_uring_mkdirat(op, dir.fd, dir.name, request->mode) == 0)
+		return 1;
+
+	response->rv = mkdirat(dir.fd, dir.name, request->mode);
 	response->err = errno;
+	sip_release(&dir);
+	return 0;
 }
 
 /**
@@ -194,8 +323,48 @@ void handle_mkdirat(struct sip_request_mkdirat *request, struct sip_response *re
  * Policy: Carry out policy with trusted credentials and return result.
  */
 void handle_mknodat(struct sip_request_mknodat *request, struct sip_response *response) {
-	response->rv = mknodat(AT_FDCWD, request->pathname, request->mode, request->dev);
+	struct sip_handle dir;
+
+	if (sip_resolve_dir(&dir, request->pathname_dirfd, request->pathname) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return;
+	}
+
+	response->rv = mknodat(dir.fd, dir.name, request->mode, request->dev);
 	response->err = errno;
+	sip_release(&dir);
+}
+
+/**
+ * Resolve the file an openat request for writing names. If it doesn't
+ * exist and O_CREAT is given, create it instead; O_EXCL makes sure that a
+ * file created in the meantime is checked rather than opened. Files are
+ * not created through a dangling symlink, since the link could be pointed
+ * at a high integrity file between the checks.
+ *
+ * @param int* created Receives the descriptor of the new file, or -1.
+ * @return 0 on success, -1 on error.
+ */
+static int sip_resolve_open(struct sip_request_openat *request, struct sip_handle *file, int *created) {
+	int tries;
+
+	*created = -1;
+
+	for (tries = 0; tries < SIP_OPEN_TRIES; tries++) {
+		if (sip_resolve(file, request->file_dirfd, request->file, request->flags & (O_NOFOLLOW | O_DIRECTORY)) == 0)
+			return 0;
+		if (errno != ENOENT || !(request->flags & O_CREAT))
+			return -1;
+
+		*created = sip_open(request->file_dirfd, request->file, request->flags | O_EXCL, request->mode);
+		if (*created >= 0 || errno != EEXIST)
+			return *created >= 0 ? 0 : -1;
+	}
+
+	sip_info("Not creating %s through a dangling symlink.\n", request->file);
+	errno = EACCES;
+	return -1;
 }
 
 /**
@@ -204,65 +373,203 @@ void handle_mknodat(struct sip_request_mknodat *request, struct sip_response *re
  * Policy: Deny requests to write high integrity files. Allow all other
  * requests.
  */
-void handle_openat(struct sip_request_openat *request, struct sip_response *response) {
+int submit_openat(struct sip_request_openat *request, struct sip_response *response, struct sip_uring_op *op) {
 	int writing = (request->flags & O_RDWR) || (request->flags & O_WRONLY);
+	int creating = (request->flags & O_CREAT) && (request->flags & O_EXCL);
+	struct sip_handle file;
+	int created;
+
+	/* Nothing to check: open the file in one go. */
+	if (!writing || creating) {
+		if (op != NULL && sip_uring_openat(op, request->file_dirfd, request->file, request->flags, request->mode,
+										   sip_names_dirfd(request->file_dirfd, request->file) ? 0 : RESOLVE_NO_MAGICLINKS) == 0)
+			return 1;
+
+		response->rv = sip_open(request->file_dirfd, request->file, request->flags, request->mode);
+		response->err = errno;
+		return 0;
+	}
+
+	if (sip_resolve_open(request, &file, &created) < 0 || created >= 0) {
+		response->rv = created;
+		response->err = errno;
+		return 0;
+	}
+
+	/* The file is reopened through the link to its handle. That link is a
+	   symlink itself, so O_NOFOLLOW is applied here. */
+	if (S_ISLNK(file.st.st_mode)) {
+		sip_release(&file);
+
+		response->rv = -1;
+		response->err = ELOOP;
+		return 0;
+	}
 
-	if (SIP_LV_HIGH == sip_path_to_level(request->file) && writing) {
+	if (SIP_LV_HIGH == sip_stat_buf_to_level(&file.st)) {
 		sip_info("High integrity file %s opened for writing. Denying.\n", request->file);
+		sip_release(&file);
 
 		response->rv = -1;
 		response->err = EACCES;
-		return;
+		return 0;
 	}
 
-	response->rv = open(request->file, request->flags, request->mode);
+	int flags = request->flags & ~(O_CREAT | O_EXCL | O_NOFOLLOW);
+
+	if (sip_submit_handle(op, &file, NULL) && sip_uring_openat(op, AT_FDCWD, file.proc, flags, 0, 0) == 0)
+		return 1;
+
+	response->rv = openat(AT_FDCWD, file.proc, flags);
 	response->err = errno;
+	sip_release(&file);
+	return 0;
 }
 
 /**
- * Handler for renameat2.
+ * Handler for renameat2. The entry oldpath names is checked, not the file
+ * a symlink there leads to, since the call moves the entry.
  *
  * Policy: Allow rename operation if the file is untrusted.
  */
-void handle_renameat2(struct sip_request_renameat2 *request, struct sip_response *response) {
-	if (SIP_LV_HIGH == sip_path_to_level(request->oldpath)) {
+int submit_renameat2(struct sip_request_renameat2 *request, struct sip_response *response, struct sip_uring_op *op) {
+	struct sip_handle dir, newdir;
+
+	if (sip_resolve_parent(&dir, request->oldpath_dirfd, request->oldpath) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return 0;
+	}
+
+	if (SIP_LV_HIGH == sip_stat_buf_to_level(&dir.st)) {
+		sip_release(&dir);
+
 		response->rv = -1;
 		response->err = EACCES;
-		return;
+		return 0;
+	}
+
+	if (sip_resolve_dir(&newdir, request->newpath_dirfd, request->newpath) < 0) {
+		sip_release(&dir);
+
+		response->rv = -1;
+		response->err = errno;
+		return 0;
 	}
 
-	response->rv = syscall(SYS_renameat2, AT_FDCWD, request->oldpath, AT_FDCWD, request->newpath, request->flags);
+	if (sip_submit_handle(op, &dir, &newdir) &&
+		sip_uring_renameat(op, dir.fd, dir.name, newdir.fd, newdir.name, request->flags) == 0)
+		return 1;
+
+	response->rv = syscall(SYS_renameat2, dir.fd, dir.name, newdir.fd, newdir.name, request->flags);
 	response->err = errno;
+	sip_release(&newdir);
+	sip_release(&dir);
+	return 0;
 }
 
 /**
- * Handler for symlinkat.
+ * Handler for symlinkat. The target is only checked, never opened, and the
+ * link will be followed by the client; linkpath is resolved as a handle.
  */
-void handle_symlinkat(struct sip_request_symlinkat *request, struct sip_response *response) {
+int submit_symlinkat(struct sip_request_symlinkat *request, struct sip_response *response, struct sip_uring_op *op) {
+	struct sip_handle dir;
+
 	// If target is high integrity, deny (prevents creating very long chains for TOCTTOU attacks)
 	if (sip_path_to_level(request->target) == SIP_LV_HIGH) {
 		response->rv = -1;
 		response->err = EACCES; // Write access is denied error
-		return;
+		return 0;
+	}
+
+	if (sip_resolve_dir(&dir, request->linkpath_dirfd, request->linkpath) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return 0;
 	}
 	// Else, allow
-	response->rv = symlinkat(request->target, AT_FDCWD, request->linkpath);
+	if (sip_submit_handle(op, &dir, NULL) && sip_uring_symlinkat(op, request->target, dir.fd, dir.name) == 0)
+		return 1;
+
+	response->rv = symlinkat(request->target, dir.fd, dir.name);
 	response->err = errno;
+	sip_release(&dir);
+	return 0;
 }
 
 /**
- * Handler for unlinkat.
+ * Handler for unlinkat. As for renameat2, the entry itself is checked.
  */
-void handle_unlinkat(struct sip_request_unlinkat *request, struct sip_response *response) {
+int submit_unlinkat(struct sip_request_unlinkat *request, struct sip_response *response, struct sip_uring_op *op) {
+	struct sip_handle dir;
+
+	if (sip_resolve_parent(&dir, request->pathname_dirfd, request->pathname) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return 0;
+	}
 	// If target is high integrity, deny
-	if (sip_path_to_level(request->pathname) == SIP_LV_HIGH) {
+	if (sip_stat_buf_to_level(&dir.st) == SIP_LV_HIGH) {
+		sip_release(&dir);
+
 		response->rv = -1;
 		response->err = EACCES; // Write access denied
-		return;
+		return 0;
 	}
 	// Otherwise, allow
-	response->rv = unlinkat(AT_FDCWD, request->pathname, request->flags);
+	if (sip_submit_handle(op, &dir, NULL) && sip_uring_unlinkat(op, dir.fd, dir.name, request->flags) == 0)
+		return 1;
+
+	response->rv = unlinkat(dir.fd, dir.name, request->flags);
 	response->err = errno;
+	sip_release(&dir);
+	return 0;
+}
+
+/* Handlers for the calls in SIP_URING_CALLS: run the call right away. */
+#define SIP_SYNC_HANDLER(name, nr, returns_fd) 											\
+	void handle_ ##name(struct sip_request_ ##name *request, struct sip_response *response) { 	\
+		submit_ ##name(request, response, NULL); 										\
+	}
+
+SIP_URING_CALLS(SIP_SYNC_HANDLER)
+
+/**
+ * Fill in the response to a call submitted by its submit_<name> handler,
+ * once the engine has run it.
+ *
+ * @param int res Result of the syscall, or a negated errno.
+ */
+void complete_call(struct sip_uring_op *op, int res, struct sip_response *response) {
+	response->rv = res < 0 ? -1 : res;
+	response->err = res < 0 ? -res : 0;
+	response->size = 0;
+
+	if (op->handles[0] >= 0)
+		close(op->handles[0]);
+	if (op->handles[1] >= 0)
+		close(op->handles[1]);
+}
+
+/**
+ * Set the times of the file dirfd/path names, through a handle; the utime
+ * handlers share this.
+ */
+static void sip_utimens(int dirfd, const char *path, const struct timespec times[2], int flags,
+						struct sip_response *response) {
+	struct sip_handle file;
+
+	if (sip_resolve(&file, dirfd, path, (flags & AT_SYMLINK_NOFOLLOW) ? O_NOFOLLOW : 0) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return;
+	}
+
+	/* There is no futimens(2) for O_PATH descriptors; the link leads to a
+	   symlink itself too. */
+	response->rv = utimensat(AT_FDCWD, file.proc, times, 0);
+	response->err = errno;
+	sip_release(&file);
 }
 
 /**
@@ -270,8 +577,12 @@ void handle_unlinkat(struct sip_request_unlinkat *request, struct sip_response *
  */
 void handle_utime(struct sip_request_utime *request, struct sip_response *response) {
 	// No private copies of files are made and this syscall will always write, so allow it
-	response->rv = utime(request->path, &request->times);
-	response->err = errno;
+	struct timespec times[2] = {
+		{ request->times.actime, 0 },
+		{ request->times.modtime, 0 }
+	};
+
+	sip_utimens(request->path_dirfd, request->path, times, 0, response);
 }
 
 /**
@@ -279,8 +590,12 @@ void handle_utime(struct sip_request_utime *request, struct sip_response *respon
  */
 void handle_utimes(struct sip_request_utimes *request, struct sip_response *response) {
 	// No private copies of files are made and this syscall will always write, so allow it
-	response->rv = utimes(request->filename, request->times);
-	response->err = errno;
+	struct timespec times[2] = {
+		{ request->times[0].tv_sec, request->times[0].tv_usec * 1000 },
+		{ request->times[1].tv_sec, request->times[1].tv_usec * 1000 }
+	};
+
+	sip_utimens(request->filename_dirfd, request->filename, times, 0, response);
 }
 
 /**
@@ -288,8 +603,7 @@ void handle_utimes(struct sip_request_utimes *request, struct sip_response *resp
  */
 void handle_utimensat(struct sip_request_utimensat *request, struct sip_response *response) {
 	// No private copies of files are made and this syscall will always write, so allow it
-	response->rv = utimensat(AT_FDCWD, request->pathname, request->times, request->flags);
-	response->err = errno;
+	sip_utimens(request->pathname_dirfd, request->pathname, request->times, request->flags, response);
 }
 
 /**
@@ -345,3 +659,280 @@ void handle_connect(struct sip_request_connect *request, struct sip_response *re
 		response->err = 0;
 	}
 }
+
+/**
+ * Handler for readdirplus. Lists up to SIP_READDIR_BATCH entries of a
+ * directory, starting at request->cookie, into a new memfd and returns it
+ * (see packets.h). Records are buffered and written in large chunks.
+ *
+ * Policy: Like fstatat, simply perform the operation with the trusted user's
+ * credentials and return the result.
+ */
+void handle_readdirplus(struct sip_request_readdirplus *request, struct sip_response *response) {
+	struct sip_readdir_result result = { 0, 0, request->cookie };
+	struct sip_dirent *rec;
+	struct dirent *entry;
+	char buf[65536] __attribute__((aligned(8)));
+	size_t used = 0, namelen, reclen;
+	int dirfd, memfd;
+	DIR *dir;
+
+	response->rv = -1;
+
+	if ((dirfd = sip_open(request->path_dirfd, request->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC, 0)) < 0) {
+		response->err = errno;
+		return;
+	}
+
+	if ((dir = fdopendir(dirfd)) == NULL) {
+		response->err = errno;
+		close(dirfd);
+		return;
+	}
+
+	if ((memfd = memfd_create("sip-readdir", MFD_CLOEXEC)) < 0) {
+		response->err = errno;
+		closedir(dir);
+		return;
+	}
+
+	if (request->cookie != 0)
+		seekdir(dir, request->cookie);
+
+	while (result.count < SIP_READDIR_BATCH) {
+		errno = 0;
+		if ((entry = readdir(dir)) == NULL) {
+			result.eof = errno == 0;
+			break;
+		}
+
+		namelen = strlen(entry->d_name) + 1;
+		reclen = (offsetof(struct sip_dirent, name) + namelen + 7) & ~7;
+
+		if (used + reclen > sizeof(buf)) {
+			if (write(memfd, buf, used) != used)
+				goto fail;
+			used = 0;
+		}
+
+		rec = (struct sip_dirent *) (buf + used);
+
+		if (fstatat(dirfd, entry->d_name, &rec->stat, AT_SYMLINK_NOFOLLOW) < 0) {
+			memset(&rec->stat, 0, sizeof(rec->stat));
+			rec->stat.st_ino = entry->d_ino;
+		}
+
+		rec->reclen = reclen;
+		rec->type = entry->d_type;
+		memcpy(rec->name, entry->d_name, namelen);
+
+		used += reclen;
+		result.count++;
+		result.cookie = telldir(dir);
+	}
+
+	if (used > 0 && write(memfd, buf, used) != used)
+		goto fail;
+
+	closedir(dir);
+
+	response->rv = memfd;
+	response->err = 0;
+	memcpy(response->buf, &result, sizeof(result));
+	response->size = sizeof(result);
+	return;
+
+fail:
+	response->err = errno ? errno : EIO;
+	closedir(dir);
+	close(memfd);
+}
+
+/**
+ * Check whether a subtree request has handled SIP_SUBTREE_MAX_NODES files.
+ * The first time, the request is marked failed, so that the client leaves
+ * the rest of the tree to the command.
+ *
+ * @return 1 if the walk must stop, otherwise 0.
+ */
+static int sip_subtree_full(struct sip_subtree_result *result, int *err) {
+	if (result->nodes + result->failed < SIP_SUBTREE_MAX_NODES)
+		return 0;
+
+	if (result->nodes + result->failed == SIP_SUBTREE_MAX_NODES) {
+		result->failed++;
+		if (*err == 0)
+			*err = E2BIG;
+	}
+	return 1;
+}
+
+/**
+ * Apply the operation of a subtree request to one file, through the handler
+ * for the corresponding single-file call so the same policy applies.
+ *
+ * @param int dirfd Directory containing the file.
+ * @param char* name Name of the file in dirfd.
+ * @param struct stat* sbuf Attributes of the file (from lstat).
+ */
+static void sip_subtree_apply(struct sip_request_subtree *request, int dirfd, const char *name,
+							  const struct stat *sbuf, struct sip_subtree_result *result, int *err) {
+	SIP_PREPARE_RES(response);
+
+	if (sip_subtree_full(result, err))
+		return;
+
+	switch (request->op) {
+		case SIP_SUBTREE_REMOVE: {
+			struct sip_request_unlinkat call = { dirfd, name, S_ISDIR(sbuf->st_mode) ? AT_REMOVEDIR : 0 };
+
+			handle_unlinkat(&call, &response);
+			break;
+		}
+		case SIP_SUBTREE_CHMOD: {
+			struct sip_request_fchmodat call = { dirfd, name, request->mode, 0 };
+
+			/* chmod(2) follows symlinks; like chmod -R, leave them alone. */
+			if (S_ISLNK(sbuf->st_mode))
+				return;
+			if (S_ISDIR(sbuf->st_mode) && (request->flags & SIP_SUBTREE_DIR_SETID))
+				call.mode |= sbuf->st_mode & (S_ISUID|S_ISGID);
+
+			handle_fchmodat(&call, &response);
+			break;
+		}
+		case SIP_SUBTREE_CHOWN: {
+			struct sip_request_fchownat call = { dirfd, name, request->owner, request->group, AT_SYMLINK_NOFOLLOW };
+
+			handle_fchownat(&call, &response);
+			break;
+		}
+	}
+
+	result->nodes++;
+
+	if (response.rv < 0) {
+		result->failed++;
+		if (*err == 0)
+			*err = response.err;
+	}
+}
+
+/**
+ * Walk the file dirfd/name for a subtree request. Directories are opened
+ * relative to their parent with O_NOFOLLOW, so the walk can't be led out of
+ * the tree by a symlink swapped in while it runs.
+ */
+static void sip_subtree_walk(struct sip_request_subtree *request, int dirfd, const char *name, int depth,
+							 struct sip_subtree_result *result, int *err) {
+	struct dirent *entry;
+	struct stat sbuf;
+	int fd;
+	DIR *dir;
+
+	if (sip_subtree_full(result, err))
+		return;
+
+	if (fstatat(dirfd, name, &sbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+		result->failed++;
+		if (*err == 0)
+			*err = errno;
+		return;
+	}
+
+	/* Directories are changed before their contents, and removed after. */
+	if (request->op != SIP_SUBTREE_REMOVE || !S_ISDIR(sbuf.st_mode))
+		sip_subtree_apply(request, dirfd, name, &sbuf, result, err);
+	if (!S_ISDIR(sbuf.st_mode))
+		return;
+
+	if (depth == SIP_SUBTREE_MAX_DEPTH ||
+		(fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+		result->failed++;
+		if (*err == 0)
+			*err = depth == SIP_SUBTREE_MAX_DEPTH ? ELOOP : errno;
+		return;
+	}
+
+	if ((dir = fdopendir(fd)) == NULL) {
+		result->failed++;
+		if (*err == 0)
+			*err = errno;
+		close(fd);
+		return;
+	}
+
+	while (!sip_subtree_full(result, err) && (entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+			sip_subtree_walk(request, fd, entry->d_name, depth + 1, result, err);
+	}
+
+	closedir(dir);
+
+	if (request->op == SIP_SUBTREE_REMOVE)
+		sip_subtree_apply(request, dirfd, name, &sbuf, result, err);
+}
+
+/**
+ * Handler for subtree. Runs rm -r, chmod -R or chown -R on a tree in one
+ * request (see packets.h) and returns a summary. The tree is walked from
+ * its parent directory, resolved once, so the checks on the root hold for
+ * the walk.
+ *
+ * Policy: Each file is handled as a delegated unlinkat, fchmodat or fchownat
+ * on it would be. "/" and top-level directories are refused.
+ */
+void handle_subtree(struct sip_request_subtree *request, struct sip_response *response) {
+	struct sip_subtree_result result = { 0, 0 };
+	char name[NAME_MAX + 1], parent_path[PATH_MAX];
+	struct sip_handle parent;
+	size_t len;
+	int err = 0;
+
+	if (request->op < SIP_SUBTREE_REMOVE || request->op > SIP_SUBTREE_CHOWN) {
+		response->rv = -1;
+		response->err = EINVAL;
+		return;
+	}
+
+	if (sip_resolve_parent(&parent, request->path_dirfd, request->path) < 0) {
+		response->rv = -1;
+		response->err = errno;
+		return;
+	}
+
+	/* The root itself, not what a symlink there leads to. */
+	for (len = 0; parent.name[len] != '\0' && parent.name[len] != '/'; len++)
+		;
+
+	if (!S_ISDIR(parent.st.st_mode) || len == 0 || len > NAME_MAX) {
+		err = S_ISDIR(parent.st.st_mode) ? EPERM : ENOTDIR;
+	} else {
+		memcpy(name, parent.name, len);
+		name[len] = '\0';
+
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+			sip_fd_to_path_r(parent.fd, parent_path) == NULL || strcmp(parent_path, "/") == 0)
+			err = EPERM;
+	}
+
+	if (err) {
+		sip_info("Refusing subtree operation %d on %s.\n", request->op, request->path);
+		sip_release(&parent);
+
+		response->rv = -1;
+		response->err = err;
+		return;
+	}
+
+	sip_subtree_walk(request, parent.fd, name, 0, &result, &err);
+	sip_release(&parent);
+
+	sip_info("Subtree operation %d on %s: %lu files, %lu failed.\n", request->op, request->path,
+			 result.nodes, result.failed);
+
+	response->rv = result.failed ? -1 : 0;
+	response->err = err;
+	memcpy(response->buf, &result, sizeof(result));
+	response->size = sizeof(result);
+}
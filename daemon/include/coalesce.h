@@ -0,0 +1,17 @@
+#ifndef _SIP_COALESCE_H
+#define _SIP_COALESCE_H
+
+#include <stddef.h>
+#include "packets.h"
+
+#define SIP_COALESCE_SLOTS 64 						/* calls shared at once */
+#define SIP_COALESCE_WINDOW_NS (2 * 1000000L) 	/* results reused for 2ms */
+
+struct sip_flight;
+
+int sip_coalesce_begin(unsigned short callno, const char *fields, size_t size,
+					   struct sip_response *response, struct sip_flight **flight);
+void sip_coalesce_end(struct sip_flight *flight, const struct sip_response *response);
+void sip_coalesce_write();
+
+#endif
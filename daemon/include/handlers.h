@@ -2,24 +2,32 @@
 #define _SIP_HANDLER_H
 
 #include "packets.h"
+#include "uring.h"
 
-void handle_delegatortest(struct sip_request_test *request, struct sip_response *response);
-void handle_faccessat(struct sip_request_faccessat *request, struct sip_response *response);
-void handle_fchmodat(struct sip_request_fchmodat *request, struct sip_response *response);
-void handle_fchownat(struct sip_request_fchownat *request, struct sip_response *response);
-void handle_fstatat(struct sip_request_fstatat *request, struct sip_response *response);
-void handle_statvfs(struct sip_request_statvfs *request, struct sip_response *response);
-void handle_linkat(struct sip_request_linkat *request, struct sip_response *response);
-void handle_mkdirat(struct sip_request_mkdirat *request, struct sip_response *response);
-void handle_mknodat(struct sip_request_mknodat *request, struct sip_response *response);
-void handle_openat(struct sip_request_openat *request, struct sip_response *response);
-void handle_renameat2(struct sip_request_renameat2 *request, struct sip_response *response);
-void handle_symlinkat(struct sip_request_symlinkat *request, struct sip_response *response);
-void handle_unlinkat(struct sip_request_unlinkat *request, struct sip_response *response);
-void handle_utime(struct sip_request_utime *request, struct sip_response *response);
-void handle_utimes(struct sip_request_utimes *request, struct sip_response *response);
-void handle_utimensat(struct sip_request_utimensat *request, struct sip_response *response);
-void handle_bind(struct sip_request_bind *request, struct sip_response *response);
-void handle_connect(struct sip_request_connect *request, struct sip_response *response);
+/* void handle_<name>(struct sip_request_<name> *request, struct sip_response *response); */
+#define SIP_HANDLER_PROTO(name, nr, returns_fd) \
+	void handle_ ##name(struct sip_request_ ##name *request, struct sip_response *response);
+
+SIP_DELEGATED_CALLS(SIP_HANDLER_PROTO)
+
+/* Calls the io_uring engine can run (see uring.c). Their handlers resolve
+   the paths and enforce policy in submit_<name> on the calling thread, which
+   then submits the call to the engine if op is given and returns 1, or else
+   runs it and returns 0. A submitted call is finished with complete_call(). */
+#define SIP_URING_CALLS(X) \
+	X(linkat, SYS_linkat, 0) \
+	X(mkdirat, SYS_mkdirat, 0) \
+	X(openat, SYS_openat, 1) \
+	X(renameat2, SYS_renameat2, 0) \
+	X(symlinkat, SYS_symlinkat, 0) \
+	X(unlinkat, SYS_unlinkat, 0)
+
+/* int submit_<name>(struct sip_request_<name> *request, struct sip_response *response, struct sip_uring_op *op); */
+#define SIP_SUBMIT_PROTO(name, nr, returns_fd) \
+	int submit_ ##name(struct sip_request_ ##name *request, struct sip_response *response, struct sip_uring_op *op);
+
+SIP_URING_CALLS(SIP_SUBMIT_PROTO)
+
+void complete_call(struct sip_uring_op *op, int res, struct sip_response *response);
 
 #endif
@@ -0,0 +1,26 @@
+#ifndef _SIP_RESOLVE_H
+#define _SIP_RESOLVE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define SIP_PROC_FD_SZ 32 		/* fits "/proc/self/fd/<fd>" */
+
+/* A file named by a request, resolved once. Handlers check the file and
+   make the call through fd, so both see the same file. */
+struct sip_handle {
+	int fd; 					/* O_PATH descriptor */
+	int owned; 					/* fd was opened here; see sip_release() */
+	const char *name; 			/* sip_resolve_dir(): the entry in fd */
+	struct stat st; 			/* the file, or the entry (not followed) */
+	char proc[SIP_PROC_FD_SZ]; 	/* link to fd, for calls without AT_EMPTY_PATH */
+};
+
+int sip_names_dirfd(int dirfd, const char *path);
+int sip_open(int dirfd, const char *path, int flags, mode_t mode);
+int sip_resolve(struct sip_handle *handle, int dirfd, const char *path, int flags);
+int sip_resolve_dir(struct sip_handle *handle, int dirfd, const char *path);
+int sip_resolve_parent(struct sip_handle *handle, int dirfd, const char *path);
+void sip_release(struct sip_handle *handle);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _SIP_URING_H
+#define _SIP_URING_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define SIP_URING_ENTRIES 256 		/* max. operations in flight */
+
+/* An operation in flight. done() is called on the completion thread with
+   the result of the syscall (a negated errno on failure). */
+struct sip_uring_op {
+	void (*done)(struct sip_uring_op *op, int res);
+	int handles[2]; 				/* descriptors the call goes through, or -1; see complete_call() */
+};
+
+int sip_uring_start();
+
+/* Each returns 0 if the operation was submitted, or -1 if the engine can't
+   take it; the caller then makes the syscall itself. Paths only need to
+   stay valid until the function returns, descriptors until done(). */
+int sip_uring_openat(struct sip_uring_op *op, int dirfd, const char *path, int flags, mode_t mode,
+					 unsigned long long resolve);
+int sip_uring_unlinkat(struct sip_uring_op *op, int dirfd, const char *path, int flags);
+int sip_uring_renameat(struct sip_uring_op *op, int olddirfd, const char *oldpath,
+					   int newdirfd, const char *newpath, unsigned int flags);
+int sip_uring_mkdirat(struct sip_uring_op *op, int dirfd, const char *path, mode_t mode);
+int sip_uring_symlinkat(struct sip_uring_op *op, const char *target, int dirfd, const char *linkpath);
+int sip_uring_linkat(struct sip_uring_op *op, int olddirfd, const char *oldpath,
+					 int newdirfd, const char *newpath, int flags);
+
+#endif
@@ -0,0 +1,166 @@
+/**
+ * Path resolution for the handlers.
+ *
+ * A handler that checks a file and then makes a call on its path resolves
+ * the path twice. In between, a client can swap a component of the path,
+ * e.g. rename a high integrity file over the low one that was checked.
+ * Handlers instead resolve the path once to an O_PATH descriptor, and make
+ * both the checks and the call through it.
+ *
+ * Paths are resolved with openat2(2) and RESOLVE_NO_MAGICLINKS where the
+ * kernel has it. The links in /proc/self/fd lead to the daemon's own
+ * descriptors, which a client must not reach. The exception is the link
+ * sip_get_path() makes for a descriptor that came with the request.
+ */
+
+#define _GNU_SOURCE
+
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "resolve.h"
+
+static int have_openat2 = 1; 	/* cleared if the kernel lacks openat2(2) */
+
+/**
+ * Determine whether a path is the /proc link to dirfd itself, which is how
+ * sip_get_path() passes a descriptor that came with a request.
+ */
+int sip_names_dirfd(int dirfd, const char *path) {
+	char proc[SIP_PROC_FD_SZ];
+
+	if (dirfd < 0 || strncmp(path, "/proc/self/fd/", 14) != 0)
+		return 0;
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirfd);
+	return strcmp(path, proc) == 0;
+}
+
+/**
+ * openat(2) that doesn't follow magic links, except to a descriptor that
+ * came with the request (see sip_names_dirfd()).
+ *
+ * @return A new descriptor, or -1 on error.
+ */
+int sip_open(int dirfd, const char *path, int flags, mode_t mode) {
+	struct open_how how;
+	int fd;
+
+	if (sip_names_dirfd(dirfd, path))
+		return openat(AT_FDCWD, path, flags, mode);
+
+	if (__atomic_load_n(&have_openat2, __ATOMIC_RELAXED)) {
+		memset(&how, 0, sizeof(how));
+		how.flags = flags;
+		how.mode = ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) ? (mode & 07777) : 0;
+		how.resolve = RESOLVE_NO_MAGICLINKS;
+
+		if ((fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how))) >= 0 || errno != ENOSYS)
+			return fd;
+
+		__atomic_store_n(&have_openat2, 0, __ATOMIC_RELAXED);
+	}
+
+	return openat(dirfd, path, flags, mode);
+}
+
+/**
+ * Resolve the file dirfd/path names, and stat it.
+ *
+ * @param int flags O_NOFOLLOW to resolve a symlink itself, O_DIRECTORY to
+ *                  require a directory.
+ * @return 0 on success, -1 on error.
+ */
+int sip_resolve(struct sip_handle *handle, int dirfd, const char *path, int flags) {
+	handle->name = NULL;
+	handle->owned = !sip_names_dirfd(dirfd, path);
+
+	if (!handle->owned)
+		handle->fd = dirfd;
+	else if ((handle->fd = sip_open(dirfd, path, O_PATH | O_CLOEXEC | flags, 0)) < 0)
+		return -1;
+
+	if (fstat(handle->fd, &handle->st) < 0) {
+		sip_release(handle);
+		return -1;
+	}
+
+	snprintf(handle->proc, SIP_PROC_FD_SZ, "/proc/self/fd/%d", handle->fd);
+	return 0;
+}
+
+/**
+ * Resolve the directory that holds the entry dirfd/path names, for calls
+ * that create the entry (mkdirat, symlinkat, the new path of linkat). The
+ * entry itself is left alone: handle->name is relative to handle->fd.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int sip_resolve_dir(struct sip_handle *handle, int dirfd, const char *path) {
+	const char *end = path + strlen(path);
+	char dir[PATH_MAX];
+	size_t len;
+
+	/* The last component keeps its trailing slashes, as in the call. */
+	while (end > path && end[-1] == '/')
+		end--;
+	for (handle->name = end; handle->name > path && handle->name[-1] != '/'; handle->name--)
+		;
+
+	len = handle->name - path;
+	handle->owned = len > 0;
+	handle->proc[0] = '\0';
+
+	if (!handle->owned) {
+		handle->fd = dirfd;
+		return 0;
+	}
+
+	if (len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+
+	handle->fd = sip_open(dirfd, dir, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+	return handle->fd < 0 ? -1 : 0;
+}
+
+/**
+ * Resolve the directory that holds the entry dirfd/path names, for calls
+ * that act on the entry rather than on a file (unlinkat, renameat2). The
+ * entry is stat'ed without following it.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int sip_resolve_parent(struct sip_handle *handle, int dirfd, const char *path) {
+	if (sip_resolve_dir(handle, dirfd, path) < 0)
+		return -1;
+
+	if (fstatat(handle->fd, handle->name, &handle->st, AT_SYMLINK_NOFOLLOW) < 0) {
+		sip_release(handle);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Close the descriptor of a handle if it was opened for it.
+ */
+void sip_release(struct sip_handle *handle) {
+	int err = errno;
+
+	if (handle->owned)
+		close(handle->fd);
+
+	errno = err;
+}
@@ -10,165 +10,1613 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 
 #include "common.h"   // Generated from template
 #include "logger.h"   // Logging
 #include "handlers.h" // Syscall handlers
 #include "packets.h"  // Packet structs
-#include "util.h"     // sip_send_fd
+#include "util.h"     // sip_send_fds
+#include "ring.h"     // Shared-memory transport
+#include "coalesce.h" // Sharing of read-only calls
+#include "resolve.h"  // Path resolution for handlers
 
 #define DAEMON_MAX_CONNECTION 1000
+#define DAEMON_CONN_WORKERS 8 	/* max. threads serving one ring connection */
+#define DAEMON_MIN_WORKERS 4 	/* pool threads, at least */
+#define DAEMON_CONN_BATCH 16 	/* requests served before other connections get a turn */
+#define DAEMON_EPOLL_EVENTS 64 	/* events taken per epoll_wait */
+#define DAEMON_MAX_UNSENT 256 	/* responses held for a client that doesn't read; see send_response() */
+#define DAEMON_WATCH_BITS 8192 	/* per window of a connection; see watch_path() */
+#define DAEMON_WATCH_NS (2 * SIP_RESULT_TTL_NS) 	/* length of a window */
 
 static int exit_flag = 0;
 
+/* States of a connection. */
+#define CONN_NEW 0 			/* waiting for the handshake */
+#define CONN_HANDSHAKE 1 	/* a pool thread is answering the handshake */
+#define CONN_OPEN 2 		/* served by the pool */
+#define CONN_HANDOFF 3 		/* to be served by threads of its own once no pool thread uses it */
+#define CONN_RINGS 4 		/* served by threads of its own */
+#define CONN_CLOSED 5 		/* hung up; released once no pool thread uses it */
+
+/* State shared by the threads serving one connection. */
+struct sip_connection {
+	int fd;
+	int state; 					/* CONN_* */
+	int queued; 				/* in a run queue */
+	int refs; 					/* pool threads using the connection */
+	int home; 					/* run queue the connection's events go to */
+	struct sip_connection *ready; 	/* in a run queue or the released list */
+	struct sip_rings *rings; 	/* NULL when using the socket */
+	unsigned int sq_head; 		/* our copies of the ring counters we own */
+	unsigned int cq_tail;
+	pthread_mutex_t lock; 		/* protects the fields above, the counters below */
+	pthread_mutex_t recv_lock; 	/* one thread takes requests off the ring at a time */
+	pthread_mutex_t send_lock; 	/* keeps responses and their descriptors in order */
+	struct sip_unsent *unsent; 	/* responses the client isn't ready for; under send_lock */
+	struct sip_unsent **unsent_tail;
+	int nunsent; 				/* also read without the lock */
+	int workers; 				/* threads serving the connection */
+	int idle; 					/* of which waiting for a request */
+	int notify; 				/* client asked for notices */
+	unsigned int notices; 		/* notices meant for the client so far */
+	struct sip_connection *next; 	/* in the list of clients to notify */
+	struct sip_watch {
+		long window; 			/* DAEMON_WATCH_NS since boot */
+		unsigned long bits[DAEMON_WATCH_BITS / (8 * sizeof(long))];
+	} watch[2]; 				/* paths the client may have results for */
+};
+
+/* A response held until the client's socket has room for it. */
+struct sip_unsent {
+	struct sip_unsent *next;
+	int fds[SIP_MAX_FDS]; 			/* copies of the descriptors it returns */
+	struct sip_response response; 	/* only SIP_RESPONSE_SIZE() bytes are allocated */
+};
+
+/* Run queue of a pool thread. */
+struct sip_worker {
+	pthread_mutex_t lock; 		/* protects the queue */
+	struct sip_connection *head, *tail;
+	int length; 				/* also read without the lock */
+};
+
+/* Socket connections are watched by the main thread with epoll, which
+   queues the ones with requests for the pool. Every pool thread has a run
+   queue; a thread with nothing to do steals from the others, so that cheap
+   requests don't wait behind a slow call. The pool lock protects the
+   released list and lets idle threads sleep. Released connections are
+   freed by the main thread between two epoll_waits, after which no event
+   can refer to them any more. */
+static int epfd = -1;
+static struct sip_worker *pool;
+static int pool_size;
+static int sleepers; 		/* idle pool threads */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct sip_connection *released;
+
+/* Clients that asked for notices. The lock also serializes notices. */
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sip_connection *clients;
+
+/* Whether calls in SIP_URING_CALLS go to the io_uring engine (see uring.c). */
+static int uring_running = 0;
+
+#define SIP_ASYNC_REQUEST(name, nr, returns_fd) struct sip_request_ ##name name;
+
+/* A call running on the io_uring engine, with everything it needs until it
+   completes. */
+struct sip_async {
+	struct sip_uring_op op; 		/* must come first */
+	struct sip_connection *conn; 	/* holds a pool reference */
+	unsigned short callno;
+	union {
+		SIP_URING_CALLS(SIP_ASYNC_REQUEST)
+	} request;
+	struct sip_response response;
+	int fds[SIP_MAX_FDS]; 			/* received with the request */
+	int nfds;
+	char proc[SIP_MAX_FDS][SIP_PROC_FD_SZ];
+	char packet[SIP_MAX_PACKET]; 	/* the request's strings point in here */
+};
+
+static void close_connection(struct sip_connection *conn);
+static void put_connection(struct sip_connection *conn);
+
+static void close_fds(int *fds, int nfds) {
+	int i;
+
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+}
+
+/**
+ * Read a string field from a request (see packets.h).
+ *
+ * @param char** pos Position of the field; advanced past it on success.
+ * @param char* end End of the packet.
+ * @return The string, or NULL if the field is malformed.
+ */
+static const char *sip_get_str(char **pos, char *end) {
+	unsigned short len;
+	char *str = *pos + sizeof(len);
+
+	if (end - *pos < sizeof(len))
+		return NULL;
+
+	memcpy(&len, *pos, sizeof(len));
+
+	/* Length must cover exactly one terminating NUL. */
+	if (len == 0 || len > PATH_MAX || end - str < len || memchr(str, '\0', len) != str + len - 1)
+		return NULL;
+
+	*pos = str + len;
+	return str;
+}
+
+/**
+ * Read a PATH field from a request (see packets.h).
+ *
+ * @param int* fds, int nfds Descriptors the path may refer to (-1 for
+ *                           unused slots).
+ * @param int* dirfd Receives the descriptor the path is relative to.
+ * @param char* proc Buffer of SIP_PROC_FD_SZ bytes, used if the path refers
+ *                   to a descriptor itself.
+ * @return The path, or NULL if the field is malformed.
+ */
+static const char *sip_get_path(char **pos, char *end, const int *fds, int nfds, int *dirfd, char *proc) {
+	signed char index;
+	const char *path;
+
+	if (end - *pos < sizeof(index))
+		return NULL;
+
+	index = **pos;
+	*pos += sizeof(index);
+
+	if ((path = sip_get_str(pos, end)) == NULL)
+		return NULL;
+
+	/* No descriptor: the path must be absolute, or it would be resolved
+	   against our own working directory. */
+	if (index < 0) {
+		*dirfd = AT_FDCWD;
+		return index == -1 && path[0] == '/' ? path : NULL;
+	}
+
+	if (index >= nfds || fds[index] < 0)
+		return NULL;
+
+	/* The descriptor's own file. Its /proc link works with every handler,
+	   including those whose calls have no AT_EMPTY_PATH. The descriptor is
+	   kept as dirfd, which the link overrides, so that handlers can use it
+	   directly (see sip_names_dirfd()). */
+	if (path[0] == '\0') {
+		snprintf(proc, SIP_PROC_FD_SZ, "/proc/self/fd/%d", fds[index]);
+		*dirfd = fds[index];
+		return proc;
+	}
+
+	*dirfd = fds[index];
+	return path;
+}
+
+/**
+ * Read a fixed-size field from a request.
+ *
+ * @return 0 on success, -1 if the packet is too short.
+ */
+static int sip_get_val(char **pos, char *end, void *dest, size_t size) {
+	if (end - *pos < size)
+		return -1;
+
+	memcpy(dest, *pos, size);
+	*pos += size;
+	return 0;
+}
+
+/* Current window for watch_path(). */
+static long watch_window() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (ts.tv_sec * 1000000000L + ts.tv_nsec) / DAEMON_WATCH_NS;
+}
+
+/* FNV-1a, continued from hash. */
+static unsigned long watch_hash(unsigned long hash, const char *str, size_t len) {
+	while (len-- > 0)
+		hash = (hash ^ (unsigned char) *str++) * 0x100000001b3UL;
+	return hash;
+}
+
+#define WATCH_HASH_INIT 0xcbf29ce484222325UL
+#define WATCH_BIT(hash) ((hash) & (DAEMON_WATCH_BITS - 1))
+#define WATCH_WORD(hash) (WATCH_BIT(hash) / (8 * sizeof(long)))
+#define WATCH_MASK(hash) (1UL << (WATCH_BIT(hash) % (8 * sizeof(long))))
+
+/**
+ * Note that a client read an absolute path with a call in
+ * SIP_CALL_SHAREABLE, and may keep the result for SIP_RESULT_TTL_NS: a
+ * notice for the path or a directory above it is meant for the client (see
+ * packets.h). The path and its directories are set in a bitmap per window
+ * of DAEMON_WATCH_NS. A result is kept into the next window at most, so
+ * the current and the previous window are checked; the one before is
+ * cleared for reuse.
+ */
+static void watch_path(struct sip_connection *conn, const char *path) {
+	long window = watch_window();
+	struct sip_watch *watch = &conn->watch[window & 1];
+	unsigned long hash = WATCH_HASH_INIT;
+	const char *start = path, *slash;
+
+	if (__atomic_load_n(&watch->window, __ATOMIC_ACQUIRE) != window) {
+		pthread_mutex_lock(&conn->lock);
+		if (watch->window != window) {
+			memset(watch->bits, 0, sizeof(watch->bits));
+			__atomic_store_n(&watch->window, window, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&conn->lock);
+	}
+
+	/* "/a/b" sets "/a" and "/a/b". */
+	while (*start != '\0') {
+		slash = strchrnul(start + 1, '/');
+		hash = watch_hash(hash, start, slash - start);
+		__atomic_or_fetch(&watch->bits[WATCH_WORD(hash)], WATCH_MASK(hash), __ATOMIC_SEQ_CST);
+		start = slash;
+	}
+}
+
+/**
+ * Determine whether a notice for a path is meant for a client.
+ *
+ * @param long window Current window.
+ * @param unsigned long hash watch_hash() of the path.
+ */
+static int watches_path(struct sip_connection *conn, long window, unsigned long hash) {
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct sip_watch *watch = &conn->watch[i];
+		long held = __atomic_load_n(&watch->window, __ATOMIC_ACQUIRE);
+
+		if ((held == window || held == window - 1) &&
+			(__atomic_load_n(&watch->bits[WATCH_WORD(hash)], __ATOMIC_SEQ_CST) & WATCH_MASK(hash)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Send a notice to the clients it is meant for (see packets.h). The sends
+ * don't block: a client that doesn't keep up misses the notice and finds
+ * out from the count in the next message it gets. Most notices are meant
+ * for few clients or none, so few sends are made under the lock.
+ *
+ * @param char* path Absolute path of the file that changed, or NULL if
+ *                   anything may have changed; the latter goes to every
+ *                   client.
+ */
+static void notice_all(const char *path) {
+	struct sip_response notice;
+	struct sip_connection *conn;
+	size_t len = path != NULL ? strlen(path) + 1 : 0;
+	unsigned long hash = path != NULL ? watch_hash(WATCH_HASH_INIT, path, len - 1) : 0;
+	long window = watch_window();
+
+	notice.rv = 0;
+	notice.err = 0;
+	notice.id = SIP_NOTICE_ID;
+	notice.nfds = 0;
+	notice.size = len <= SIP_DATA_SZ ? len : 0;
+	memcpy(notice.buf, path, notice.size);
+
+	pthread_mutex_lock(&clients_lock);
+
+	for (conn = clients; conn != NULL; conn = conn->next) {
+		if (path != NULL && !watches_path(conn, window, hash))
+			continue;
+
+		notice.notices = __atomic_add_fetch(&conn->notices, 1, __ATOMIC_SEQ_CST);
+		send(conn->fd, &notice, SIP_RESPONSE_SIZE(&notice), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+
+	pthread_mutex_unlock(&clients_lock);
+}
+
+/**
+ * Send notices for a file a call may have changed. Only the directory part
+ * of the path is resolved, since the file itself may be gone or be a
+ * symlink; clients compare paths in that form.
+ */
+static void notice_path(int dirfd, const char *path) {
+	char abspath[PATH_MAX], dir[PATH_MAX], resolved[PATH_MAX];
+	char *base;
+
+	if (__atomic_load_n(&clients, __ATOMIC_RELAXED) == NULL)
+		return;
+
+	/* The descriptor sent with the request itself (see sip_get_path). */
+	if (sip_names_dirfd(dirfd, path)) {
+		notice_all(sip_fd_to_path_r(dirfd, resolved));
+		return;
+	}
+
+	if (path[0] == '/') {
+		if (snprintf(abspath, PATH_MAX, "%s", path) >= PATH_MAX) {
+			notice_all(NULL);
+			return;
+		}
+	} else if (sip_fd_to_path_r(dirfd, dir) == NULL ||
+			   snprintf(abspath, PATH_MAX, "%s/%s", dir, path) >= PATH_MAX) {
+		notice_all(NULL);
+		return;
+	}
+
+	base = strrchr(abspath, '/');
+	*base++ = '\0';
+
+	if (strcmp(base, "") == 0 || strcmp(base, ".") == 0 || strcmp(base, "..") == 0 ||
+		realpath(abspath[0] ? abspath : "/", dir) == NULL ||
+		snprintf(resolved, PATH_MAX, "%s/%s", strcmp(dir, "/") ? dir : "", base) >= PATH_MAX) {
+		notice_all(NULL);
+		return;
+	}
+
+	notice_all(resolved);
+}
+
+/* Whether a call may have changed the files named by its PATH fields. */
+static int call_changed_files(unsigned short callno, const void *request, const struct sip_response *response) {
+	/* A subtree operation may fail after it changed some of the files. */
+	if (response->rv < 0 && callno != SYS_subtree)
+		return 0;
+
+	switch (callno) {
+		case SYS_delegatortest:
+		case SYS_faccessat:
+		case SYS_fstatat:
+		case SYS_statvfs:
+		case SYS_readdirplus:
+			return 0;
+		case SYS_openat:
+			return (((const struct sip_request_openat *) request)->flags & (O_CREAT|O_TRUNC)) != 0;
+		case SYS_subtree:
+			return response->rv >= 0 || response->size < sizeof(struct sip_subtree_result) ||
+				   ((const struct sip_subtree_result *) response->buf)->nodes > 0;
+		default:
+			return 1;
+	}
+}
+
+#define SIP_NOTICE(kind, type, field) SIP_NOTICE_ ##kind(type, field)
+#define SIP_NOTICE_PATH(type, field) notice_path(request.field ##_dirfd, request.field);
+#define SIP_NOTICE_STR(type, field)
+#define SIP_NOTICE_VAL(type, field)
+#define SIP_NOTICE_PAIR(type, field)
+
+/* Decode the fields of a request into its struct. */
+#define SIP_GET(kind, type, field) SIP_GET_ ##kind(type, field)
+#define SIP_GET_PATH(type, field) 										\
+	if ((request.field = sip_get_path(&pos, end, fds, nfds, 			\
+			&request.field ##_dirfd, proc[paths++])) == NULL) 			\
+		goto malformed;
+#define SIP_GET_STR(type, field) 											\
+	if ((request.field = sip_get_str(&pos, end)) == NULL) 				\
+		goto malformed;
+#define SIP_GET_VAL(type, field) 											\
+	if (sip_get_val(&pos, end, &request.field, sizeof(request.field))) 	\
+		goto malformed;
+#define SIP_GET_PAIR(type, field) SIP_GET_VAL(type, field)
+
+/**
+ * Decode the fields of a call and run its handler. Clients are sent
+ * notices for the files the call may have changed.
+ *
+ * @param char** pos Start of the fields; receives the position after them.
+ * @param char* end End of the packet.
+ * @param int last The fields must extend to the end of the packet.
+ * @param int* fds, int nfds Descriptors PATH fields may refer to.
+ * @param int* respfd Receives the descriptor the call returns, or -1.
+ * @return 0 if the handler ran, otherwise the error to report: ENOSYS for
+ *         an unknown call and EINVAL for malformed fields.
+ */
+static int run_call(unsigned short callno, char **posp, char *end, int last, const int *fds, int nfds,
+					struct sip_response *response, int *respfd) {
+	char proc[SIP_MAX_FDS][SIP_PROC_FD_SZ];
+	char *pos = *posp;
+	int paths = 0;
+
+	*respfd = -1;
+	response->size = 0;
+
+	switch (callno) {
+#define SIP_DISPATCH(name, nr, returns_fd) 					\
+		case nr: { 											\
+			struct sip_request_ ##name request; 			\
+															\
+			SIP_FIELDS_ ##name(SIP_GET) 					\
+			if (last && pos != end) 						\
+				goto malformed; 							\
+			*posp = pos; 									\
+			errno = 0; 										\
+			handle_ ##name(&request, response); 			\
+			if (call_changed_files(nr, &request, response)) { 	\
+				SIP_FIELDS_ ##name(SIP_NOTICE) 				\
+			} 												\
+			if (returns_fd && response->rv >= 0) 			\
+				*respfd = response->rv; 					\
+			return 0; 										\
+		}
+
+		SIP_DELEGATED_CALLS(SIP_DISPATCH)
+#undef SIP_DISPATCH
+
+		default:
+			sip_error("Unhandled delegated syscall: %d\n", callno);
+			return ENOSYS;
+	}
+
+malformed:
+	sip_error("Malformed request for call %d.\n", callno);
+	return EINVAL;
+}
+
+/**
+ * Run a compound request (see packets.h). Each step goes through the
+ * handler of its call, so policy is enforced per step. Descriptors returned
+ * by steps are attached to the response.
+ *
+ * @param int* fds, int nfds Descriptors received with the request.
+ * @param int* respfds Receives the descriptors to return.
+ */
+static void run_compound(char *pos, char *end, const int *fds, int nfds,
+						 struct sip_response *response, int *respfds) {
+	struct sip_compound_result *result = (struct sip_compound_result *) response->buf;
+	struct sip_response step_response;
+	struct sip_step step;
+	int avail[SIP_MAX_FDS + SIP_MAX_STEPS];
+	unsigned int datasize = 0;
+	int count, i, fd, err = 0;
+
+	for (i = 0; i < SIP_MAX_FDS + SIP_MAX_STEPS; i++)
+		avail[i] = i < nfds ? fds[i] : -1;
+
+	response->rv = 0;
+	response->err = 0;
+	result->steps = 0;
+
+	count = pos < end ? (unsigned char) *pos++ : 0;
+
+	if (count == 0 || count > SIP_MAX_STEPS)
+		err = EINVAL;
+
+	for (i = 0; i < count && err == 0; i++) {
+		if (sip_get_val(&pos, end, &step, sizeof(step)) || step.callno == SYS_compound) {
+			err = EINVAL;
+			break;
+		}
+
+		if ((err = run_call(step.callno, &pos, end, i == count - 1, avail, SIP_MAX_FDS + i, &step_response, &fd)))
+			break;
+
+		/* Later steps can use the descriptor; the client gets it too. */
+		if (fd >= 0) {
+			if (response->nfds == SIP_MAX_FDS) {
+				close(fd);
+				err = EINVAL;
+				break;
+			}
+			avail[SIP_MAX_FDS + i] = fd;
+			respfds[response->nfds] = fd;
+			step_response.rv = response->nfds++;
+		}
+
+		result->rv[i] = step_response.rv;
+		result->steps = i + 1;
+
+		if (step_response.size > 0) {
+			memcpy(&result->data, step_response.buf, step_response.size);
+			datasize = step_response.size;
+		}
+
+		if (step_response.rv < 0 && !(step.flags & SIP_STEP_EXIST_OK && step_response.err == EEXIST)) {
+			response->rv = -1;
+			response->err = step_response.err;
+			break;
+		}
+	}
+
+	if (err) {
+		response->rv = -1;
+		response->err = err;
+	}
+
+	response->size = offsetof(struct sip_compound_result, data) + datasize;
+}
+
+/**
+ * Run a call in SIP_CALL_SHAREABLE, whose request refers to no descriptors.
+ * Identical requests from any client may share the result (see coalesce.c).
+ * The client may keep the result: the path it read is watched for notices
+ * first, so that a change made after the call ran is never missed.
+ */
+static void run_shared(struct sip_connection *conn, unsigned short callno, char *pos, char *end,
+					   struct sip_response *response) {
+	char proc[SIP_PROC_FD_SZ], *field = pos;
+	struct sip_flight *flight;
+	const char *path;
+	int respfd, err, dirfd;
+
+	if (conn->notify && (path = sip_get_path(&field, end, NULL, 0, &dirfd, proc)) != NULL)
+		watch_path(conn, path);
+
+	if (sip_coalesce_begin(callno, pos, end - pos, response, &flight))
+		return;
+
+	if ((err = run_call(callno, &pos, end, 1, NULL, 0, response, &respfd))) {
+		response->rv = -1;
+		response->err = err;
+	}
+
+	if (flight != NULL)
+		sip_coalesce_end(flight, response);
+}
+
+/**
+ * Map the rings a client offered in its handshake (see ring.h). The client
+ * can still write to them, so the memfd must be sealed against shrinking.
+ *
+ * @return The mapped rings, or NULL if the offer is unusable.
+ */
+static struct sip_rings *map_rings(int memfd) {
+	struct stat sbuf;
+	void *rings;
+	int seals = fcntl(memfd, F_GET_SEALS);
+
+	if (seals == -1 || !(seals & F_SEAL_SHRINK) || fstat(memfd, &sbuf) == -1 ||
+		sbuf.st_size < sizeof(struct sip_rings)) {
+		sip_warning("Client offered unusable rings; using the socket.\n");
+		return NULL;
+	}
+
+	rings = mmap(NULL, sizeof(struct sip_rings), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+	return rings == MAP_FAILED ? NULL : rings;
+}
+
+/**
+ * Answer the client's handshake (see packets.h).
+ *
+ * @param struct sip_rings** rings Receives the client's rings if it asked
+ *                                 for them and they could be mapped.
+ * @param int* notify Set to 1 if the client asked for notices.
+ * @return Agreed protocol version, or 0 if there is none.
+ */
+static int handshake(int clientfd, struct sip_rings **rings, int *notify) {
+	struct sip_hello hello;
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov = { &hello, sizeof(hello) };
+	int version = 0, memfd = -1;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} u;
+
+	*rings = NULL;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+
+	if (recvmsg(clientfd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) || hello.magic != SIP_PROTO_MAGIC) {
+		sip_error("Client sent a bad handshake.\n");
+		return 0;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (hello.min_version <= SIP_PROTO_VERSION && hello.max_version >= SIP_PROTO_VERSION)
+		version = SIP_PROTO_VERSION;
+
+	if (version && (hello.flags & SIP_HELLO_RING) && memfd >= 0)
+		*rings = map_rings(memfd);
+
+	if (memfd >= 0)
+		close(memfd);
+
+	hello.min_version = version;
+	hello.max_version = version;
+	*notify = version && (hello.flags & SIP_HELLO_NOTICES);
+
+	hello.flags = (*rings != NULL ? SIP_HELLO_RING : 0) | (*notify ? SIP_HELLO_NOTICES : 0);
+
+	/* A client that doesn't take its answer isn't waited for. */
+	if (send(clientfd, &hello, sizeof(hello), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(hello)) {
+		sip_error("Failed to answer handshake: %s\n", strerror(errno));
+		version = 0;
+	}
+
+	if (version == 0) {
+		sip_error("Client speaks no supported protocol version.\n");
+		if (*rings != NULL)
+			munmap(*rings, sizeof(struct sip_rings));
+		*rings = NULL;
+	}
+
+	return version;
+}
+
+/**
+ * Receive a message along with up to SIP_MAX_FDS descriptors. If the sender
+ * attached more, the ones that arrived are closed and the call fails.
+ *
+ * @param int* fds Receives the descriptors.
+ * @param int* nfds Receives the number of descriptors.
+ * @return Same as recv(2).
+ */
+static ssize_t recv_with_fds(int sockfd, void *buf, size_t size, int flags, int *fds, int *nfds) {
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov = { buf, size };
+	ssize_t received;
+	union {
+		char buf[CMSG_SPACE(SIP_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+
+	*nfds = 0;
+	received = recvmsg(sockfd, &msg, flags | MSG_CMSG_CLOEXEC);
+
+	if (received < 0)
+		return received;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+		}
+	}
+
+	if (msg.msg_flags & MSG_CTRUNC) {
+		close_fds(fds, *nfds);
+		*nfds = 0;
+		errno = EPROTO;
+		return -1;
+	}
+
+	return received;
+}
+
+/**
+ * Take the next request off the client's submission ring, along with the
+ * descriptors it sent over the socket for it.
+ *
+ * @return Same as recv(2) with MSG_TRUNC.
+ */
+static ssize_t ring_receive(struct sip_connection *conn, char *packet, size_t size, int *fds, int *nfds) {
+	struct sip_ring *sq = &conn->rings->sq;
+	struct sip_ring_request *entry;
+	struct sip_header head;
+	unsigned int tail, len;
+	char byte;
+
+	*nfds = 0;
+
+	pthread_mutex_lock(&conn->recv_lock);
+
+	while ((tail = __atomic_load_n(&sq->tail, __ATOMIC_ACQUIRE)) == conn->sq_head) {
+		if (sip_ring_wait(&sq->tail, &sq->tail_waiting, conn->sq_head) == -1 && !sip_peer_alive(conn->fd)) {
+			pthread_mutex_unlock(&conn->recv_lock);
+			return 0;
+		}
+	}
+
+	if (tail - conn->sq_head > SIP_RING_ENTRIES) {
+		pthread_mutex_unlock(&conn->recv_lock);
+		errno = EPROTO;
+		return -1;
+	}
+
+	/* Read the size once; the client can change it under us. */
+	entry = &conn->rings->sqe[conn->sq_head & (SIP_RING_ENTRIES - 1)];
+	len = __atomic_load_n(&entry->size, __ATOMIC_RELAXED);
+
+	if (len <= size)
+		memcpy(packet, entry->packet, len);
+
+	sip_ring_publish(&sq->head, &sq->head_waiting, ++conn->sq_head);
+
+	/* The descriptors were sent just before the request was submitted. */
+	if (len >= sizeof(head) && len <= size) {
+		memcpy(&head, packet, sizeof(head));
+
+		if (head.nfds > SIP_MAX_FDS ||
+			(head.nfds > 0 && recv_with_fds(conn->fd, &byte, 1, 0, fds, nfds) <= 0)) {
+			pthread_mutex_unlock(&conn->recv_lock);
+			errno = EPROTO;
+			return -1;
+		}
+	}
+
+	pthread_mutex_unlock(&conn->recv_lock);
+	return len;
+}
+
+/**
+ * Put a response on the client's completion ring. Its descriptors, if any,
+ * are sent over the socket first. Must be called with send_lock held. The
+ * send may block, which only holds up the connection's own threads.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int ring_send(struct sip_connection *conn, struct sip_response *response, const int *respfds) {
+	struct sip_ring *cq = &conn->rings->cq;
+	unsigned int head;
+	char byte = 0;
+
+	if (response->nfds > 0 && sip_send_fds(conn->fd, &byte, 1, respfds, response->nfds, MSG_NOSIGNAL) != 1)
+		return -1;
+
+	while (conn->cq_tail - (head = __atomic_load_n(&cq->head, __ATOMIC_ACQUIRE)) >= SIP_RING_ENTRIES) {
+		if (conn->cq_tail - head > SIP_RING_ENTRIES) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (sip_ring_wait(&cq->head, &cq->head_waiting, head) == -1 && !sip_peer_alive(conn->fd)) {
+			errno = EPIPE;
+			return -1;
+		}
+	}
+
+	memcpy(&conn->rings->cqe[conn->cq_tail & (SIP_RING_ENTRIES - 1)], response, SIP_RESPONSE_SIZE(response));
+	sip_ring_publish(&cq->tail, &cq->tail_waiting, ++conn->cq_tail);
+
+	return 0;
+}
+
+/**
+ * Hold a response the client's socket has no room for, along with copies of
+ * its descriptors, and have epoll report when there is room again. Must be
+ * called with send_lock held.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int hold_response(struct sip_connection *conn, const struct sip_response *response, const int *respfds) {
+	struct sip_unsent *unsent;
+	struct epoll_event event;
+	int i;
+
+	if (conn->nunsent >= DAEMON_MAX_UNSENT) {
+		sip_error("Client doesn't take its responses; dropping it.\n");
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if ((unsent = malloc(offsetof(struct sip_unsent, response) + SIP_RESPONSE_SIZE(response))) == NULL)
+		return -1;
+
+	for (i = 0; i < response->nfds; i++) {
+		if ((unsent->fds[i] = fcntl(respfds[i], F_DUPFD_CLOEXEC, 0)) < 0) {
+			close_fds(unsent->fds, i);
+			free(unsent);
+			return -1;
+		}
+	}
+
+	memcpy(&unsent->response, response, SIP_RESPONSE_SIZE(response));
+	unsent->next = NULL;
+
+	if (conn->unsent == NULL) {
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+			close_fds(unsent->fds, response->nfds);
+			free(unsent);
+			return -1;
+		}
+
+		conn->unsent_tail = &conn->unsent;
+	}
+
+	*conn->unsent_tail = unsent;
+	conn->unsent_tail = &unsent->next;
+	__atomic_add_fetch(&conn->nunsent, 1, __ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+/**
+ * Send the responses held for a client, as far as its socket has room.
+ * Once all are sent, epoll stops reporting room.
+ *
+ * @return 1 if all were sent, 0 if some are still held, -1 on error.
+ */
+static int send_unsent(struct sip_connection *conn) {
+	struct sip_unsent *unsent;
+	struct epoll_event event;
+	size_t size;
+	int rv = 1;
+
+	pthread_mutex_lock(&conn->send_lock);
+
+	while ((unsent = conn->unsent) != NULL) {
+		size = SIP_RESPONSE_SIZE(&unsent->response);
+
+		if (sip_send_fds(conn->fd, &unsent->response, size, unsent->fds, unsent->response.nfds,
+						 MSG_DONTWAIT | MSG_NOSIGNAL) != size) {
+			rv = errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+			break;
+		}
+
+		conn->unsent = unsent->next;
+		__atomic_sub_fetch(&conn->nunsent, 1, __ATOMIC_SEQ_CST);
+		close_fds(unsent->fds, unsent->response.nfds);
+		free(unsent);
+	}
+
+	if (rv == 1) {
+		event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &event);
+	}
+
+	pthread_mutex_unlock(&conn->send_lock);
+
+	return rv;
+}
+
+/**
+ * Send a response along with the response->nfds descriptors it returns. Over
+ * the socket, both go out in a single message.
+ *
+ * Sends over the socket don't block, as a pool thread waiting for one
+ * client would hold up the others. When the client's socket is full, the
+ * response is held instead, and the pool reads no more of the client's
+ * requests until it has taken the held responses (see serve_ready()). More
+ * than DAEMON_MAX_UNSENT held responses means the client stopped reading,
+ * and its connection is dropped.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int send_response(struct sip_connection *conn, struct sip_response *response, const int *respfds) {
+	size_t size = SIP_RESPONSE_SIZE(response);
+	int rv = 0;
+
+	response->notices = __atomic_load_n(&conn->notices, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&conn->send_lock);
+
+	if (conn->rings != NULL)
+		rv = ring_send(conn, response, respfds);
+	else if (conn->unsent != NULL)
+		rv = hold_response(conn, response, respfds);
+	else if (sip_send_fds(conn->fd, response, size, respfds, response->nfds, MSG_DONTWAIT | MSG_NOSIGNAL) != size)
+		rv = errno == EAGAIN || errno == EWOULDBLOCK ? hold_response(conn, response, respfds) : -1;
+
+	pthread_mutex_unlock(&conn->send_lock);
+
+	return rv;
+}
+
+/**
+ * Send the response to a call that ran on the io_uring engine, or that its
+ * handler ran right away, and free the call. Clients are sent notices for
+ * the files the call may have changed first, as in run_call().
+ */
+static void finish_async(struct sip_async *async) {
+	struct sip_response *response = &async->response;
+	int respfd = -1;
+
+	switch (async->callno) {
+#define SIP_ASYNC_NOTICE(name, nr, returns_fd) 				\
+		case nr: { 											\
+			struct sip_request_ ##name request = async->request.name; 	\
+															\
+			if (call_changed_files(nr, &request, response)) { 	\
+				SIP_FIELDS_ ##name(SIP_NOTICE) 				\
+			} 												\
+			if (returns_fd && response->rv >= 0) { 		\
+				respfd = response->rv; 						\
+				response->nfds = 1; 						\
+			} 												\
+			break; 											\
+		}
+
+		SIP_URING_CALLS(SIP_ASYNC_NOTICE)
+#undef SIP_ASYNC_NOTICE
+	}
+
+	sip_coalesce_write();
+
+	if (send_response(async->conn, response, &respfd) == -1) {
+		sip_error("Failed to send response to client: %s\n", strerror(errno));
+		close_connection(async->conn);
+	}
+
+	if (respfd >= 0)
+		close(respfd);
+	close_fds(async->fds, async->nfds);
+
+	put_connection(async->conn);
+	free(async);
+}
+
+/* Completion callback of calls on the io_uring engine. */
+static void async_done(struct sip_uring_op *op, int res) {
+	struct sip_async *async = (struct sip_async *) op;
+
+	complete_call(op, res, &async->response);
+	finish_async(async);
+}
+
 /**
- * Handles a request from an untrusted process.
+ * Hand a call in SIP_URING_CALLS to the io_uring engine, so that the pool
+ * thread can serve other requests while the call runs. The request is
+ * copied along with its descriptors, and the connection is held until the
+ * response is sent. Compound requests, shared calls and connections that
+ * use the rings are served synchronously.
  *
- * @param void* pointer to client socket descriptor.
+ * @param int* fds Descriptors sent with the request; closed once the call
+ *                 completes if it is taken.
+ * @return 1 if the request was taken, 0 if the caller must serve it.
  */
-void *handle_connection(void* arg) {
-	
-	pthread_detach(pthread_self()); /* Let OS reap thread resources */
+static int run_async(struct sip_connection *conn, struct sip_header *head, char *packet, ssize_t received,
+					 int *fds, int nfds) {
+	struct sip_async *async;
+	char (*proc)[SIP_PROC_FD_SZ];
+	char *pos, *end;
+	int paths = 0;
+
+	if (!uring_running || conn->rings != NULL)
+		return 0;
+
+	switch (head->callno) {
+#define SIP_SUBMIT(name, nr, returns_fd) 						\
+		case nr: { 												\
+			struct sip_request_ ##name request; 				\
+																\
+			if ((async = malloc(sizeof(*async))) == NULL) 		\
+				return 0; 										\
+																\
+			memcpy(async->packet, packet, received); 			\
+			pos = async->packet + sizeof(*head); 				\
+			end = async->packet + received; 					\
+			proc = async->proc; 								\
+																\
+			SIP_FIELDS_ ##name(SIP_GET) 						\
+			if (pos != end) 									\
+				goto malformed; 								\
+																\
+			async->request.name = request; 						\
+			break; 												\
+		}
+
+		SIP_URING_CALLS(SIP_SUBMIT)
+#undef SIP_SUBMIT
+
+		default:
+			return 0;
+	}
+
+	async->op.done = &async_done;
+	async->op.handles[0] = async->op.handles[1] = -1;
+	async->conn = conn;
+	async->callno = head->callno;
+	async->response.id = head->id;
+	async->response.nfds = 0;
+	async->response.size = 0;
+	memcpy(async->fds, fds, nfds * sizeof(int));
+	async->nfds = nfds;
+
+	pthread_mutex_lock(&conn->lock);
+	conn->refs++;
+	pthread_mutex_unlock(&conn->lock);
+
+	/* See serve_request(). */
+	sip_coalesce_write();
+	errno = 0;
 
+	switch (head->callno) {
+#define SIP_SUBMIT(name, nr, returns_fd) 												\
+		case nr: 																	\
+			if (!submit_ ##name(&async->request.name, &async->response, &async->op)) 	\
+				finish_async(async); 												\
+			break;
+
+		SIP_URING_CALLS(SIP_SUBMIT)
+#undef SIP_SUBMIT
+	}
+
+	return 1;
+
+malformed:
+	/* The synchronous path reports it. */
+	free(async);
+	return 0;
+}
+
+/**
+ * Run a request and send back its response.
+ *
+ * @param ssize_t received Size of the request, as reported by recv(2) with
+ *                         MSG_TRUNC.
+ * @param int* fds Descriptors sent with the request; closed here.
+ * @return 0 on success, -1 if the response could not be sent.
+ */
+static int serve_request(struct sip_connection *conn, char *packet, ssize_t received, int *fds, int nfds) {
 	struct sip_response response;
-	ssize_t sent = 0, received = 0;
-	void* packet = NULL;
-	int clientfd = *(int*) arg, pkt_head[2], respfd;
-	free(arg);
+	struct sip_header head;
+	int respfds[SIP_MAX_FDS]; 	/* descriptors returned with the response */
+	char *pos, *end;
+	int err, sent;
+
+	if (received < sizeof(head) || received > SIP_MAX_PACKET) {
+		sip_error("Dropping packet of bad size %zd.\n", received);
+		close_fds(fds, nfds);
+		return 0;
+	}
+
+	memcpy(&head, packet, sizeof(head));
+	pos = packet + sizeof(head);
+	end = packet + received;
+
+	sip_info("Received delegated syscall request. Call number is %d.\n", head.callno);
+
+	/* Based on call number, execute an appropriate handler. Calls that
+	   return a descriptor get it attached to the response. */
+	response.id = head.id;
+	response.nfds = 0;
+	response.size = 0;
+
+	if (head.size != received || head.nfds != nfds) {
+		sip_error("Malformed request for call %d.\n", head.callno);
+		response.rv = -1;
+		response.err = EINVAL;
+	} else if (SIP_CALL_SHAREABLE(head.callno) && nfds == 0) {
+		run_shared(conn, head.callno, pos, end, &response);
+	} else if (run_async(conn, &head, packet, received, fds, nfds)) {
+		return 0;
+	} else {
+		/* Anything else may change what shared calls would return. */
+		sip_coalesce_write();
+
+		if (head.callno == SYS_compound) {
+			run_compound(pos, end, fds, nfds, &response, respfds);
+		} else if ((err = run_call(head.callno, &pos, end, 1, fds, nfds, &response, &respfds[0]))) {
+			response.rv = -1;
+			response.err = err;
+		} else if (respfds[0] >= 0) {
+			response.nfds = 1;
+		}
+
+		sip_coalesce_write();
+	}
+
+	/* Send back response with its descriptors. */
+	sent = send_response(conn, &response, respfds);
+
+	close_fds(respfds, response.nfds);
+	close_fds(fds, nfds);
+
+	if (sent == -1) {
+		sip_error("Failed to send response to client: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stop sending notices to a connection, drop the responses held for it and
+ * close it. The memory is freed later by the main thread (see released),
+ * since pending events may still refer to it.
+ */
+static void release_connection(struct sip_connection *conn) {
+	struct sip_unsent *unsent;
+
+	if (conn->notify) {
+		struct sip_connection **link;
+
+		pthread_mutex_lock(&clients_lock);
+		for (link = &clients; *link != conn; link = &(*link)->next)
+			;
+		*link = conn->next;
+		pthread_mutex_unlock(&clients_lock);
+	}
+
+	if (conn->rings == NULL)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+
+	while ((unsent = conn->unsent) != NULL) {
+		conn->unsent = unsent->next;
+		close_fds(unsent->fds, unsent->response.nfds);
+		free(unsent);
+	}
+
+	close(conn->fd);
+	if (conn->rings != NULL)
+		munmap(conn->rings, sizeof(struct sip_rings));
+
+	pthread_mutex_lock(&pool_lock);
+	conn->ready = released;
+	released = conn;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Serves requests on a connection that uses the rings until the client
+ * hangs up. The rings can't be watched with epoll, so these connections
+ * have threads of their own. Every serving thread receives and answers
+ * requests on its own, so requests complete in any order; clients match
+ * responses to requests by ID. When a request arrives while no other
+ * thread is waiting for the next one, another thread is started (up to
+ * DAEMON_CONN_WORKERS) so that one slow call does not hold up the rest.
+ *
+ * @param void* pointer to the struct sip_connection.
+ */
+static void *serve_connection(void *arg) {
+
+	pthread_detach(pthread_self()); /* Let OS reap thread resources */
+
+	struct sip_connection *conn = arg;
+	ssize_t received = 0;
+	char packet[SIP_MAX_PACKET];
+	int fds[SIP_MAX_FDS], nfds;
+	int spawn, last;
+	pthread_t tid;
 
 	while (1) {
 
-		respfd = -1; /* fd to include in response (-1 for none) */
+		/* Read the next request. Like MSG_TRUNC, this reports the real
+		   length of requests that don't fit. */
+		received = ring_receive(conn, packet, sizeof(packet), fds, &nfds);
 
-		/* Read packet header to determine call number & packet size. */
-	 	received = recv(clientfd, &pkt_head, 2 * sizeof(int), MSG_PEEK);
+		pthread_mutex_lock(&conn->lock);
+		conn->idle--;
+		spawn = received > 0 && conn->idle == 0 && conn->workers < DAEMON_CONN_WORKERS;
+		if (spawn) {
+			conn->workers++;
+			conn->idle++;
+		}
+		pthread_mutex_unlock(&conn->lock);
 
 		if (received == 0) {
 			sip_info("Client closed connection. Exiting thread loop.\n");
 			break;
 		}
 
-		/* Allocate space for packet. */
-		packet = realloc(packet, pkt_head[1]);	
-		
-		if (packet == NULL) {
-			sip_error("Can't serve request: out of memory.\n");
+		if (received < 0) {
+			sip_error("Failed to read packet: %s\n", strerror(errno));
 			break;
 		}
 
-		/* Read entire packet. */
-		received = recv(clientfd, packet, pkt_head[1], 0);
+		if (spawn && pthread_create(&tid, NULL, &serve_connection, conn) != 0) {
+			pthread_mutex_lock(&conn->lock);
+			conn->workers--;
+			conn->idle--;
+			pthread_mutex_unlock(&conn->lock);
+		}
 
-		if (received < 0 || received != pkt_head[1]) {
-			sip_error("Failed to read packet: %s\n", strerror(errno));
+		if (serve_request(conn, packet, received, fds, nfds) == -1)
 			break;
+
+		pthread_mutex_lock(&conn->lock);
+		conn->idle++;
+		pthread_mutex_unlock(&conn->lock);
+	}
+
+	/* Wake the other threads serving this connection so they exit too. */
+	shutdown(conn->fd, SHUT_RDWR);
+
+	pthread_mutex_lock(&conn->lock);
+	last = --conn->workers == 0;
+	pthread_mutex_unlock(&conn->lock);
+
+	/* Clean up */
+	if (last)
+		release_connection(conn);
+	return NULL;
+}
+
+/**
+ * Queue a connection on a pool thread's run queue, unless it is queued
+ * already or the pool no longer serves it. An idle thread is woken to take
+ * it, or to steal it if the owner of the queue is busy.
+ */
+static void schedule_connection(struct sip_connection *conn, struct sip_worker *worker) {
+	int queue;
+
+	pthread_mutex_lock(&conn->lock);
+	queue = !conn->queued && conn->state <= CONN_OPEN;
+	if (queue)
+		conn->queued = 1;
+	pthread_mutex_unlock(&conn->lock);
+
+	if (!queue)
+		return;
+
+	pthread_mutex_lock(&worker->lock);
+	conn->ready = NULL;
+	if (worker->tail != NULL)
+		worker->tail->ready = conn;
+	else
+		worker->head = conn;
+	worker->tail = conn;
+	__atomic_add_fetch(&worker->length, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&worker->lock);
+
+	/* Pairs with the check in take_connection(). */
+	if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&pool_lock);
+		pthread_cond_signal(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+/* Take the connection at the head of a run queue, if any. */
+static struct sip_connection *pop_connection(struct sip_worker *worker) {
+	struct sip_connection *conn;
+
+	if (__atomic_load_n(&worker->length, __ATOMIC_SEQ_CST) == 0)
+		return NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if ((conn = worker->head) != NULL) {
+		worker->head = conn->ready;
+		if (worker->head == NULL)
+			worker->tail = NULL;
+		__atomic_sub_fetch(&worker->length, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return conn;
+}
+
+/**
+ * Take the next connection to serve: from the thread's own run queue, else
+ * from the others in turn. Sleeps while all are empty.
+ */
+static struct sip_connection *take_connection(struct sip_worker *self) {
+	struct sip_connection *conn;
+	int i, start = self - pool;
+
+	while (1) {
+		for (i = 0; i < pool_size; i++) {
+			if ((conn = pop_connection(&pool[(start + i) % pool_size])) != NULL)
+				return conn;
 		}
 
-		sip_info("Received delegated syscall request. Call number is %d.\n", pkt_head[0]);
+		/* Announce that we sleep before checking the queues a last time,
+		   so that a thread queueing a connection either sees us or we see
+		   its connection. */
+		pthread_mutex_lock(&pool_lock);
+		__atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
 
-		/* Based on call number, execute an appropriate handler. Note that
-		   calls that send back file descriptors need special handling, as
-		   we must sendmsg instead of send to send back the response. */
-		errno = 0;
+		for (i = 0; i < pool_size && __atomic_load_n(&pool[i].length, __ATOMIC_SEQ_CST) == 0; i++)
+			;
+		if (i == pool_size)
+			pthread_cond_wait(&pool_cond, &pool_lock);
 
-		switch (pkt_head[0]) {
-			case SYS_delegatortest:
-				handle_delegatortest(packet, &response);
-			break;
-			case SYS_faccessat:
-				handle_faccessat(packet, &response);
-			break;
-			case SYS_fchmodat:
-				handle_fchmodat(packet, &response);
-			break;
-			case SYS_fchownat:
-				handle_fchownat(packet, &response);
-			break;
-			case SYS_fstatat:
-				handle_fstatat(packet, &response);
-			break;
-			case SYS_statvfs:
-				handle_statvfs(packet, &response);
-			break;
-			case SYS_linkat:
-				handle_linkat(packet, &response);
-			break;
-			case SYS_mkdirat:
-				handle_mkdirat(packet, &response);
-			break;
-			case SYS_mknodat:
-				handle_mknodat(packet, &response);
-			break;
-			case SYS_openat:
-				handle_openat(packet, &response);
-				respfd = response.rv;
-			break;
-			case SYS_renameat2:
-				handle_renameat2(packet, &response);
-			break;
-			case SYS_symlinkat:
-				handle_symlinkat(packet, &response);
-			break;
-			case SYS_unlinkat:
-				handle_unlinkat(packet, &response);
-			break;
-			case SYS_utime:
-				handle_utime(packet, &response);
-			break;
-			case SYS_utimes:
-				handle_utimes(packet, &response);
-			break;
-			case SYS_utimensat:
-				handle_utimensat(packet, &response);
-			break;
-			case SYS_bind:
-				handle_bind(packet, &response);
-				respfd = response.rv;
-			break;
-			case SYS_connect:
-				handle_connect(packet, &response);
-				respfd = response.rv;
+		__atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+/* Mark a connection closed; it is released once no pool thread uses it. */
+static void close_connection(struct sip_connection *conn) {
+	pthread_mutex_lock(&conn->lock);
+	conn->state = CONN_CLOSED;
+	pthread_mutex_unlock(&conn->lock);
+
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+/**
+ * Answer the handshake of a new connection. A client that asked for the
+ * rings is handed to a thread of its own once the pool lets go of it.
+ *
+ * @return 1 if the pool keeps serving the connection, 0 otherwise.
+ */
+static int open_connection(struct sip_connection *conn) {
+	struct sip_rings *rings;
+	int notify = 0;
+
+	if (!handshake(conn->fd, &rings, &notify)) {
+		close_connection(conn);
+		return 0;
+	}
+
+	conn->rings = rings;
+	conn->notify = notify;
+
+	if (notify) {
+		pthread_mutex_lock(&clients_lock);
+		conn->next = clients;
+		clients = conn;
+		pthread_mutex_unlock(&clients_lock);
+	}
+
+	if (rings != NULL) {
+		sip_info("Serving client over shared-memory rings.\n");
+		epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	conn->state = rings != NULL ? CONN_HANDOFF : CONN_OPEN;
+	pthread_mutex_unlock(&conn->lock);
+
+	return rings == NULL;
+}
+
+/**
+ * Serve the requests waiting on a connection, up to DAEMON_CONN_BATCH. If
+ * more requests are waiting after one is taken, the connection is queued
+ * again so that another pool thread can serve them meanwhile; a slow call
+ * then doesn't hold up the rest. While responses are held for the client
+ * (see send_response()), they are sent first and no requests are read.
+ */
+static void serve_ready(struct sip_connection *conn, struct sip_worker *self) {
+	char packet[SIP_MAX_PACKET];
+	int fds[SIP_MAX_FDS], nfds, pending, state, sent, i;
+	ssize_t received;
+
+	pthread_mutex_lock(&conn->lock);
+	state = conn->state;
+	if (state == CONN_NEW)
+		conn->state = CONN_HANDSHAKE;
+	pthread_mutex_unlock(&conn->lock);
+
+	/* Requests that arrive during the handshake are taken by the thread
+	   answering it, once it is done. */
+	if (state == CONN_NEW && !open_connection(conn))
+		return;
+	if (state != CONN_NEW && state != CONN_OPEN)
+		return;
+
+	if (__atomic_load_n(&conn->nunsent, __ATOMIC_SEQ_CST) > 0 && (sent = send_unsent(conn)) <= 0) {
+		if (sent == -1) {
+			sip_error("Failed to send response to client: %s\n", strerror(errno));
+			close_connection(conn);
+		}
+		return;
+	}
+
+	for (i = 0; i < DAEMON_CONN_BATCH; i++) {
+		/* The event for room in the socket resumes the client. */
+		if (__atomic_load_n(&conn->nunsent, __ATOMIC_SEQ_CST) > 0)
+			return;
+
+		received = recv_with_fds(conn->fd, packet, sizeof(packet), MSG_TRUNC | MSG_DONTWAIT, fds, &nfds);
+
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		if (received == 0) {
+			sip_info("Client closed connection.\n");
+			close_connection(conn);
+			return;
+		}
+
+		if (received < 0) {
+			sip_error("Failed to read packet: %s\n", strerror(errno));
+			close_connection(conn);
+			return;
+		}
+
+		if (ioctl(conn->fd, FIONREAD, &pending) == 0 && pending > 0)
+			schedule_connection(conn, self);
+
+		if (serve_request(conn, packet, received, fds, nfds) == -1) {
+			close_connection(conn);
+			return;
+		}
+	}
+
+	/* Give the other connections a turn. */
+	schedule_connection(conn, self);
+}
+
+/**
+ * Drop a pool reference to a connection. The last reference to a
+ * connection that hung up releases it, and the last to one that asked for
+ * the rings starts its thread. Pool threads hold a reference while serving
+ * a connection, and so do its calls on the io_uring engine.
+ */
+static void put_connection(struct sip_connection *conn) {
+	pthread_t tid;
+	int state, last;
+
+	pthread_mutex_lock(&conn->lock);
+	last = --conn->refs == 0 && !conn->queued;
+	state = conn->state;
+	if (last && state == CONN_HANDOFF)
+		conn->state = CONN_RINGS;
+	pthread_mutex_unlock(&conn->lock);
+
+	if (!last)
+		return;
+
+	/* The thread releases the connection when the client hangs up. */
+	if (state == CONN_HANDOFF && pthread_create(&tid, NULL, &serve_connection, conn) != 0) {
+		sip_error("Failed to start thread for client: %s\n", strerror(errno));
+		state = CONN_CLOSED;
+	}
+
+	if (state == CONN_CLOSED)
+		release_connection(conn);
+}
+
+/**
+ * Pool thread. Takes ready connections off the run queues and serves them.
+ * Several threads may serve one connection at once, so its requests
+ * complete in any order; clients match responses to requests by ID.
+ *
+ * @param void* pointer to the thread's struct sip_worker.
+ */
+static void *pool_worker(void *arg) {
+	struct sip_worker *self = arg;
+	struct sip_connection *conn;
+
+	while (1) {
+		conn = take_connection(self);
+
+		pthread_mutex_lock(&conn->lock);
+		conn->queued = 0;
+		conn->refs++;
+		pthread_mutex_unlock(&conn->lock);
+
+		serve_ready(conn, self);
+		put_connection(conn);
+	}
+
+	return NULL;
+}
+
+/**
+ * Start the pool threads, two per CPU but at least DAEMON_MIN_WORKERS:
+ * handlers block on the file system, and a long call like a subtree
+ * removal shouldn't stall every other client.
+ *
+ * @return Number of threads started.
+ */
+static int start_pool() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, workers = cpus > 0 ? 2 * cpus : DAEMON_MIN_WORKERS;
+	pthread_t tid;
+
+	if (workers < DAEMON_MIN_WORKERS)
+		workers = DAEMON_MIN_WORKERS;
+
+	if ((pool = calloc(workers, sizeof(struct sip_worker))) == NULL)
+		return 0;
+
+	/* Queues of threads that failed to start are still served by stealing. */
+	pool_size = workers;
+
+	for (i = 0; i < workers; i++)
+		pthread_mutex_init(&pool[i].lock, NULL);
+
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&tid, NULL, &pool_worker, &pool[i]) != 0)
 			break;
-			default:
-				sip_error("Unhandled delegated syscall: %d\n", pkt_head[0]);
+		pthread_detach(tid);
+	}
+
+	return i;
+}
+
+/**
+ * Accept the pending connections and watch them for requests. The listening
+ * socket is edge-triggered, so this accepts until there are none left.
+ */
+static void accept_connections(int listenfd) {
+	static int next_home = 0;
+
+	struct sip_connection *conn;
+	struct epoll_event event;
+	int clientfd;
+
+	while (1) {
+		clientfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (clientfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
 				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				sip_error("Accept failed: %s.\n", strerror(errno));
+			return;
 		}
 
-		/* Send back response */
-		sent = send(clientfd, &response, sizeof(struct sip_response), 0);
+		sip_info("Daemon received a connection request!\n");
 
-		if (sent != sizeof(struct sip_response)) {
-			sip_error("Failed to send response to client: %s\n", strerror(errno));
-			break;
+		// TODO: NEED TO DO THIS? I THINK WE CAN HANDLE THIS PERMS ON COM PATH.
+		// Right now, this function just does logging... but it could:
+			// Get link to executable path
+			// Check ownership and group ownership of executable using sip_path_to_level and if the value returned is HIGH or -1, then abort (don't add to pool).
+			// This would confirm that the peer process is running with the untrusted userid
+		// 			is_connection_valid(newfd,&uid,&gid); 
+
+		if ((conn = calloc(1, sizeof(struct sip_connection))) == NULL) {
+			sip_error("Couldn't accept connection: out of memory.\n");
+			close(clientfd);
+			continue; /* Maybe some memory will free up? */
 		}
 
-		/* Send back descriptor if necessary */
-		if (respfd >= 0) {
-			if (sip_send_fd(clientfd, respfd) == 0) {
-				sip_info("Descriptor sent to client successfully.\n");
-				close(respfd);
-			}
+		conn->fd = clientfd;
+		conn->state = CONN_NEW;
+		conn->home = next_home;
+		next_home = (next_home + 1) % pool_size;
+		conn->workers = 1;
+		conn->idle = 1;
+		pthread_mutex_init(&conn->lock, NULL);
+		pthread_mutex_init(&conn->recv_lock, NULL);
+		pthread_mutex_init(&conn->send_lock, NULL);
+
+		/* The event for the handshake comes right away if it was sent
+		   already. */
+		event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, clientfd, &event) == -1) {
+			sip_error("Couldn't watch connection: %s\n", strerror(errno));
+			close(clientfd);
+			free(conn);
 		}
 	}
+}
 
-	/* Clean up */
-	if (packet != NULL)
-		free(packet);
+/* Free the connections released since the last call. */
+static void free_released() {
+	struct sip_connection *conn, *next;
 
-	close(clientfd);
+	pthread_mutex_lock(&pool_lock);
+	conn = released;
+	released = NULL;
+	pthread_mutex_unlock(&pool_lock);
+
+	for (; conn != NULL; conn = next) {
+		next = conn->ready;
+		pthread_mutex_destroy(&conn->lock);
+		pthread_mutex_destroy(&conn->recv_lock);
+		pthread_mutex_destroy(&conn->send_lock);
+		free(conn);
+	}
 }
 
 int main(int argc, char **argv) {
 
-	struct sockaddr_un addr, client_addr;
+	struct sockaddr_un addr;
+	struct epoll_event events[DAEMON_EPOLL_EVENTS], event;
+	struct sip_connection *conn;
+	struct rlimit limit;
 
-	int addrlen, listenfd, clientfd, *fdcopy;
+	int addrlen, listenfd, n, i;
 
 	/* Set real, effective, and saved GID/UID. NOTE: the effective GID
 	   is set to SIP_UNTRUSTED_USERID so new files are automatically
@@ -179,8 +1627,20 @@ int main(int argc, char **argv) {
 	sip_info("Daemon started. RUID is %d, EUID is %d, PID is %d.\n",
 		     getuid(), geteuid(), getpid());
 
+	/* Every untrusted process holds a connection for its whole lifetime. */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	/* A client may hang up before its response is sent. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The engine runs calls with the credentials set above. */
+	uring_running = sip_uring_start() == 0;
+
 	/* Create UNIX domain socket. */
-	listenfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	
 	if (listenfd < 0) {
 		sip_error("Creating socket failed: %s\n", strerror(errno));
@@ -210,34 +1670,42 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	/* Wait for new connections in an infinite loop. When a connection arrives,
-	   spawn a thread to handle it. */
-	pthread_t tid;
+	/* Watch the listening socket and every client socket from here, and
+	   serve the requests with a fixed pool of threads. */
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+
+	if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event) == -1) {
+		sip_error("Failed to set up epoll: %s.\n", strerror(errno));
+		return 1;
+	}
+
+	if (start_pool() == 0) {
+		sip_error("Failed to start worker threads.\n");
+		return 1;
+	}
 
 	while (1) {
-		clientfd = accept(listenfd, (struct sockaddr*)&client_addr, &addrlen);
+		free_released();
 
-		if (clientfd < 0) {
-			sip_error("Accept failed: %s. Aborting.\n", strerror(errno));
+		n = epoll_wait(epfd, events, DAEMON_EPOLL_EVENTS, -1);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			sip_error("epoll_wait failed: %s. Aborting.\n", strerror(errno));
 			exit(1);
 		}
 
-		sip_info("Daemon received a connection request!\n");
-
-		// TODO: NEED TO DO THIS? I THINK WE CAN HANDLE THIS PERMS ON COM PATH.
-		// Right now, this function just does logging... but it could:
-			// Get link to executable path
-			// Check ownership and group ownership of executable using sip_path_to_level and if the value returned is HIGH or -1, then abort (don't add to pool).
-			// This would confirm that the peer process is running with the untrusted userid
-		// 			is_connection_valid(newfd,&uid,&gid); 
+		for (i = 0; i < n; i++) {
+			conn = events[i].data.ptr;
 
-		if ((fdcopy = malloc(sizeof(int))) == NULL) {
-			sip_error("Couldn't accept connection: out of memory.\n");
-			continue; /* Maybe some memory will free up? */
+			if (conn == NULL)
+				accept_connections(listenfd);
+			else
+				schedule_connection(conn, &pool[conn->home]);
 		}
-		*fdcopy = clientfd;
-		
-		pthread_create(&tid, NULL, &handle_connection, fdcopy);
 	}
 
 	/* Clean up */
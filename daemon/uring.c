@@ -0,0 +1,341 @@
+/**
+ * io_uring engine for the daemon's file system calls.
+ *
+ * A pool thread that makes a blocking call can't serve anything else until
+ * it returns. Calls submitted here instead run in the kernel while the
+ * thread goes on with the next request; a completion thread hands each
+ * result to the callback of its operation. The engine is used only if the
+ * kernel supports io_uring with stable submissions, so that paths can be
+ * freed once an operation is submitted. Operations it doesn't support, or
+ * that don't fit, run synchronously in the caller.
+ *
+ * The engine is off unless SIP_DAEMON_URING=on. Most of these operations
+ * are punted to the kernel's worker threads, which costs more than it saves
+ * while the files are in the page cache (see tests/daemon-load.c -f); it
+ * pays off when calls block on slow storage.
+ *
+ * Only the call itself runs here. The handlers still resolve and check the
+ * file on the pool thread (see resolve.c): the check needs the stat of the
+ * resolved file, so a resolve submitted as IORING_OP_OPENAT2 with the call
+ * linked to it would run the call unchecked. The linked call couldn't use
+ * the descriptor the resolve returns either, since the *at opcodes take no
+ * fixed files. The one call that needs no check, an openat that doesn't
+ * write, is a single IORING_OP_OPENAT2 (see submit_openat()).
+ *
+ * The ring is set up without liburing, with the raw syscalls.
+ */
+
+#define _GNU_SOURCE
+
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "uring.h"
+
+static int ringfd = -1;
+static unsigned char supported[IORING_OP_LAST]; 	/* opcodes the kernel has */
+
+/* Submission queue. The lock protects it and sq_local_tail. */
+static pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int *sq_tail, *sq_mask, *sq_array;
+static unsigned int sq_local_tail;
+static struct io_uring_sqe *sqes;
+
+/* Completion queue, read by the completion thread only. */
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static unsigned int inflight; 	/* kept below SIP_URING_ENTRIES */
+
+/**
+ * Take the next submission queue entry for an operation. On success, the
+ * submission lock is held until sip_uring_submit().
+ *
+ * @return The cleared entry, or NULL if the engine can't take the
+ *         operation.
+ */
+static struct io_uring_sqe *sip_uring_get(int opcode) {
+	struct io_uring_sqe *sqe;
+
+	if (ringfd < 0 || !supported[opcode])
+		return NULL;
+
+	pthread_mutex_lock(&sq_lock);
+
+	if (__atomic_load_n(&inflight, __ATOMIC_ACQUIRE) >= SIP_URING_ENTRIES) {
+		pthread_mutex_unlock(&sq_lock);
+		return NULL;
+	}
+
+	sqe = &sqes[sq_local_tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+
+	return sqe;
+}
+
+/**
+ * Submit the entry taken with sip_uring_get(). If the kernel doesn't
+ * consume it, it is taken back, which is safe since only io_uring_enter()
+ * consumes entries.
+ *
+ * @return 0 on success, -1 if the caller must make the call itself.
+ */
+static int sip_uring_submit(struct sip_uring_op *op, struct io_uring_sqe *sqe) {
+	unsigned int index = sq_local_tail & *sq_mask;
+	int rv;
+
+	sqe->user_data = (uintptr_t) op;
+	sq_array[index] = index;
+
+	__atomic_add_fetch(&inflight, 1, __ATOMIC_ACQ_REL);
+	__atomic_store_n(sq_tail, sq_local_tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		rv = syscall(SYS_io_uring_enter, ringfd, 1, 0, 0, NULL, 0);
+	} while (rv < 0 && errno == EINTR);
+
+	if (rv != 1) {
+		__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&inflight, 1, __ATOMIC_ACQ_REL);
+		pthread_mutex_unlock(&sq_lock);
+		sip_warning("io_uring submission failed: %s\n", rv < 0 ? strerror(errno) : "not consumed");
+		return -1;
+	}
+
+	sq_local_tail++;
+	pthread_mutex_unlock(&sq_lock);
+	return 0;
+}
+
+/**
+ * Completion thread. Waits for completions and hands them to their
+ * operations.
+ */
+static void *sip_uring_reap(void *arg __attribute__((unused))) {
+	struct sip_uring_op *op;
+	struct io_uring_cqe cqe;
+	unsigned int head = *cq_head;
+
+	while (1) {
+		if (syscall(SYS_io_uring_enter, ringfd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			sip_error("Waiting for io_uring completions failed: %s\n", strerror(errno));
+			usleep(1000);
+		}
+
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = cqes[head & *cq_mask];
+			__atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+			__atomic_sub_fetch(&inflight, 1, __ATOMIC_ACQ_REL);
+
+			op = (struct sip_uring_op *) (uintptr_t) cqe.user_data;
+			op->done(op, cqe.res);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Find out which of the opcodes we use the kernel supports.
+ */
+static void sip_uring_probe() {
+	static const int opcodes[] = {
+		IORING_OP_OPENAT, IORING_OP_OPENAT2, IORING_OP_UNLINKAT, IORING_OP_RENAMEAT, IORING_OP_MKDIRAT,
+		IORING_OP_SYMLINKAT, IORING_OP_LINKAT
+	};
+	size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	int i;
+
+	if (probe == NULL || syscall(SYS_io_uring_register, ringfd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+		free(probe);
+		return;
+	}
+
+	for (i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++) {
+		if (opcodes[i] < probe->ops_len && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED))
+			supported[opcodes[i]] = 1;
+	}
+
+	free(probe);
+}
+
+/**
+ * Set up the ring and start the completion thread. Must be called after
+ * the daemon has set its credentials, which the kernel uses for the
+ * operations.
+ *
+ * @return 0 if the engine is running, -1 if calls run synchronously.
+ */
+int sip_uring_start() {
+	struct io_uring_params params;
+	char *setting = getenv("SIP_DAEMON_URING");
+	size_t sq_size, cq_size;
+	void *sq, *cq;
+	pthread_t tid;
+	int fd;
+
+	if (setting == NULL || strcmp(setting, "on") != 0)
+		return -1;
+
+	memset(&params, 0, sizeof(params));
+
+	if ((fd = syscall(SYS_io_uring_setup, SIP_URING_ENTRIES, &params)) < 0) {
+		sip_info("io_uring unavailable (%s). Running calls synchronously.\n", strerror(errno));
+		return -1;
+	}
+
+	/* Handlers pass descriptors as /proc/self/fd links (see resolve.c), which
+	   only resolve to ours in native worker threads. */
+	if (!(params.features & IORING_FEAT_SUBMIT_STABLE) || !(params.features & IORING_FEAT_NODROP) ||
+		!(params.features & IORING_FEAT_NATIVE_WORKERS)) {
+		sip_info("io_uring too old. Running calls synchronously.\n");
+		close(fd);
+		return -1;
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	cq = (params.features & IORING_FEAT_SINGLE_MMAP) || sq == MAP_FAILED ? sq :
+		 mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	/* The mappings stay if anything fails: the daemon keeps running
+	   without the engine. */
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+		sip_warning("Failed to map io_uring: %s. Running calls synchronously.\n", strerror(errno));
+		return -1;
+	}
+
+	sq_tail = sq + params.sq_off.tail;
+	sq_mask = sq + params.sq_off.ring_mask;
+	sq_array = sq + params.sq_off.array;
+	sq_local_tail = *sq_tail;
+	cq_head = cq + params.cq_off.head;
+	cq_tail = cq + params.cq_off.tail;
+	cq_mask = cq + params.cq_off.ring_mask;
+	cqes = cq + params.cq_off.cqes;
+
+	ringfd = fd;
+	sip_uring_probe();
+
+	if (pthread_create(&tid, NULL, &sip_uring_reap, NULL) != 0) {
+		sip_warning("Failed to start io_uring completion thread. Running calls synchronously.\n");
+		ringfd = -1;
+		return -1;
+	}
+	pthread_detach(tid);
+
+	sip_info("Running file system calls on io_uring.\n");
+	return 0;
+}
+
+/* With resolve flags (RESOLVE_*), the call is an openat2(2). */
+int sip_uring_openat(struct sip_uring_op *op, int dirfd, const char *path, int flags, mode_t mode,
+					 unsigned long long resolve) {
+	struct io_uring_sqe *sqe = sip_uring_get(resolve ? IORING_OP_OPENAT2 : IORING_OP_OPENAT);
+	struct open_how how;
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t) path;
+
+	if (resolve) {
+		memset(&how, 0, sizeof(how));
+		how.flags = flags;
+		how.mode = ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) ? (mode & 07777) : 0;
+		how.resolve = resolve;
+
+		sqe->len = sizeof(how);
+		sqe->addr2 = (uintptr_t) &how;
+	} else {
+		sqe->len = mode;
+		sqe->open_flags = flags;
+	}
+	return sip_uring_submit(op, sqe);
+}
+
+int sip_uring_unlinkat(struct sip_uring_op *op, int dirfd, const char *path, int flags) {
+	struct io_uring_sqe *sqe = sip_uring_get(IORING_OP_UNLINKAT);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t) path;
+	sqe->unlink_flags = flags;
+	return sip_uring_submit(op, sqe);
+}
+
+int sip_uring_renameat(struct sip_uring_op *op, int olddirfd, const char *oldpath,
+					   int newdirfd, const char *newpath, unsigned int flags) {
+	struct io_uring_sqe *sqe = sip_uring_get(IORING_OP_RENAMEAT);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->fd = olddirfd;
+	sqe->addr = (uintptr_t) oldpath;
+	sqe->len = newdirfd;
+	sqe->addr2 = (uintptr_t) newpath;
+	sqe->rename_flags = flags;
+	return sip_uring_submit(op, sqe);
+}
+
+int sip_uring_mkdirat(struct sip_uring_op *op, int dirfd, const char *path, mode_t mode) {
+	struct io_uring_sqe *sqe = sip_uring_get(IORING_OP_MKDIRAT);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t) path;
+	sqe->len = mode;
+	return sip_uring_submit(op, sqe);
+}
+
+int sip_uring_symlinkat(struct sip_uring_op *op, const char *target, int dirfd, const char *linkpath) {
+	struct io_uring_sqe *sqe = sip_uring_get(IORING_OP_SYMLINKAT);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t) target;
+	sqe->addr2 = (uintptr_t) linkpath;
+	return sip_uring_submit(op, sqe);
+}
+
+int sip_uring_linkat(struct sip_uring_op *op, int olddirfd, const char *oldpath,
+					 int newdirfd, const char *newpath, int flags) {
+	struct io_uring_sqe *sqe = sip_uring_get(IORING_OP_LINKAT);
+
+	if (sqe == NULL)
+		return -1;
+
+	sqe->fd = olddirfd;
+	sqe->addr = (uintptr_t) oldpath;
+	sqe->len = newdirfd;
+	sqe->addr2 = (uintptr_t) newpath;
+	sqe->hardlink_flags = flags;
+	return sip_uring_submit(op, sqe);
+}
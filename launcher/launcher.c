@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "logger.h"
 #include "level.h"
@@ -89,6 +90,24 @@ void close_benign_files() {
 	closedir(dp);
 }
 
+/**
+ * Put the LOW wrapper library at the front of LD_PRELOAD.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int preload_low_library() {
+	char *current = getenv("LD_PRELOAD");
+	char preload[PATH_MAX];
+
+	if (current == NULL || current[0] == '\0')
+		return setenv("LD_PRELOAD", SIP_LOW_LIBRARY, 1);
+
+	if (snprintf(preload, PATH_MAX, "%s:%s", SIP_LOW_LIBRARY, current) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return setenv("LD_PRELOAD", preload, 1);
+}
 
 int main(int argc, char* argv[]) {
 
@@ -112,6 +131,14 @@ int main(int argc, char* argv[]) {
 		return 1;
 	}
 
+	/* Preload the LOW library. The combined library from /etc/ld.so.preload
+	   is still loaded after it, but the LOW library calls past it (see
+	   sip_find_sym()), so calls go through one layer of wrappers. */
+	if (preload_low_library() < 0) {
+		perror("failed to set LD_PRELOAD");
+		return 1;
+	}
+
 	/* Execute program */
 	execvp(argv[1], &argv[1]);
 	perror("execvp failed");
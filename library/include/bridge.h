@@ -4,7 +4,8 @@
 #include <sys/types.h>
 #include "packets.h"
 
-int sip_delegate_call(void *request, struct sip_response *response);
-int sip_delegate_call_fd(void *request, struct sip_response *response);
+int sip_delegate_call(void *request, const int *fds, int nfds, struct sip_response *response);
+int sip_delegate_call_fd(void *request, const int *fds, int nfds, struct sip_response *response);
+int sip_delegate_call_fds(void *request, const int *fds, int nfds, struct sip_response *response, int *rfds, int max_rfds);
 
 #endif
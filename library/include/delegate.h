@@ -0,0 +1,82 @@
+#ifndef _SIP_DELEGATE_H
+#define _SIP_DELEGATE_H
+
+#include "packets.h"
+#include "level.h"
+
+/**
+ * Stubs for the calls in SIP_DELEGATED_CALLS, one per call:
+ *
+ *   int sip_delegate_<name>(struct sip_response *response, <fields>);
+ *
+ * Each PATH field is passed as a (dirfd, pathname) pair; relative paths are
+ * sent with their directory descriptor and an empty pathname stands for the
+ * file dirfd refers to. The stubs return -1 if the request could not be
+ * built or delivered and 0 otherwise, in which case the result of the call
+ * is in response.
+ */
+#define SIP_PARAM(kind, type, field) SIP_PARAM_ ##kind(type, field)
+#define SIP_PARAM_PATH(type, field) , int field ##_dirfd, const char *field
+#define SIP_PARAM_STR(type, field) , const char *field
+#define SIP_PARAM_VAL(type, field) , type field
+#define SIP_PARAM_PAIR(type, field) , const type *field
+
+/**
+ * Compound requests (see packets.h) are built step by step:
+ *
+ *   struct sip_compound compound;
+ *
+ *   sip_compound_init(&compound);
+ *   sip_compound_<name>(&compound, step_flags, <fields>);  (returns the step index)
+ *   ...
+ *   sip_delegate_compound(&compound, &response, fds, max_fds);
+ *
+ * A PATH field of a step can name the descriptor returned by an earlier
+ * step i as its dirfd with SIP_STEP_FD(i). If a step can't be added, the
+ * error is reported by sip_delegate_compound(), which must always be called
+ * to release the compound. The result is in response.buf as a struct
+ * sip_compound_result.
+ */
+#define SIP_STEP_FD(step) (-1000 - (step))
+
+/* Descriptors to send with a request. */
+struct sip_attached {
+	int fds[SIP_MAX_FDS];
+	int count;
+	int cwd; 				/* index of our descriptor for ".", or -1 */
+};
+
+struct sip_compound {
+	char packet[SIP_COMPOUND_SZ];
+	char *pos;
+	struct sip_attached attached;
+	int steps;
+	int err; 				/* errno of the first step that couldn't be added */
+};
+
+#if defined(SIP_LIB_LEVEL) && SIP_LIB_LEVEL == SIP_LV_HIGH
+/* HIGH build: the daemon is never used, so delegation always fails. */
+#define SIP_DELEGATE_PROTO(name, nr, returns_fd) \
+	static inline int sip_delegate_ ##name(struct sip_response *response SIP_FIELDS_ ##name(SIP_PARAM)) { \
+		return -1; \
+	} \
+	static inline int sip_compound_ ##name(struct sip_compound *compound, unsigned short step_flags SIP_FIELDS_ ##name(SIP_PARAM)) { \
+		return -1; \
+	}
+
+static inline void sip_compound_init(struct sip_compound *compound) { }
+static inline int sip_delegate_compound(struct sip_compound *compound, struct sip_response *response, int *fds, int max_fds) {
+	return -1;
+}
+#else
+#define SIP_DELEGATE_PROTO(name, nr, returns_fd) \
+	int sip_delegate_ ##name(struct sip_response *response SIP_FIELDS_ ##name(SIP_PARAM)); \
+	int sip_compound_ ##name(struct sip_compound *compound, unsigned short step_flags SIP_FIELDS_ ##name(SIP_PARAM));
+
+void sip_compound_init(struct sip_compound *compound);
+int sip_delegate_compound(struct sip_compound *compound, struct sip_response *response, int *fds, int max_fds);
+#endif
+
+SIP_DELEGATED_CALLS(SIP_DELEGATE_PROTO)
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _SIP_DIRCACHE_H
+#define _SIP_DIRCACHE_H
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include "level.h"
+
+#define SIP_DIRCACHE_SLOTS 4 					/* listings kept for stat lookups */
+#define SIP_DIRCACHE_TTL_NS (1000 * 1000000L) 	/* listings expire after 1s */
+
+#if defined(SIP_LIB_LEVEL) && SIP_LIB_LEVEL == SIP_LV_HIGH
+/* HIGH build: directories are never listed by the daemon. */
+static inline int sip_dircache_stat(int dirfd, const char *pathname, int flags, struct stat *sbuf) { return 0; }
+static inline void sip_dircache_invalidate() { }
+#else
+DIR *sip_dir_open(int dirfd, const char *name);
+int sip_dir_is_emulated(DIR *dirp);
+struct dirent *sip_dir_read(DIR *dirp);
+struct dirent64 *sip_dir_read64(DIR *dirp);
+int sip_dir_close(DIR *dirp);
+void sip_dir_rewind(DIR *dirp);
+long sip_dir_tell(DIR *dirp);
+void sip_dir_seek(DIR *dirp, long loc);
+int sip_dircache_stat(int dirfd, const char *pathname, int flags, struct stat *sbuf);
+void sip_dircache_invalidate();
+#endif
+
+#endif
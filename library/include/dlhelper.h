@@ -1,6 +1,115 @@
 #ifndef _SIP_DLHELP_H
 #define _SIP_DLHELP_H
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <sys/ipc.h>
+#include <dirent.h>
+#include <utime.h>
+
+/* Size of the page holding the dispatch table (it is write-protected once
+   all symbols are resolved). */
+#define SIP_REAL_TABLE_SZ 4096
+
+/**
+ * List of libc entry points we interpose on. Each entry has the form
+ * X(return type, name, parameter list). The real implementations are
+ * resolved once, when the library is loaded, into sip_real_table.
+ */
+#define SIP_REAL_CALLS(X) \
+	X(int, faccessat, (int, const char *, int, int)) \
+	X(int, fchmodat, (int, const char *, mode_t, int)) \
+	X(int, fchmod, (int, mode_t)) \
+	X(int, fchownat, (int, const char *, uid_t, gid_t, int)) \
+	X(int, fchown, (int, uid_t, gid_t)) \
+	X(gid_t, getgid, (void)) \
+	X(int, getresgid, (gid_t *, gid_t *, gid_t *)) \
+	X(uid_t, getuid, (void)) \
+	X(int, getresuid, (uid_t *, uid_t *, uid_t *)) \
+	X(int, getgroups, (int, gid_t[])) \
+	X(int, setuid, (uid_t)) \
+	X(int, setreuid, (uid_t, uid_t)) \
+	X(int, setresuid, (uid_t, uid_t, uid_t)) \
+	X(int, setgid, (gid_t)) \
+	X(int, setregid, (gid_t, gid_t)) \
+	X(int, setresgid, (gid_t, gid_t, gid_t)) \
+	X(int, execve, (const char *, char *const[], char *const[])) \
+	X(int, __fxstat, (int, int, struct stat *)) \
+	X(int, __fxstatat, (int, int, const char *, struct stat *, int)) \
+	X(int, statvfs, (const char *, struct statvfs *)) \
+	X(int, fstatvfs, (int, struct statvfs *)) \
+	X(int, linkat, (int, const char *, int, const char *, int)) \
+	X(int, mkdirat, (int, const char *, mode_t)) \
+	X(int, __xmknodat, (int, int, const char *, mode_t, dev_t *)) \
+	X(int, openat, (int, const char *, int, ...)) \
+	X(int, close, (int)) \
+	X(int, dup, (int)) \
+	X(int, dup2, (int, int)) \
+	X(int, dup3, (int, int, int)) \
+	X(int, fcntl, (int, int, ...)) \
+	X(DIR *, opendir, (const char *)) \
+	X(struct dirent *, readdir, (DIR *)) \
+	X(struct dirent64 *, readdir64, (DIR *)) \
+	X(int, closedir, (DIR *)) \
+	X(void, rewinddir, (DIR *)) \
+	X(long, telldir, (DIR *)) \
+	X(void, seekdir, (DIR *, long)) \
+	X(int, dirfd, (DIR *)) \
+	X(ssize_t, readlinkat, (int, const char *, char *, size_t)) \
+	X(int, rmdir, (const char *)) \
+	X(int, symlinkat, (const char *, int, const char *)) \
+	X(int, unlinkat, (int, const char *, int)) \
+	X(int, utime, (const char *, const struct utimbuf *)) \
+	X(int, utimes, (const char *, const struct timeval[2])) \
+	X(int, utimensat, (int, const char *, const struct timespec[2], int)) \
+	X(int, futimens, (int, const struct timespec[2])) \
+	X(int, bind, (int, const struct sockaddr *, socklen_t)) \
+	X(int, connect, (int, const struct sockaddr *, socklen_t)) \
+	X(int, accept4, (int, struct sockaddr *, socklen_t *, int)) \
+	X(int, msgget, (key_t, int)) \
+	X(int, shmget, (key_t, size_t, int))
+
+#define SIP_REAL_PTR(type, name, args) type (*name) args;
+
+/* Dispatch table of real libc entry points. */
+struct sip_real_calls {
+	int ready; 				/* 1 once all symbols are resolved */
+	SIP_REAL_CALLS(SIP_REAL_PTR)
+};
+
+/* The table occupies a page of its own so it can be made read-only. */
+union sip_real_table {
+	struct sip_real_calls calls;
+	char pad[SIP_REAL_TABLE_SZ];
+};
+
+extern union sip_real_table sip_real_table __attribute__((visibility("hidden")));
+
+struct sip_real_calls *sip_resolve_real_calls(void);
 void *sip_find_sym(const char *symbol);
+int sip_wrappers_active(void);
+
+/* example use: sip_real(openat)(dirfd, path, flags, mode); */
+#define sip_real(name) 												\
+	((__builtin_expect(sip_real_table.calls.ready, 1) ? 			\
+	  &sip_real_table.calls : sip_resolve_real_calls())->name) 		\
+
+/* fstat(2) that bypasses our __fxstat wrapper. Newer glibc versions export
+   fstat directly and don't route it through __fxstat. */
+#ifdef _STAT_VER
+#define sip_real_fstat(fd, sbuf) sip_real(__fxstat)(_STAT_VER, fd, sbuf)
+#else
+#define sip_real_fstat(fd, sbuf) fstat(fd, sbuf)
+#endif
+
+/* Same for fstatat(2) and our __fxstatat wrapper. */
+#ifdef _STAT_VER
+#define sip_real_fstatat(dirfd, pathname, sbuf, flags) sip_real(__fxstatat)(_STAT_VER, dirfd, pathname, sbuf, flags)
+#else
+#define sip_real_fstatat(dirfd, pathname, sbuf, flags) fstatat(dirfd, pathname, sbuf, flags)
+#endif
 
 #endif
@@ -0,0 +1,22 @@
+#ifndef _SIP_FDTABLE_H
+#define _SIP_FDTABLE_H
+
+#include <sys/stat.h>
+#include "level.h"
+
+#define SIP_FD_TABLE_SZ 1024 		/* descriptors >= this are not tracked */
+#define SIP_FD_PATH_MAX 240 		/* longer paths are recorded without a name */
+
+#if defined(SIP_LIB_LEVEL) && SIP_LIB_LEVEL == SIP_LV_HIGH
+/* HIGH build: descriptors only need paths for delegation, so none are tracked. */
+static inline void sip_fd_record(int fd, int dirfd, const char *pathname, int flags, const struct stat *sbuf) { }
+static inline void sip_fd_forget(int fd) { }
+#else
+void sip_fd_record(int fd, int dirfd, const char *pathname, int flags, const struct stat *sbuf);
+void sip_fd_record_dup(int oldfd, int newfd, int cloexec);
+void sip_fd_forget(int fd);
+int sip_fd_lookup(int fd, const struct stat *sbuf, char *path, int *flags);
+char *sip_fd_abs_path(int dirfd, const char *pathname, char *resolved);
+#endif
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _SIP_RESULTCACHE_H
+#define _SIP_RESULTCACHE_H
+
+#include "packets.h"
+
+#define SIP_RC_SLOTS 256 					/* must be a power of two */
+#define SIP_RC_MAX_PROBE 4 					/* max. slots visited per lookup */
+#define SIP_RC_KEY_MAX 512 					/* longer requests are not cached */
+#define SIP_RC_TTL_NS SIP_RESULT_TTL_NS 	/* results expire after 1s */
+
+struct sip_result_cache_stats {
+	unsigned long hits; 			/* requests answered from the cache */
+	unsigned long misses; 			/* requests sent to the daemon */
+	unsigned long invalidations; 	/* results dropped by notices */
+};
+
+int sip_result_cache_lookup(const void *request, struct sip_response *response);
+void sip_result_cache_store(const void *request, const struct sip_response *response);
+void sip_result_cache_invalidate(const char *path);
+void sip_result_cache_stats(struct sip_result_cache_stats *stats);
+
+#endif
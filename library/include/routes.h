@@ -0,0 +1,44 @@
+#ifndef _SIP_ROUTES_H
+#define _SIP_ROUTES_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include "level.h"
+
+#define SIP_ROUTE_SLOTS 1024 				/* must be a power of two */
+#define SIP_ROUTE_MAX_PROBE 8 				/* max. slots visited per lookup */
+#define SIP_ROUTE_TTL_NS (1000 * 1000000L) 	/* routes expire after 1s */
+
+/* Operations that can be routed straight to the daemon. */
+#define SIP_ROUTE_OPENAT 1
+#define SIP_ROUTE_FACCESSAT 2
+#define SIP_ROUTE_FSTATAT 3
+#define SIP_ROUTE_FCHMODAT 4
+#define SIP_ROUTE_FCHOWNAT 5
+#define SIP_ROUTE_UNLINKAT 6 				/* keyed by parent directory */
+
+/* Key of an openat route: a file that can't be written may still be read. */
+#define SIP_ROUTE_OPENAT_KEY(flags) (SIP_ROUTE_OPENAT | ((flags) & O_ACCMODE) << 4)
+
+struct sip_route_stats {
+	unsigned long learned; 		/* routes added after a failed native call */
+	unsigned long saved; 		/* native calls skipped */
+};
+
+#if defined(SIP_LIB_LEVEL) && SIP_LIB_LEVEL == SIP_LV_HIGH
+/* HIGH build: no delegation, so there is nothing to route. */
+static inline int sip_route_lookup(const char *pathname, int op) { return 0; }
+static inline void sip_route_learn(const char *pathname, int op) { }
+#else
+int sip_route_lookup(const char *pathname, int op);
+void sip_route_learn(const char *pathname, int op);
+void sip_route_stats(struct sip_route_stats *stats);
+#endif
+
+/* Result of a skipped native call; errno is what the kernel would have set. */
+static inline int sip_route_native_skipped() {
+	errno = EACCES;
+	return -1;
+}
+
+#endif
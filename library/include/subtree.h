@@ -0,0 +1,16 @@
+#ifndef _SIP_SUBTREE_H
+#define _SIP_SUBTREE_H
+
+#include <sys/types.h>
+#include "level.h"
+
+#define SIP_SUBTREE_ROOTS 16 	/* max. operands of a command offloaded */
+
+#if defined(SIP_LIB_LEVEL) && SIP_LIB_LEVEL == SIP_LV_HIGH
+/* HIGH build: nothing is delegated, so nothing is offloaded. */
+static inline int sip_subtree_done(int dirfd, const char *pathname, int flags, int op, mode_t mode, uid_t owner, gid_t group) { return 0; }
+#else
+int sip_subtree_done(int dirfd, const char *pathname, int flags, int op, mode_t mode, uid_t owner, gid_t group);
+#endif
+
+#endif
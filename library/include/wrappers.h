@@ -6,9 +6,9 @@
 #define O_TMPFILE 0
 #endif
 
-/* Macro to help with wrapper definition */
+/* Macro to help with wrapper definition. The real implementation of each
+   wrapped call is reached through sip_real(name); see dlhelper.h. */
 #define sip_wrapper(type, name, ...) \
-	type (*_ ##name)(__VA_ARGS__); \
 	type name(__VA_ARGS__) \
 
 #endif
\ No newline at end of file
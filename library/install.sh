@@ -15,13 +15,13 @@ cd $CWD
 ##############################
 ## Compile shared libraries ##
 ##############################
-make clean lib
+make clean libs
 
 ####################################################
 ## Copy our glibc wrapper libraries into usr/lib/ ##
 ####################################################
 LIB_DIR="/usr/lib/"
-LIBS=("libsipwrap.so")
+LIBS=("libsipwrap.so" "libsipwrap-high.so" "libsipwrap-low.so")
 cp -t $LIB_DIR ${LIBS[@]/#/bin/}
 
 ##################################################################
@@ -35,8 +35,13 @@ chmod u+s ${LIBS[@]/#/$LIB_DIR}
 # Enter the names of overriding libraries (.o files) in /etc/ld.so.preload
 # These "preloading" libraries will take precedence over the standard set.
 # It contains names of libraries to be loaded, separated by white spaces or `:'.
+# The combined library is preloaded system-wide, so processes of the
+# untrusted user that weren't started by the launcher, or that dropped
+# LD_PRELOAD (env -i, cron, su), still get the LOW policy. The launcher puts
+# the LOW library in front of it for untrusted programs, which replaces it.
+PRELOAD_LIBS=("libsipwrap.so")
 libs_appended=0
-for lib in $LIBS
+for lib in "${PRELOAD_LIBS[@]}"
 do
 	if [[ $libs_appended == 0 ]]; then
 		# Overwrites the file
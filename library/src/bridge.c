@@ -1,16 +1,54 @@
+#define _GNU_SOURCE /* memfd_create */
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
 #include "logger.h"
 #include "common.h"
 #include "packets.h"
+#include "ring.h"
+#include "resultcache.h"
+
+/* A call waiting for its response. */
+struct sip_call {
+	unsigned int id;
+	int *fds; 							/* receives the returned descriptors */
+	int max_fds;
+	int status; 						/* 1 while in flight, then 0 or -1 */
+	struct sip_response *response;
+	const char *request; 				/* if others may share the call */
+	struct sip_call *sharers; 			/* calls waiting for our response */
+	pthread_cond_t cond;
+	struct sip_call *next;
+};
 
 static int sockfd = -1;
+static int version = 0; 	/* protocol version agreed with the daemon */
+
+/* The lock protects everything below, plus connection setup. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sip_call *calls; 	/* calls in flight */
+static int receiving; 				/* a thread is reading responses */
+static unsigned int next_id;
+static int notices; 				/* the daemon sends notices (see packets.h) */
+static unsigned int seen; 			/* notices processed */
+static unsigned long epoch; 		/* bumped whenever results are dropped */
+
+/* Shared-memory transport, if the daemon accepted it (see ring.h). The
+   receiving thread owns cq_head; sq_lock protects sq_tail. */
+static struct sip_rings *rings;
+static unsigned int cq_head;
+static pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int sq_tail;
 
 /**
  * Start the helper process.
@@ -30,23 +68,163 @@ static void sip_delegate_start() {
 	sleep(1);
 }
 
+/**
+ * In a forked child, the connection and the calls in flight belong to the
+ * parent. Start over with a connection of our own.
+ */
+static void sip_bridge_reset_child() {
+	pthread_mutex_t unlocked = PTHREAD_MUTEX_INITIALIZER;
+
+	lock = unlocked;
+	sq_lock = unlocked;
+	if (sockfd >= 0)
+		close(sockfd);
+	sockfd = -1;
+	calls = NULL;
+	receiving = 0;
+	notices = 0;
+	seen = 0;
+	sip_result_cache_invalidate(NULL);
+	if (rings != NULL)
+		munmap(rings, sizeof(struct sip_rings));
+	rings = NULL;
+}
+
+/**
+ * Set up shared-memory rings to offer the daemon, if SIP_TRANSPORT=ring is
+ * set in the environment. The memfd is sealed so that the daemon can map it
+ * without fear of it shrinking.
+ *
+ * @param struct sip_rings** map Receives the mapping.
+ * @return The memfd, or -1 if the socket transport should be used.
+ */
+static int sip_rings_create(struct sip_rings **map) {
+	char *transport = getenv("SIP_TRANSPORT");
+	int memfd;
+
+	if (transport == NULL || strcmp(transport, "ring") != 0)
+		return -1;
+
+	memfd = memfd_create("sip-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (memfd == -1)
+		return -1;
+
+	if (ftruncate(memfd, sizeof(struct sip_rings)) == -1 ||
+		fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1 ||
+		(*map = mmap(NULL, sizeof(struct sip_rings), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+		sip_warning("Failed to set up rings: %s. Using the socket.\n", strerror(errno));
+		close(memfd);
+		return -1;
+	}
+
+	return memfd;
+}
+
+/**
+ * Agree on a protocol version with the daemon (see packets.h).
+ *
+ * @return 1 on success, 0 on failure.
+ */
+static int sip_handshake() {
+	struct sip_hello hello;
+	struct sip_rings *map = NULL;
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov = { &hello, sizeof(hello) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	int memfd = sip_rings_create(&map);
+	ssize_t sent;
+
+	hello.magic = SIP_PROTO_MAGIC;
+	hello.min_version = SIP_PROTO_VERSION;
+	hello.max_version = SIP_PROTO_VERSION;
+	hello.flags = SIP_HELLO_NOTICES;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	/* Offer the rings along with the hello. */
+	if (memfd >= 0) {
+		hello.flags |= SIP_HELLO_RING;
+		msg.msg_control = u.buf;
+		msg.msg_controllen = sizeof(u.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	}
+
+	sent = sendmsg(sockfd, &msg, 0);
+
+	if (memfd >= 0)
+		close(memfd);
+
+	if (sent != sizeof(hello)) {
+		sip_error("Failed to send handshake: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	if (recv(sockfd, &hello, sizeof(hello), 0) != sizeof(hello)) {
+		sip_error("Failed to read handshake reply: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	if (hello.magic != SIP_PROTO_MAGIC || hello.min_version != hello.max_version ||
+		hello.min_version < SIP_PROTO_VERSION || hello.max_version > SIP_PROTO_VERSION) {
+		sip_error("Daemon does not speak protocol version %d.\n", SIP_PROTO_VERSION);
+		goto fail;
+	}
+
+	version = hello.max_version;
+	notices = (hello.flags & SIP_HELLO_NOTICES) != 0;
+	seen = 0;
+	epoch++;
+
+	if (map != NULL && (hello.flags & SIP_HELLO_RING)) {
+		rings = map;
+		cq_head = 0;
+		sq_tail = 0;
+	} else if (map != NULL) {
+		sip_warning("Daemon declined rings. Using the socket.\n");
+		munmap(map, sizeof(struct sip_rings));
+	}
+	return 1;
+
+fail:
+	if (map != NULL)
+		munmap(map, sizeof(struct sip_rings));
+	return 0;
+}
+
 /**
  * Establish a connection with the helper. If the helper hasn't been started
- * yet, start it.
+ * yet, start it. Must be called with the lock held.
  *
  * @return 1 on success, 0 on failure.
  */
-static int sip_delegate_connect() {
+static int sip_connect_daemon() {
 	struct sockaddr_un addr;
 	
 	int addrlen = 0;
 	int attempts = 0;
 	int conn = 0;
 
+	static int atfork_set = 0;
+
 	if (sockfd > 0) {
 		return 1;
 	}
 
+	if (!atfork_set) {
+		pthread_atfork(NULL, NULL, sip_bridge_reset_child);
+		atfork_set = 1;
+	}
+
 	/* Create socket. Set SOCK_CLOEXEC flag so socket is not inherited
 	 * by child processes. */
 	sockfd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
@@ -73,98 +251,533 @@ static int sip_delegate_connect() {
 	/* Still not connected? Bail. */
 	if (conn < 0) {
 		sip_error("Failed to start delegator: %s\n", strerror(errno));
+		close(sockfd);
+		sockfd = -1;
+		return 0;
+	}
+
+	if (!sip_handshake()) {
+		close(sockfd);
+		sockfd = -1;
 		return 0;
 	}
 
 	return 1;
 }
 
+static void sip_close_fds(const int *fds, int nfds) {
+	int i;
+
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+}
+
 /**
- * This function can be used to delegate a syscall to the trusted helper. It
- * accepts a pointer to the data to send (one of the structs in packets.h), a
- * the number of bytes to send, and a pointer to a sip_response struct. On
- * error, it returns -1. On success, it returns 0 and copies the response to
- * the response buffer.
+ * Receive a message from the daemon along with the descriptors attached to
+ * it. If more than SIP_MAX_FDS were attached, the call fails.
  *
- * @param  void* request
- * @param  struct sip_response* response
- * @return int -1 on error, 0 on success.
+ * @param int* fds Buffer of SIP_MAX_FDS descriptors.
+ * @param int* nfds Receives the number of descriptors.
+ * @return Same as recv(2).
  */
-int sip_delegate_call(void *request, struct sip_response *response) {
-	
-	struct sip_header *head = (struct sip_header*) request;
-	ssize_t sent, received;
+static ssize_t sip_receive_with_fds(void *data, size_t size, int *fds, int *nfds) {
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov = { data, size };
+	ssize_t received;
+	union {
+		char buf[CMSG_SPACE(SIP_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+
+	*nfds = 0;
+
+	if ((received = recvmsg(sockfd, &msg, 0)) < 0)
+		return received;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+		}
+	}
 
-	if (!sip_delegate_connect()) {
+	if (msg.msg_flags & MSG_CTRUNC) {
+		sip_close_fds(fds, *nfds);
+		*nfds = 0;
+		errno = EPROTO;
 		return -1;
 	}
 
-	sent = send(sockfd, request, head->size, 0);
+	return received;
+}
 
-	if (sent == -1) {
-		sip_error("Failed to send syscall request: %s\n", strerror(errno));
+/**
+ * Send data over the socket with descriptors attached.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int sip_send_with_fds(void *data, size_t size, const int *fds, int nfds) {
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov = { data, size };
+	union {
+		char buf[CMSG_SPACE(SIP_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		msg.msg_control = u.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	return sendmsg(sockfd, &msg, 0) == -1 ? -1 : 0;
+}
+
+/**
+ * Send an encoded request and its descriptors over the transport in use.
+ * With the rings, the descriptors go over the socket just ahead of the
+ * request, in submission order.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int sip_send_request(void *request, size_t size, const int *fds, int nfds) {
+	struct sip_ring_request *entry;
+	unsigned int head;
+	char byte = 0;
+
+	if (rings == NULL)
+		return sip_send_with_fds(request, size, fds, nfds);
+
+	pthread_mutex_lock(&sq_lock);
+
+	if (nfds > 0 && sip_send_with_fds(&byte, 1, fds, nfds) == -1) {
+		pthread_mutex_unlock(&sq_lock);
 		return -1;
 	}
 
-	received = recv(sockfd, response, sizeof(struct sip_response), 0);
+	while (sq_tail - (head = __atomic_load_n(&rings->sq.head, __ATOMIC_ACQUIRE)) >= SIP_RING_ENTRIES) {
+		if (sip_ring_wait(&rings->sq.head, &rings->sq.head_waiting, head) == -1 && !sip_peer_alive(sockfd)) {
+			pthread_mutex_unlock(&sq_lock);
+			errno = EPIPE;
+			return -1;
+		}
+	}
+
+	entry = &rings->sqe[sq_tail & (SIP_RING_ENTRIES - 1)];
+	entry->size = size;
+	memcpy(entry->packet, request, size);
+	sip_ring_publish(&rings->sq.tail, &rings->sq.tail_waiting, ++sq_tail);
+
+	pthread_mutex_unlock(&sq_lock);
+	return 0;
+}
+
+/**
+ * Drop the cached results a notice from the daemon refers to. If notices
+ * were missed, all of them are dropped. Must be called with the lock held.
+ *
+ * @param size_t size Bytes received.
+ */
+static void sip_handle_notice(const struct sip_response *notice, size_t size) {
+	if (size < offsetof(struct sip_response, buf) || size != SIP_RESPONSE_SIZE(notice) ||
+		notice->id != SIP_NOTICE_ID || notice->nfds != 0) {
+		sip_warning("Malformed notice (%zu bytes).\n", size);
+		sip_result_cache_invalidate(NULL);
+	} else if (notice->notices - seen != 1 || notice->size == 0 || notice->buf[notice->size - 1] != '\0') {
+		sip_result_cache_invalidate(NULL);
+	} else {
+		sip_result_cache_invalidate(notice->buf);
+	}
+
+	if ((int) (notice->notices - seen) > 0)
+		seen = notice->notices;
+	epoch++;
+}
+
+/**
+ * Process the notices waiting on the socket, without blocking. Stops at a
+ * message that carries descriptors for the rings. Must be called with the
+ * lock held, by the thread that may read the socket.
+ */
+static void sip_drain_notices() {
+	struct sip_response notice;
+	int fds[SIP_MAX_FDS], nfds;
+	ssize_t received;
+	char byte;
+
+	while (recv(sockfd, &byte, 1, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT) > 1) {
+		if ((received = sip_receive_with_fds(&notice, sizeof(notice), fds, &nfds)) <= 0)
+			break;
+		sip_close_fds(fds, nfds);
+		sip_handle_notice(&notice, received);
+	}
+}
+
+/**
+ * Catch up with the notices the daemon counted in a message. If some of
+ * them haven't arrived, they were dropped: all results are dropped with
+ * them. Must be called with the lock held, by the thread that may read the
+ * socket.
+ */
+static void sip_sync_notices(unsigned int count) {
+	if ((int) (count - seen) <= 0)
+		return;
+
+	if (rings != NULL)
+		sip_drain_notices();
+
+	if ((int) (count - seen) > 0) {
+		sip_result_cache_invalidate(NULL);
+		seen = count;
+		epoch++;
+	}
+}
+
+/**
+ * Receive the next response and its descriptors over the transport in use.
+ * Only the receiving thread may call this.
+ *
+ * @param int* fds Buffer of SIP_MAX_FDS descriptors.
+ * @param int* nfds Receives the number of descriptors.
+ * @return Same as recv(2).
+ */
+static ssize_t sip_receive(struct sip_response *buf, int *fds, int *nfds) {
+	struct sip_response *entry;
+	struct sip_response notice;
+	ssize_t received;
+	size_t size;
+
+	if (rings == NULL)
+		return sip_receive_with_fds(buf, sizeof(struct sip_response), fds, nfds);
+
+	*nfds = 0;
+
+	while (__atomic_load_n(&rings->cq.tail, __ATOMIC_ACQUIRE) == cq_head) {
+		if (sip_ring_wait(&rings->cq.tail, &rings->cq.tail_waiting, cq_head) == -1 && !sip_peer_alive(sockfd)) {
+			errno = ECONNRESET;
+			return 0;
+		}
+	}
+
+	entry = &rings->cqe[cq_head & (SIP_RING_ENTRIES - 1)];
+	size = SIP_RESPONSE_SIZE(entry);
+	if (size > sizeof(struct sip_response))
+		size = sizeof(struct sip_response);
+	memcpy(buf, entry, size);
+
+	sip_ring_publish(&rings->cq.head, &rings->cq.head_waiting, ++cq_head);
+
+	/* The descriptors were sent over the socket just before the response
+	   was completed, in a message of one byte. Notices may come first. */
+	while (size >= offsetof(struct sip_response, buf) && buf->nfds > 0) {
+		if ((received = sip_receive_with_fds(&notice, sizeof(notice), fds, nfds)) <= 0)
+			return -1;
+		if (received == 1)
+			break;
+
+		sip_close_fds(fds, *nfds);
+		*nfds = 0;
+
+		pthread_mutex_lock(&lock);
+		sip_handle_notice(&notice, received);
+		pthread_mutex_unlock(&lock);
+	}
+
+	return size;
+}
+
+/**
+ * Receive one response and hand it to the call it belongs to. Called without
+ * the lock held, by at most one thread at a time.
+ *
+ * @param struct sip_response* buf Buffer to receive into.
+ * @return 0 on success, -1 if the connection is unusable.
+ */
+static int sip_receive_response(struct sip_response *buf) {
+	struct sip_call *call;
+	ssize_t received;
+	int fds[SIP_MAX_FDS], nfds, kept;
+
+	received = sip_receive(buf, fds, &nfds);
 
 	if (received <= 0) {
 		sip_error("Failed to read syscall response: %s\n", strerror(errno));
 		return -1;
 	}
+
+	if (received < offsetof(struct sip_response, buf) || received != SIP_RESPONSE_SIZE(buf) || buf->nfds != nfds) {
+		sip_error("Malformed syscall response (%zd bytes, %d descriptors).\n", received, nfds);
+		sip_close_fds(fds, nfds);
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	if (buf->id == SIP_NOTICE_ID) {
+		sip_handle_notice(buf, received);
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	sip_sync_notices(buf->notices);
+
+	for (call = calls; call != NULL && call->id != buf->id; call = call->next)
+		;
+	pthread_mutex_unlock(&lock);
+
+	/* A call stays in the list until it is completed, which only the
+	   receiving thread does, so call remains valid until marked done below. */
+	if (call == NULL) {
+		sip_error("Dropping response to unknown request %u.\n", buf->id);
+		sip_close_fds(fds, nfds);
+		return 0;
+	}
+
+	/* Hand over the descriptors the caller asked for and drop the rest. */
+	kept = nfds < call->max_fds ? nfds : call->max_fds;
+	memcpy(call->fds, fds, kept * sizeof(int));
+	sip_close_fds(fds + kept, nfds - kept);
+	buf->nfds = kept;
+
+	if (call->response != buf)
+		memcpy(call->response, buf, SIP_RESPONSE_SIZE(buf));
+
+	pthread_mutex_lock(&lock);
+	call->status = 0;
+	pthread_cond_signal(&call->cond);
+	pthread_mutex_unlock(&lock);
+
 	return 0;
 }
 
 /**
- * Special version of sip_delegate_call that expects a file descriptor in the
- * response. Must be used for calls like openat(2) that return a descriptor.
+ * Find a call in flight that sends the same request. Must be called with
+ * the lock held.
  */
-int sip_delegate_call_fd(void *request, struct sip_response *response) {
+static struct sip_call *sip_find_shared(const char *request, const struct sip_header *head) {
+	struct sip_header other;
+	struct sip_call *call;
+
+	for (call = calls; call != NULL; call = call->next) {
+		if (call->request == NULL || call->status <= 0)
+			continue;
+
+		memcpy(&other, call->request, sizeof(other));
+
+		if (other.callno == head->callno && other.size == head->size &&
+			memcmp(call->request + sizeof(other), request + sizeof(other), head->size - sizeof(other)) == 0)
+			return call;
+	}
 
-	int rv = sip_delegate_call(request, response);
+	return NULL;
+}
 
-	if (rv == 0 && response->err == 0) {	/* success! expect a descriptor. */
+/**
+ * Send a request and wait for its response. Any number of threads can have
+ * calls in flight on the connection. Whichever waiting thread finds nobody
+ * receiving becomes the receiver: it reads responses and hands them to
+ * their callers until its own arrives, then passes the role on.
+ *
+ * A request for a call in SIP_CALL_SHAREABLE that refers to no descriptors
+ * is not sent if the same request is already in flight: the caller waits
+ * for that one's response instead. Any other request stops the calls in
+ * flight from being shared, since it may change what they would return.
+ * Results of such requests are also kept in the result cache (see
+ * resultcache.c) and answered from it while the daemon sends no notice
+ * that they may have changed.
+ *
+ * @return -1 on error, 0 on success.
+ */
+static int sip_submit(void *request, const int *fds, int nfds, struct sip_response *response, int *rfds, int max_rfds) {
+	struct sip_call self, **link, *call, *next;
+	struct sip_header head;
+	unsigned long sent_epoch;
+	ssize_t sent;
+	int shareable;
 
-		struct msghdr msg = {0};
-		struct cmsghdr *cmsg;
-		int myfd[1], *fdptr;
-		char data[5];
-		struct iovec iov[1];
+	memcpy(&head, request, sizeof(head));
+	shareable = SIP_CALL_SHAREABLE(head.callno) && nfds == 0 && max_rfds == 0;
 
-		/* need to transfer at least one byte of non-ancillary data */
-		iov[0].iov_base = &data;
-		iov[0].iov_len = 5;
+	pthread_mutex_lock(&lock);
 
-		union {
-		   /* ancillary data buffer, wrapped in a union in order to ensure
-		      it is suitably aligned */
-		   char buf[CMSG_SPACE(sizeof myfd)];
-		   struct cmsghdr align;
-		} u;
+	if (!sip_connect_daemon()) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
 
-		msg.msg_iov = iov;
-		msg.msg_iovlen = 1;
-		msg.msg_control = u.buf;
-		msg.msg_controllen = sizeof u.buf;
+	if (shareable && notices) {
+		/* Catch up with the notices first, unless responses may be
+		   waiting on the socket or another thread is reading it. */
+		if (!receiving && (rings != NULL || calls == NULL))
+			sip_drain_notices();
 
-		if (recvmsg(sockfd, &msg, 0) <= 0) {
-			sip_error("Failed to receive descriptor from helper: %s\n", strerror(errno));
-			return -1;
+		if (sip_result_cache_lookup(request, response)) {
+			pthread_mutex_unlock(&lock);
+			return 0;
 		}
+	}
 
-		cmsg = CMSG_FIRSTHDR(&msg);
+	self.status = 1;
+	self.response = response;
+	pthread_cond_init(&self.cond, NULL);
 
-		if (cmsg == NULL) {
-			sip_error("Failed to receive descriptor from helper: msg_control is empty.\n");
-			return -1;
+	if (shareable && (call = sip_find_shared(request, &head)) != NULL) {
+		self.next = call->sharers;
+		call->sharers = &self;
+
+		while (self.status > 0)
+			pthread_cond_wait(&self.cond, &lock);
+
+		pthread_mutex_unlock(&lock);
+		pthread_cond_destroy(&self.cond);
+
+		return self.status;
+	}
+
+	if (!shareable) {
+		for (call = calls; call != NULL; call = call->next)
+			call->request = NULL;
+	}
+
+	if (++next_id == SIP_NOTICE_ID)
+		++next_id;
+	self.id = next_id;
+	self.fds = rfds;
+	self.max_fds = max_rfds;
+	self.request = shareable ? request : NULL;
+	self.sharers = NULL;
+	self.next = calls;
+	calls = &self;
+	sent_epoch = epoch;
+
+	pthread_mutex_unlock(&lock);
+
+	head.id = self.id;
+	memcpy(request, &head, sizeof(head));
+
+	sent = sip_send_request(request, head.size, fds, nfds);
+
+	pthread_mutex_lock(&lock);
+
+	if (sent == -1) {
+		sip_error("Failed to send syscall request: %s\n", strerror(errno));
+		self.status = -1;
+	}
+
+	while (self.status > 0) {
+		if (receiving) {
+			pthread_cond_wait(&self.cond, &lock);
+			continue;
 		}
 
-		fdptr = (int *) CMSG_DATA(cmsg);
-		memcpy(&myfd, fdptr, sizeof(int));
+		receiving = 1;
+		pthread_mutex_unlock(&lock);
 
-		sip_info("Success! Received descriptor %d from helper.\n", myfd[0]);
-		return 0;
+		int rv = sip_receive_response(response);
+
+		pthread_mutex_lock(&lock);
+		receiving = 0;
+
+		/* Connection is broken: fail every call in flight. */
+		if (rv == -1) {
+			struct sip_call *call;
+
+			for (call = calls; call != NULL; call = call->next) {
+				call->status = -1;
+				pthread_cond_signal(&call->cond);
+			}
+		}
 	}
 
-	return -1;
+	for (link = &calls; *link != &self; link = &(*link)->next)
+		;
+	*link = self.next;
+
+	/* Keep the result unless a notice came in since the request was sent. */
+	if (self.status == 0 && shareable && notices && epoch == sent_epoch)
+		sip_result_cache_store(request, response);
+
+	/* Hand the response to the calls that shared ours. */
+	for (call = self.sharers; call != NULL; call = next) {
+		next = call->next;
+		if (self.status == 0)
+			memcpy(call->response, response, SIP_RESPONSE_SIZE(response));
+		call->status = self.status;
+		pthread_cond_signal(&call->cond);
+	}
+
+	/* Pass the receiver role on to another waiting thread. */
+	if (calls != NULL && !receiving)
+		pthread_cond_signal(&calls->cond);
+
+	pthread_mutex_unlock(&lock);
+	pthread_cond_destroy(&self.cond);
+
+	return self.status;
+}
+
+/**
+ * This function can be used to delegate a syscall to the trusted helper. It
+ * accepts a pointer to an encoded request (a struct sip_header followed by
+ * the fields of the call, see packets.h), the descriptors to send with it,
+ * and a pointer to a sip_response struct. On error, it returns -1. On
+ * success, it returns 0 and copies the response to the response buffer. The
+ * request ID is filled in here.
+ *
+ * @param  void* request
+ * @param  int* fds Descriptors the request refers to (head.nfds of them).
+ * @param  int nfds
+ * @param  struct sip_response* response
+ * @return int -1 on error, 0 on success.
+ */
+int sip_delegate_call(void *request, const int *fds, int nfds, struct sip_response *response) {
+	return sip_submit(request, fds, nfds, response, NULL, 0);
+}
+
+/**
+ * Version of sip_delegate_call for calls that return descriptors. On
+ * success, the response->nfds descriptors attached to the response are
+ * stored in rfds; any beyond max_rfds are closed.
+ *
+ * @param  int* rfds Buffer for the returned descriptors.
+ * @param  int max_rfds Size of rfds.
+ */
+int sip_delegate_call_fds(void *request, const int *fds, int nfds, struct sip_response *response, int *rfds, int max_rfds) {
+	return sip_submit(request, fds, nfds, response, rfds, max_rfds);
+}
+
+/**
+ * Special version of sip_delegate_call that expects a file descriptor in the
+ * response. Must be used for calls like openat(2) that return a descriptor.
+ * On success, response->rv is the received descriptor.
+ */
+int sip_delegate_call_fd(void *request, const int *fds, int nfds, struct sip_response *response) {
+	int fd;
+
+	if (sip_submit(request, fds, nfds, response, &fd, 1) == -1)
+		return -1;
+
+	if (response->rv >= 0) {
+		if (response->nfds != 1) {
+			sip_error("Response to call %u is missing its descriptor.\n", response->id);
+			return -1;
+		}
+		response->rv = fd;
+	}
+
+	return 0;
 }
@@ -0,0 +1,241 @@
+/**
+ * Client-side stubs for the calls in SIP_DELEGATED_CALLS (see packets.h).
+ * Each stub builds the request for its call and sends it to the daemon.
+ */
+
+#define _GNU_SOURCE /* O_PATH */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include "delegate.h"
+#include "bridge.h"
+#include "dlhelper.h"
+
+/**
+ * Append a string field to a request: its length, including the NUL, as an
+ * unsigned short, then the string. The caller has reserved PATH_MAX bytes
+ * after the length.
+ *
+ * @param char* pos Where to write the field.
+ * @param char* str String to write.
+ * @return Position after the field, or NULL if str is too long.
+ */
+static char *sip_put_str(char *pos, const char *str) {
+	char *dest = pos + sizeof(unsigned short);
+	size_t len = strlen(str) + 1;
+	unsigned short wirelen = len;
+
+	if (len > PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	memcpy(pos, &wirelen, sizeof(wirelen));
+	memcpy(dest, str, len);
+
+	return dest + len;
+}
+
+/**
+ * Attach a descriptor to a request.
+ *
+ * @return Its index, or -1 if there is no room.
+ */
+static int sip_attach(struct sip_attached *attached, int fd) {
+	int i;
+
+	for (i = 0; i < attached->count; i++) {
+		if (attached->fds[i] == fd)
+			return i;
+	}
+
+	if (attached->count == SIP_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	attached->fds[attached->count] = fd;
+	return attached->count++;
+}
+
+/**
+ * Append a PATH field for dirfd/pathname to a request. Absolute paths are
+ * sent as-is. Otherwise the daemon gets the directory descriptor, so it can
+ * run the call relative to it; for AT_FDCWD we open "." to send. An empty
+ * pathname refers to the file dirfd itself. In a compound request, dirfd
+ * can also be SIP_STEP_FD(i) for one of the steps before it.
+ *
+ * @param int steps Number of steps before this one.
+ * @return Position after the field, or NULL on error.
+ */
+static char *sip_put_path(char *pos, struct sip_attached *attached, int steps, int dirfd, const char *pathname) {
+	signed char index = -1;
+	int fd = dirfd;
+
+	if (dirfd <= SIP_STEP_FD(0)) {
+		if (SIP_STEP_FD(dirfd) >= steps) {
+			errno = EBADF;
+			return NULL;
+		}
+		index = SIP_MAX_FDS + SIP_STEP_FD(dirfd);
+	} else if (pathname[0] != '/') {
+		if (dirfd == AT_FDCWD) {
+			if (attached->cwd < 0) {
+				if ((fd = sip_real(openat)(AT_FDCWD, ".", O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1)
+					return NULL;
+				if ((attached->cwd = sip_attach(attached, fd)) < 0) {
+					sip_real(close)(fd);
+					return NULL;
+				}
+			}
+			index = attached->cwd;
+		} else if ((index = sip_attach(attached, fd)) < 0) {
+			return NULL;
+		}
+	}
+
+	*pos = index;
+	return sip_put_str(pos + sizeof(index), pathname);
+}
+
+/**
+ * Send a request with its descriptors, then close the descriptor we opened
+ * for the working directory, if any.
+ */
+static int sip_send_attached(void *packet, struct sip_attached *attached, int returns_fd, struct sip_response *response) {
+	int rv;
+
+	if (returns_fd)
+		rv = sip_delegate_call_fd(packet, attached->fds, attached->count, response);
+	else
+		rv = sip_delegate_call(packet, attached->fds, attached->count, response);
+
+	if (attached->cwd >= 0)
+		sip_real(close)(attached->fds[attached->cwd]);
+
+	return rv;
+}
+
+/* Generate sip_delegate_<name>() for every delegated call. Each stub encodes
+   its request into a buffer sized for the worst case, but only the encoded
+   bytes are sent. */
+#define SIP_PUT(kind, type, field) SIP_PUT_ ##kind(type, field)
+#define SIP_PUT_PATH(type, field) 										\
+	if ((pos = sip_put_path(pos, attached, steps, field ##_dirfd, field)) == NULL) \
+		goto fail;
+#define SIP_PUT_STR(type, field) 											\
+	if ((pos = sip_put_str(pos, field)) == NULL) 						\
+		goto fail;
+#define SIP_PUT_VAL(type, field) 											\
+	memcpy(pos, &field, sizeof(type)); 									\
+	pos += sizeof(type);
+#define SIP_PUT_PAIR(type, field) 										\
+	memcpy(pos, field, 2 * sizeof(type)); 								\
+	pos += 2 * sizeof(type);
+
+#define SIP_DELEGATE_STUB(name, nr, returns_fd) 						\
+	int sip_delegate_ ##name(struct sip_response *response SIP_FIELDS_ ##name(SIP_PARAM)) { \
+		char packet[SIP_WIRE_MAX(name)]; 									\
+		struct sip_attached request = { .count = 0, .cwd = -1 }; 		\
+		struct sip_attached *attached = &request; 							\
+		struct sip_header head; 											\
+		char *pos = packet + sizeof(head); 								\
+		int steps __attribute__((unused)) = 0; 								\
+																			\
+		SIP_FIELDS_ ##name(SIP_PUT) 										\
+																			\
+		head.callno = nr; 													\
+		head.size = pos - packet; 											\
+		head.nfds = attached->count; 										\
+		memcpy(packet, &head, sizeof(head)); 								\
+																			\
+		return sip_send_attached(packet, attached, returns_fd, response); \
+																			\
+	fail: __attribute__((unused)) 											\
+		if (attached->cwd >= 0) 											\
+			sip_real(close)(attached->fds[attached->cwd]); 				\
+		return -1; 															\
+	}
+
+SIP_DELEGATED_CALLS(SIP_DELEGATE_STUB)
+
+/**
+ * Start building a compound request.
+ */
+void sip_compound_init(struct sip_compound *compound) {
+	compound->pos = compound->packet + sizeof(struct sip_header) + sizeof(unsigned char);
+	compound->attached.count = 0;
+	compound->attached.cwd = -1;
+	compound->steps = 0;
+	compound->err = 0;
+}
+
+/* Generate sip_compound_<name>() for every delegated call. Each appends a
+   step to the compound: its struct sip_step, then its fields, encoded
+   first into a buffer sized for the worst case. */
+#define SIP_COMPOUND_STUB(name, nr, returns_fd) 						\
+	int sip_compound_ ##name(struct sip_compound *compound, unsigned short step_flags SIP_FIELDS_ ##name(SIP_PARAM)) { \
+		char fields[SIP_WIRE_MAX(name)]; 									\
+		struct sip_attached *attached __attribute__((unused)) = &compound->attached; \
+		struct sip_step step = { nr, step_flags }; 								\
+		char *pos = fields; 												\
+		int steps = compound->steps; 										\
+																			\
+		if (compound->err) 												\
+			return -1; 														\
+		if (steps == SIP_MAX_STEPS) { 										\
+			errno = E2BIG; 													\
+			goto fail; 														\
+		} 																	\
+																			\
+		SIP_FIELDS_ ##name(SIP_PUT) 										\
+																			\
+		if (compound->pos + sizeof(step) + (pos - fields) > compound->packet + SIP_COMPOUND_SZ) { \
+			errno = E2BIG; 													\
+			goto fail; 														\
+		} 																	\
+																			\
+		memcpy(compound->pos, &step, sizeof(step)); 						\
+		memcpy(compound->pos + sizeof(step), fields, pos - fields); 		\
+		compound->pos += sizeof(step) + (pos - fields); 					\
+		return compound->steps++; 											\
+																			\
+	fail: 																	\
+		compound->err = errno; 											\
+		return -1; 															\
+	}
+
+SIP_DELEGATED_CALLS(SIP_COMPOUND_STUB)
+
+/**
+ * Send a compound request and release it. On success, the descriptors
+ * returned by its steps are stored in fds (see sip_delegate_call_fds).
+ *
+ * @return -1 if the request could not be built or delivered, 0 otherwise.
+ */
+int sip_delegate_compound(struct sip_compound *compound, struct sip_response *response, int *fds, int max_fds) {
+	struct sip_attached *attached = &compound->attached;
+	struct sip_header head;
+	int rv = -1;
+
+	if (compound->err) {
+		errno = compound->err;
+	} else if (compound->steps > 0) {
+		head.callno = SYS_compound;
+		head.size = compound->pos - compound->packet;
+		head.nfds = attached->count;
+		memcpy(compound->packet, &head, sizeof(head));
+		compound->packet[sizeof(head)] = compound->steps;
+
+		rv = sip_delegate_call_fds(compound->packet, attached->fds, attached->count, response, fds, max_fds);
+	}
+
+	if (attached->cwd >= 0)
+		sip_real(close)(attached->fds[attached->cwd]);
+	attached->cwd = -1;
+
+	return rv;
+}
@@ -0,0 +1,512 @@
+/**
+ * Directory listings for low integrity processes.
+ *
+ * A LOW process can't list a directory it may not read, and tools that list
+ * one (ls -l, du) go on to stat every entry, each stat being delegated on
+ * its own. When opendir() fails for lack of permissions, the whole listing
+ * is fetched from the daemon with SYS_readdirplus, which includes the
+ * attributes of every entry, and the directory stream is served from that
+ * copy. The listing is also kept for SIP_DIRCACHE_TTL_NS, so that stats of
+ * its entries are answered without asking the daemon again. Calls that
+ * change the file system drop all cached listings.
+ *
+ * Emulated streams are handed out as DIR pointers; the directory wrappers
+ * tell them apart from real ones by looking them up in a list. The list is
+ * only searched while emulated streams exist.
+ */
+
+#define _GNU_SOURCE /* struct dirent64, CLOCK_MONOTONIC_COARSE */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dircache.h"
+#include "delegate.h"
+#include "dlhelper.h"
+#include "fdtable.h"
+#include "logger.h"
+
+struct sip_listing {
+	char *path; 				/* absolute path of the directory, or NULL */
+	long expires; 				/* ns */
+	int refs; 					/* streams using it, plus 1 while cached */
+	char *data; 				/* struct sip_dirent records */
+	size_t size;
+	unsigned int count;
+	unsigned int mask; 			/* index size - 1 */
+	size_t *index; 				/* name hash -> record offset + 1 */
+};
+
+struct sip_dir {
+	struct sip_listing *listing;
+	size_t offset; 				/* of the next record */
+	long pos; 					/* records read */
+	struct dirent entry;
+	struct dirent64 entry64;
+	struct sip_dir *next;
+};
+
+/* The lock protects everything below. The counts may be read without it
+   to skip the search when there is nothing to find. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sip_listing *cache[SIP_DIRCACHE_SLOTS];
+static struct sip_dir *dirs;
+static int ncached;
+static int ndirs;
+
+static long sip_dircache_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static uint64_t sip_dircache_hash(const char *name) {
+	uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+
+	while (*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * Drop a reference to a listing. Must be called with the lock held.
+ */
+static void sip_listing_put(struct sip_listing *listing) {
+	if (--listing->refs > 0)
+		return;
+
+	free(listing->path);
+	free(listing->data);
+	free(listing->index);
+	free(listing);
+}
+
+/**
+ * Append the records of one batch to a listing, checking that each is well
+ * formed.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int sip_listing_append(struct sip_listing *listing, int memfd, unsigned int count) {
+	struct sip_dirent *rec;
+	struct stat sbuf;
+	size_t size, offset;
+	char *batch, *data;
+	unsigned int i;
+
+	if (count == 0)
+		return 0;
+
+	if (sip_real_fstat(memfd, &sbuf) == -1)
+		return -1;
+
+	size = sbuf.st_size;
+	batch = mmap(NULL, size, PROT_READ, MAP_PRIVATE, memfd, 0);
+
+	if (batch == MAP_FAILED)
+		return -1;
+
+	for (i = 0, offset = 0; i < count; i++, offset += rec->reclen) {
+		rec = (struct sip_dirent *) (batch + offset);
+
+		if (size - offset < offsetof(struct sip_dirent, name) || rec->reclen > size - offset ||
+			rec->reclen <= offsetof(struct sip_dirent, name) || (rec->reclen & 7) ||
+			memchr(rec->name, '\0', rec->reclen - offsetof(struct sip_dirent, name)) == NULL)
+			goto malformed;
+	}
+
+	if ((data = realloc(listing->data, listing->size + offset)) == NULL)
+		goto fail;
+
+	memcpy(data + listing->size, batch, offset);
+	listing->data = data;
+	listing->size += offset;
+	listing->count += count;
+
+	munmap(batch, size);
+	return 0;
+
+malformed:
+	sip_error("Malformed directory listing from daemon.\n");
+	errno = EIO;
+fail:
+	munmap(batch, size);
+	return -1;
+}
+
+/**
+ * Build the index used to look up entries by name.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int sip_listing_index(struct sip_listing *listing) {
+	struct sip_dirent *rec;
+	size_t offset, slots = 1;
+	uint64_t hash;
+
+	while (slots < 2 * (size_t) listing->count)
+		slots <<= 1;
+
+	if ((listing->index = calloc(slots, sizeof(size_t))) == NULL)
+		return -1;
+
+	listing->mask = slots - 1;
+
+	for (offset = 0; offset < listing->size; offset += rec->reclen) {
+		rec = (struct sip_dirent *) (listing->data + offset);
+		hash = sip_dircache_hash(rec->name);
+
+		while (listing->index[hash & listing->mask] != 0)
+			hash++;
+		listing->index[hash & listing->mask] = offset + 1;
+	}
+	return 0;
+}
+
+/**
+ * Fetch the listing of a directory from the daemon, one batch at a time.
+ *
+ * @return The listing with one reference, or NULL with errno set.
+ */
+static struct sip_listing *sip_listing_fetch(int dirfd, const char *name) {
+	struct sip_listing *listing;
+	struct sip_readdir_result result = { 0, 0, 0 };
+	int memfd, err;
+
+	SIP_PREPARE_RES(response);
+
+	if ((listing = calloc(1, sizeof(*listing))) == NULL)
+		return NULL;
+
+	listing->refs = 1;
+
+	while (!result.eof) {
+		if (sip_delegate_readdirplus(&response, dirfd, name, result.cookie) == -1)
+			goto fail;
+
+		if (response.rv < 0) {
+			errno = response.err;
+			goto fail;
+		}
+
+		memfd = response.rv;
+
+		if (response.size != sizeof(result)) {
+			sip_real(close)(memfd);
+			errno = EIO;
+			goto fail;
+		}
+
+		memcpy(&result, response.buf, sizeof(result));
+
+		err = sip_listing_append(listing, memfd, result.count) == -1 ? errno : 0;
+		sip_real(close)(memfd);
+
+		if (err) {
+			errno = err;
+			goto fail;
+		}
+	}
+
+	if (sip_listing_index(listing) == -1)
+		goto fail;
+
+	return listing;
+
+fail:
+	err = errno;
+	sip_listing_put(listing);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * Keep a listing for stat lookups, replacing an expired one or the one
+ * closest to expiring. Must be called with the lock held.
+ */
+static void sip_dircache_insert(struct sip_listing *listing) {
+	int i, victim = 0;
+
+	for (i = 0; i < SIP_DIRCACHE_SLOTS; i++) {
+		if (cache[i] == NULL) {
+			victim = i;
+			break;
+		}
+		if (cache[i]->expires < cache[victim]->expires)
+			victim = i;
+	}
+
+	if (cache[victim] != NULL)
+		sip_listing_put(cache[victim]);
+	else
+		__atomic_add_fetch(&ncached, 1, __ATOMIC_RELAXED);
+
+	listing->refs++;
+	cache[victim] = listing;
+}
+
+/**
+ * Open an emulated stream for a directory the process can't read, listing
+ * it through the daemon.
+ *
+ * @return Stream, or NULL with errno set.
+ */
+DIR *sip_dir_open(int dirfd, const char *name) {
+	char path[PATH_MAX];
+	struct sip_listing *listing;
+	struct sip_dir *dir;
+	size_t len;
+
+	if ((dir = calloc(1, sizeof(*dir))) == NULL)
+		return NULL;
+
+	if ((listing = sip_listing_fetch(dirfd, name)) == NULL) {
+		free(dir);
+		return NULL;
+	}
+
+	dir->listing = listing;
+
+	/* Keyed without trailing slashes, as sip_dircache_stat() splits paths. */
+	if (sip_fd_abs_path(dirfd, name, path) != NULL) {
+		for (len = strlen(path); len > 1 && path[len - 1] == '/'; len--)
+			path[len - 1] = '\0';
+		listing->path = strdup(path);
+	}
+
+	listing->expires = sip_dircache_now() + SIP_DIRCACHE_TTL_NS;
+
+	pthread_mutex_lock(&lock);
+
+	if (listing->path != NULL)
+		sip_dircache_insert(listing);
+
+	dir->next = dirs;
+	dirs = dir;
+	__atomic_add_fetch(&ndirs, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&lock);
+
+	return (DIR *) dir;
+}
+
+/**
+ * Check whether a stream was opened by sip_dir_open().
+ */
+int sip_dir_is_emulated(DIR *dirp) {
+	struct sip_dir *dir;
+
+	if (__atomic_load_n(&ndirs, __ATOMIC_RELAXED) == 0)
+		return 0;
+
+	pthread_mutex_lock(&lock);
+	for (dir = dirs; dir != NULL && (DIR *) dir != dirp; dir = dir->next)
+		;
+	pthread_mutex_unlock(&lock);
+
+	return dir != NULL;
+}
+
+/**
+ * Take the next record off an emulated stream.
+ *
+ * @return The record, or NULL at the end of the directory.
+ */
+static struct sip_dirent *sip_dir_next(struct sip_dir *dir) {
+	struct sip_dirent *rec;
+
+	if (dir->offset >= dir->listing->size)
+		return NULL;
+
+	rec = (struct sip_dirent *) (dir->listing->data + dir->offset);
+	dir->offset += rec->reclen;
+	dir->pos++;
+
+	return rec;
+}
+
+/**
+ * readdir(3) for emulated streams.
+ */
+struct dirent *sip_dir_read(DIR *dirp) {
+	struct sip_dir *dir = (struct sip_dir *) dirp;
+	struct sip_dirent *rec = sip_dir_next(dir);
+
+	if (rec == NULL)
+		return NULL;
+
+	dir->entry.d_ino = rec->stat.st_ino;
+	dir->entry.d_off = dir->pos;
+	dir->entry.d_reclen = sizeof(dir->entry);
+	dir->entry.d_type = rec->type;
+	strncpy(dir->entry.d_name, rec->name, sizeof(dir->entry.d_name) - 1);
+
+	return &dir->entry;
+}
+
+/**
+ * readdir64(3) for emulated streams.
+ */
+struct dirent64 *sip_dir_read64(DIR *dirp) {
+	struct sip_dir *dir = (struct sip_dir *) dirp;
+	struct sip_dirent *rec = sip_dir_next(dir);
+
+	if (rec == NULL)
+		return NULL;
+
+	dir->entry64.d_ino = rec->stat.st_ino;
+	dir->entry64.d_off = dir->pos;
+	dir->entry64.d_reclen = sizeof(dir->entry64);
+	dir->entry64.d_type = rec->type;
+	strncpy(dir->entry64.d_name, rec->name, sizeof(dir->entry64.d_name) - 1);
+
+	return &dir->entry64;
+}
+
+/**
+ * closedir(3) for emulated streams.
+ */
+int sip_dir_close(DIR *dirp) {
+	struct sip_dir *dir = (struct sip_dir *) dirp, **link;
+
+	pthread_mutex_lock(&lock);
+
+	for (link = &dirs; *link != dir; link = &(*link)->next)
+		;
+	*link = dir->next;
+	__atomic_sub_fetch(&ndirs, 1, __ATOMIC_RELAXED);
+
+	sip_listing_put(dir->listing);
+
+	pthread_mutex_unlock(&lock);
+
+	free(dir);
+	return 0;
+}
+
+/**
+ * rewinddir(3) for emulated streams.
+ */
+void sip_dir_rewind(DIR *dirp) {
+	struct sip_dir *dir = (struct sip_dir *) dirp;
+
+	dir->offset = 0;
+	dir->pos = 0;
+}
+
+/**
+ * telldir(3) for emulated streams: the number of entries read.
+ */
+long sip_dir_tell(DIR *dirp) {
+	return ((struct sip_dir *) dirp)->pos;
+}
+
+/**
+ * seekdir(3) for emulated streams.
+ */
+void sip_dir_seek(DIR *dirp, long loc) {
+	struct sip_dir *dir = (struct sip_dir *) dirp;
+
+	sip_dir_rewind(dirp);
+	while (dir->pos < loc && sip_dir_next(dir) != NULL)
+		;
+}
+
+/**
+ * Answer a stat from a cached listing, if the path names an entry of a
+ * directory listed recently. Symbolic links are only answered for lstat,
+ * since the listing has the attributes of the links themselves.
+ *
+ * @param int flags Flags as for fstatat(2).
+ * @return 1 if sbuf was filled in, otherwise 0.
+ */
+int sip_dircache_stat(int dirfd, const char *pathname, int flags, struct stat *sbuf) {
+	char path[PATH_MAX], *name, *end;
+	struct sip_listing *listing = NULL;
+	struct sip_dirent *rec = NULL;
+	uint64_t hash;
+	size_t slot;
+	long now;
+	int i;
+
+	if (__atomic_load_n(&ncached, __ATOMIC_RELAXED) == 0)
+		return 0;
+
+	if (pathname[0] == '\0' || sip_fd_abs_path(dirfd, pathname, path) == NULL)
+		return 0;
+
+	/* Split into directory and entry name. */
+	name = strrchr(path, '/');
+	*name++ = '\0';
+	for (end = name - 1; end > path && end[-1] == '/'; end--)
+		end[-1] = '\0';
+	if (name[0] == '\0')
+		return 0;
+
+	now = sip_dircache_now();
+	hash = sip_dircache_hash(name);
+
+	pthread_mutex_lock(&lock);
+
+	for (i = 0; i < SIP_DIRCACHE_SLOTS && listing == NULL; i++) {
+		if (cache[i] != NULL && now < cache[i]->expires &&
+			strcmp(cache[i]->path, path[0] ? path : "/") == 0)
+			listing = cache[i];
+	}
+
+	if (listing != NULL) {
+		for (slot = hash & listing->mask; listing->index[slot] != 0; slot = (slot + 1) & listing->mask) {
+			rec = (struct sip_dirent *) (listing->data + listing->index[slot] - 1);
+			if (strcmp(rec->name, name) == 0)
+				break;
+			rec = NULL;
+		}
+	}
+
+	if (rec != NULL && rec->stat.st_mode != 0 &&
+		(!S_ISLNK(rec->stat.st_mode) || (flags & AT_SYMLINK_NOFOLLOW))) {
+		memcpy(sbuf, &rec->stat, sizeof(*sbuf));
+	} else {
+		rec = NULL;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return rec != NULL;
+}
+
+/**
+ * Forget all cached listings. Open streams keep theirs.
+ */
+void sip_dircache_invalidate() {
+	int i;
+
+	if (__atomic_load_n(&ncached, __ATOMIC_RELAXED) == 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	for (i = 0; i < SIP_DIRCACHE_SLOTS; i++) {
+		if (cache[i] != NULL) {
+			sip_listing_put(cache[i]);
+			cache[i] = NULL;
+		}
+	}
+	ncached = 0;
+
+	pthread_mutex_unlock(&lock);
+}
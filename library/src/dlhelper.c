@@ -1,19 +1,106 @@
+#define _GNU_SOURCE /* RTLD_NEXT */
+
 #include <dlfcn.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "dlhelper.h"
 #include "logger.h"
 
-static void *dlhandle = NULL;
+union sip_real_table sip_real_table __attribute__((aligned(SIP_REAL_TABLE_SZ)));
+
+/**
+ * Find the sip_find_sym() of the object that defines addr, if that object is
+ * another build of the wrappers.
+ */
+static void *(*sip_other_find_sym(void *addr))(const char *) {
+	void *(*find)(const char *) = NULL;
+	void *handle;
+	Dl_info info;
+
+	if (!dladdr(addr, &info) || info.dli_fname == NULL ||
+		(handle = dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD)) == NULL)
+		return NULL;
+
+	find = (void *(*)(const char *)) dlsym(handle, "sip_find_sym");
+	dlclose(handle);
+
+	return find != &sip_find_sym ? find : NULL;
+}
 
+/**
+ * Find the next definition of the given symbol after this library in the
+ * lookup order (normally the one in libc). A definition in another build of
+ * the wrappers is skipped by asking that library for the one after it: the
+ * launcher preloads the LOW library in front of the combined one from
+ * /etc/ld.so.preload, and the LOW library replaces it rather than adding a
+ * second layer of wrappers.
+ *
+ * @param const char* symbol
+ * @return Address of the symbol, or NULL if it can't be found.
+ */
 void *sip_find_sym(const char *symbol) {
-	if (dlhandle == NULL) {
-		dlhandle = dlopen("libc.so.6", RTLD_LAZY);
+	void *addr = dlsym(RTLD_NEXT, symbol);
+	void *(*find)(const char *);
 
-		if (dlhandle == NULL) { /* Fatal error */
-			sip_error("Failed to open libc.so.6. Aborting.\n");
-			exit(1);
-		}
+	if (addr == NULL) {
+		sip_warning("Failed to resolve %s: %s\n", symbol, dlerror());
+	} else if ((find = sip_other_find_sym(addr)) != NULL) {
+		addr = find(symbol);
 	}
 
-	return dlsym(dlhandle, symbol);
+	return addr;
+}
+
+/**
+ * Determine whether programs call this library's wrappers, i.e. it wasn't
+ * replaced by another build loaded in front of it (see sip_find_sym()).
+ *
+ * @return 1 if the wrappers are in use, otherwise 0.
+ */
+int sip_wrappers_active(void) {
+	void *first = dlsym(RTLD_DEFAULT, "openat");
+	Dl_info mine, theirs;
+
+	if (first == NULL || !dladdr(first, &theirs) || !dladdr(&sip_real_table, &mine))
+		return 1;
+
+	return theirs.dli_fbase == mine.dli_fbase;
+}
+
+/**
+ * Resolve every interposed symbol into the dispatch table. This normally
+ * runs exactly once, from sip_real_init(); it is only reached through
+ * sip_real() if a wrapper is invoked before the library constructors run.
+ * Resolution is idempotent, so a repeated call stores the same values.
+ *
+ * @return Pointer to the populated table.
+ */
+struct sip_real_calls *sip_resolve_real_calls(void) {
+	struct sip_real_calls *calls = &sip_real_table.calls;
+
+	if (__atomic_load_n(&calls->ready, __ATOMIC_ACQUIRE)) {
+		return calls;
+	}
+
+#define SIP_REAL_RESOLVE(type, name, args) calls->name = sip_find_sym(#name);
+	SIP_REAL_CALLS(SIP_REAL_RESOLVE)
+#undef SIP_REAL_RESOLVE
+
+	__atomic_store_n(&calls->ready, 1, __ATOMIC_RELEASE);
+
+	return calls;
+}
+
+/**
+ * Library constructor. Populates the dispatch table, then write-protects it
+ * so the real entry points can't change for the lifetime of the process.
+ */
+__attribute__((constructor(101)))
+static void sip_real_init(void) {
+	sip_resolve_real_calls();
+
+	if (getpagesize() <= SIP_REAL_TABLE_SZ) {
+		mprotect(&sip_real_table, SIP_REAL_TABLE_SZ, PROT_READ);
+	}
 }
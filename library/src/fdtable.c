@@ -0,0 +1,229 @@
+/**
+ * Per-process table of open descriptors, maintained by the openat, dup*,
+ * fcntl, close and accept wrappers. For each tracked descriptor we record
+ * the absolute path it was opened with, its open flags, and the device and
+ * inode of the file.
+ *
+ * The table lets the directory listing cache and the subtree offload find
+ * the path behind a directory descriptor without a readlink of
+ * /proc/self/fd/N (see sip_fd_abs_path()). Descriptors can also be closed or
+ * replaced behind our back (e.g. by libc-internal closes), so an entry is
+ * only trusted if a fresh fstat of the descriptor still matches its device
+ * and inode.
+ *
+ * Opens don't pay for the check: a native open records just the path, and
+ * the first lookup of the entry learns the device and inode by comparing
+ * the descriptor with a stat of the path. Note that the recorded path is
+ * the one used at open time: if the file has been renamed since, the path
+ * is stale even though the entry is valid.
+ *
+ * Every entry is protected by a sequence counter (see seqlock.h), so lookups
+ * never block.
+ */
+
+#define _GNU_SOURCE /* struct dirent64, used in dlhelper.h */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fdtable.h"
+#include "seqlock.h"
+#include "dlhelper.h"
+#include "level.h"
+#include "util.h"
+
+#define SIP_FD_UNUSED 0
+#define SIP_FD_OPENED 1 		/* path recorded, file not checked yet */
+#define SIP_FD_CHECKED 2 		/* dev and ino are those of the file */
+
+struct sip_fd_entry {
+	unsigned seq;
+	int state; 							/* SIP_FD_* */
+	int flags;
+	dev_t dev;
+	ino_t ino;
+	char path[SIP_FD_PATH_MAX]; 		/* empty if unknown */
+};
+
+static struct sip_fd_entry fds[SIP_FD_TABLE_SZ];
+
+/* Writers for the same descriptor are rare (e.g. close racing with open in
+   another thread), so just spin until the entry can be claimed. */
+static struct sip_fd_entry *sip_fd_claim(int fd) {
+	struct sip_fd_entry *entry = &fds[fd];
+
+	while (!sip_seq_write_begin(&entry->seq))
+		;
+	return entry;
+}
+
+/**
+ * Copy the entry for fd without blocking.
+ *
+ * @return 1 if the entry is in use and was copied consistently, otherwise 0.
+ */
+static int sip_fd_copy(int fd, struct sip_fd_entry *copy) {
+	struct sip_fd_entry *entry = &fds[fd];
+	unsigned start = sip_seq_read_begin(&entry->seq);
+
+	memcpy(copy, entry, sizeof(struct sip_fd_entry));
+
+	return sip_seq_read_valid(&entry->seq, start) && copy->state != SIP_FD_UNUSED;
+}
+
+/**
+ * Record a descriptor returned by openat.
+ *
+ * @param int fd New descriptor.
+ * @param int dirfd, const char* pathname Arguments passed to openat.
+ * @param int flags Open flags.
+ * @param struct stat* sbuf fstat of fd, or NULL if the caller has none; the
+ *                          file is then checked by the first lookup.
+ */
+void sip_fd_record(int fd, int dirfd, const char *pathname, int flags, const struct stat *sbuf) {
+	struct sip_fd_entry *entry, dir;
+	char path[SIP_FD_PATH_MAX] = "";
+
+	if (fd < 0 || fd >= SIP_FD_TABLE_SZ)
+		return;
+
+	/* Relative paths are only recorded when the directory is tracked; we
+	   don't know the working directory without a getcwd. */
+	if (pathname[0] == '/') {
+		if (strlen(pathname) < SIP_FD_PATH_MAX)
+			strcpy(path, pathname);
+	} else if (dirfd >= 0 && dirfd < SIP_FD_TABLE_SZ && sip_fd_copy(dirfd, &dir) && dir.path[0]) {
+		if (snprintf(path, SIP_FD_PATH_MAX, "%s/%s", dir.path, pathname) >= SIP_FD_PATH_MAX)
+			path[0] = '\0';
+	}
+
+	/* An unchecked entry without a path could never be checked. */
+	if (sbuf == NULL && path[0] == '\0') {
+		sip_fd_forget(fd);
+		return;
+	}
+
+	entry = sip_fd_claim(fd);
+	entry->state = sbuf != NULL ? SIP_FD_CHECKED : SIP_FD_OPENED;
+	entry->flags = flags;
+	entry->dev = sbuf != NULL ? sbuf->st_dev : 0;
+	entry->ino = sbuf != NULL ? sbuf->st_ino : 0;
+	strcpy(entry->path, path);
+	sip_seq_write_end(&entry->seq);
+}
+
+/**
+ * Record newfd as a duplicate of oldfd.
+ *
+ * @param int cloexec 1 if newfd has FD_CLOEXEC set, otherwise 0.
+ */
+void sip_fd_record_dup(int oldfd, int newfd, int cloexec) {
+	struct sip_fd_entry *entry, copy;
+
+	if (newfd < 0 || newfd >= SIP_FD_TABLE_SZ || oldfd == newfd)
+		return;
+
+	if (oldfd < 0 || oldfd >= SIP_FD_TABLE_SZ || !sip_fd_copy(oldfd, &copy)) {
+		sip_fd_forget(newfd);
+		return;
+	}
+
+	copy.flags = cloexec ? (copy.flags | O_CLOEXEC) : (copy.flags & ~O_CLOEXEC);
+
+	entry = sip_fd_claim(newfd);
+	entry->state = copy.state;
+	entry->flags = copy.flags;
+	entry->dev = copy.dev;
+	entry->ino = copy.ino;
+	strcpy(entry->path, copy.path);
+	sip_seq_write_end(&entry->seq);
+}
+
+/**
+ * Drop the entry for a descriptor that is being closed.
+ */
+void sip_fd_forget(int fd) {
+	struct sip_fd_entry *entry;
+
+	if (fd < 0 || fd >= SIP_FD_TABLE_SZ || fds[fd].state == SIP_FD_UNUSED)
+		return;
+
+	entry = sip_fd_claim(fd);
+	entry->state = SIP_FD_UNUSED;
+	entry->path[0] = '\0';
+	sip_seq_write_end(&entry->seq);
+}
+
+/**
+ * Look up a descriptor in the table.
+ *
+ * @param int fd Descriptor.
+ * @param struct stat* sbuf Current fstat of fd, or NULL to fstat here.
+ * @param char* path If non-NULL, receives the recorded path (PATH_MAX bytes);
+ *                   entries without a known path are then treated as misses.
+ * @param int* flags If non-NULL, receives the recorded open flags.
+ * @return Current integrity level of the file on a hit, 0 on a miss.
+ */
+int sip_fd_lookup(int fd, const struct stat *sbuf, char *path, int *flags) {
+	struct sip_fd_entry *entry, copy;
+	struct stat fdbuf, pathbuf;
+
+	if (fd < 0 || fd >= SIP_FD_TABLE_SZ || !sip_fd_copy(fd, &copy))
+		return 0;
+
+	if (path != NULL && copy.path[0] == '\0')
+		return 0;
+
+	if (sbuf == NULL) {
+		if (sip_real_fstat(fd, &fdbuf) == -1)
+			return 0;
+		sbuf = &fdbuf;
+	}
+
+	/* The first lookup checks that the path still leads to the file; the
+	   entry then keeps its device and inode. */
+	if (copy.state == SIP_FD_OPENED) {
+		if (sip_real_fstatat(AT_FDCWD, copy.path, &pathbuf, 0) == -1 ||
+			pathbuf.st_dev != sbuf->st_dev || pathbuf.st_ino != sbuf->st_ino)
+			return 0;
+
+		entry = sip_fd_claim(fd);
+		if (entry->state == SIP_FD_OPENED && strcmp(entry->path, copy.path) == 0) {
+			entry->state = SIP_FD_CHECKED;
+			entry->dev = sbuf->st_dev;
+			entry->ino = sbuf->st_ino;
+		}
+		sip_seq_write_end(&entry->seq);
+	}
+
+	/* Entry belongs to a file that has since been closed? */
+	else if (copy.dev != sbuf->st_dev || copy.ino != sbuf->st_ino)
+		return 0;
+
+	if (path != NULL)
+		strcpy(path, copy.path);
+	if (flags != NULL)
+		*flags = copy.flags;
+
+	return sip_stat_buf_to_level((struct stat *) sbuf);
+}
+
+/**
+ * Version of sip_abs_path_r() that finds the path of dirfd in the table,
+ * and only reads /proc/self/fd on a miss.
+ *
+ * @param char* resolved Buffer of at least PATH_MAX bytes for the result.
+ * @return resolved on success, NULL on error.
+ */
+char *sip_fd_abs_path(int dirfd, const char *pathname, char *resolved) {
+	char dirpath[PATH_MAX];
+
+	if (pathname[0] == '/' || dirfd == AT_FDCWD || !sip_fd_lookup(dirfd, NULL, dirpath, NULL))
+		return sip_abs_path_r(dirfd, pathname, resolved);
+
+	return sip_join_path_r(dirpath, pathname, resolved);
+}
@@ -0,0 +1,234 @@
+/**
+ * Results of delegated calls for low integrity processes.
+ *
+ * A program that stats a protected file over and over (make, a compiler
+ * searching include paths) would send the same fstatat to the daemon every
+ * time. The results of the calls in SIP_CALL_SHAREABLE with absolute paths
+ * are kept here, keyed by the encoded request, so repeated requests are
+ * answered without a round trip.
+ *
+ * The daemon sends a notice over the connection for every file its
+ * handlers may have changed (see packets.h), and the bridge drops the
+ * results for that file and everything below it. Changes made outside the
+ * daemon, and paths the daemon resolves differently (through a symlinked
+ * directory), are only picked up once a result expires after SIP_RC_TTL_NS.
+ * Only paths in canonical form are cached, so that they compare equal to
+ * the ones in notices.
+ *
+ * All functions are called by the bridge with its lock held.
+ */
+
+#define _GNU_SOURCE /* CLOCK_MONOTONIC_COARSE */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "resultcache.h"
+
+struct sip_result {
+	uint64_t hash; 					/* 0 if slot unused */
+	long expires; 					/* ns */
+	unsigned short callno;
+	unsigned short size; 			/* bytes of key in use */
+	char key[SIP_RC_KEY_MAX]; 		/* fields of the request */
+	struct sip_response response;
+};
+
+static struct sip_result results[SIP_RC_SLOTS];
+static struct sip_result_cache_stats counters;
+
+static long sip_rc_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Split an encoded request into its call number and fields.
+ *
+ * @return Size of the fields, or 0 if the request can't be cached.
+ */
+static size_t sip_rc_key(const void *request, unsigned short *callno, const char **fields) {
+	struct sip_header head;
+
+	memcpy(&head, request, sizeof(head));
+
+	if (!SIP_CALL_SHAREABLE(head.callno) || head.nfds != 0 || head.size <= sizeof(head) ||
+		head.size - sizeof(head) > SIP_RC_KEY_MAX)
+		return 0;
+
+	*callno = head.callno;
+	*fields = (const char *) request + sizeof(head);
+	return head.size - sizeof(head);
+}
+
+/* FNV-1a; never 0. */
+static uint64_t sip_rc_hash(unsigned short callno, const char *fields, size_t size) {
+	uint64_t hash = 14695981039346656037ULL ^ callno;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= (unsigned char) fields[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash ? hash : 1;
+}
+
+/**
+ * The path a request reads: its first field (see SIP_CALL_SHAREABLE),
+ * which must be absolute.
+ *
+ * @return The path, or NULL if the fields are malformed.
+ */
+static const char *sip_rc_path(const char *fields, size_t size) {
+	unsigned short len;
+
+	if (size < 1 + sizeof(len) || (signed char) fields[0] != -1)
+		return NULL;
+
+	memcpy(&len, fields + 1, sizeof(len));
+
+	if (len < 2 || 1 + sizeof(len) + len > size || fields[1 + sizeof(len) + len - 1] != '\0')
+		return NULL;
+
+	return fields + 1 + sizeof(len);
+}
+
+/* Whether a path is absolute and has no empty, "." or ".." components. */
+static int sip_rc_canonical(const char *path) {
+	const char *comp;
+
+	if (path[0] != '/')
+		return 0;
+	if (path[1] == '\0')
+		return 1;
+
+	for (comp = path + 1; ; comp = strchr(comp, '/') + 1) {
+		size_t len = strcspn(comp, "/");
+
+		if (len == 0 || (len == 1 && comp[0] == '.') || (len == 2 && comp[0] == '.' && comp[1] == '.'))
+			return 0;
+		if (comp[len] == '\0')
+			return 1;
+	}
+}
+
+/**
+ * Look up the result of a request.
+ *
+ * @param void* request Encoded request (see packets.h).
+ * @param struct sip_response* response Receives the result on a hit.
+ * @return 1 on a hit, 0 otherwise.
+ */
+int sip_result_cache_lookup(const void *request, struct sip_response *response) {
+	const char *fields;
+	unsigned short callno;
+	size_t size = sip_rc_key(request, &callno, &fields);
+	uint64_t hash;
+	long now;
+	int i;
+
+	if (size == 0)
+		return 0;
+
+	hash = sip_rc_hash(callno, fields, size);
+	now = sip_rc_now();
+
+	for (i = 0; i < SIP_RC_MAX_PROBE; i++) {
+		struct sip_result *slot = &results[(hash + i) & (SIP_RC_SLOTS - 1)];
+
+		if (slot->hash == hash && slot->callno == callno && slot->size == size &&
+			memcmp(slot->key, fields, size) == 0) {
+			if (slot->expires <= now)
+				break;
+
+			response->rv = slot->response.rv;
+			response->err = slot->response.err;
+			response->nfds = 0;
+			response->size = slot->response.size;
+			memcpy(response->buf, slot->response.buf, slot->response.size);
+			counters.hits++;
+			return 1;
+		}
+	}
+
+	counters.misses++;
+	return 0;
+}
+
+/**
+ * Remember the result of a request. It replaces an older result for the
+ * same request, or else the one closest to expiring among the slots the
+ * request may go in.
+ */
+void sip_result_cache_store(const void *request, const struct sip_response *response) {
+	struct sip_result *slot, *victim = NULL;
+	const char *fields, *path;
+	unsigned short callno;
+	size_t size = sip_rc_key(request, &callno, &fields);
+	uint64_t hash;
+	int i;
+
+	if (size == 0 || (path = sip_rc_path(fields, size)) == NULL || !sip_rc_canonical(path) ||
+		response->nfds != 0 || response->size > SIP_DATA_SZ)
+		return;
+
+	hash = sip_rc_hash(callno, fields, size);
+
+	for (i = 0; i < SIP_RC_MAX_PROBE; i++) {
+		slot = &results[(hash + i) & (SIP_RC_SLOTS - 1)];
+
+		if (slot->hash == hash && slot->callno == callno && slot->size == size &&
+			memcmp(slot->key, fields, size) == 0) {
+			victim = slot;
+			break;
+		}
+		if (victim == NULL || slot->hash == 0 || (victim->hash != 0 && slot->expires < victim->expires))
+			victim = slot;
+	}
+
+	victim->hash = hash;
+	victim->expires = sip_rc_now() + SIP_RC_TTL_NS;
+	victim->callno = callno;
+	victim->size = size;
+	memcpy(victim->key, fields, size);
+	memcpy(&victim->response, response, SIP_RESPONSE_SIZE(response));
+}
+
+/**
+ * Drop the results for a file and everything below it.
+ *
+ * @param char* path Absolute path of the file, or NULL to drop everything.
+ */
+void sip_result_cache_invalidate(const char *path) {
+	size_t len = path != NULL ? strlen(path) : 0;
+	const char *cached;
+	int i;
+
+	/* "/" covers everything. */
+	if (len == 1)
+		len = 0;
+
+	for (i = 0; i < SIP_RC_SLOTS; i++) {
+		if (results[i].hash == 0)
+			continue;
+
+		cached = sip_rc_path(results[i].key, results[i].size);
+
+		if (path == NULL || len == 0 || cached == NULL ||
+			(strncmp(cached, path, len) == 0 && (cached[len] == '\0' || cached[len] == '/'))) {
+			results[i].hash = 0;
+			counters.invalidations++;
+		}
+	}
+}
+
+/**
+ * Get the cache counters.
+ */
+void sip_result_cache_stats(struct sip_result_cache_stats *stats) {
+	*stats = counters;
+}
@@ -0,0 +1,166 @@
+/**
+ * Delegation routes for low integrity processes.
+ *
+ * A LOW process normally tries each call natively and delegates it only after
+ * it fails with EACCES or EPERM. When the same protected file is used over
+ * and over (e.g. by a build), the failing native call is pure overhead. This
+ * table remembers (path, operation) pairs that needed delegation recently, so
+ * the wrappers can go straight to the daemon. Calls whose outcome depends on
+ * the directory rather than the file (unlinkat) are keyed by the parent
+ * directory instead, so one failure covers the whole directory.
+ *
+ * Routes expire after SIP_ROUTE_TTL_NS, which bounds how long a process keeps
+ * delegating after permissions change. Entries hold only a hash of the key:
+ * a collision merely sends an allowed call to the daemon, which applies the
+ * same policy either way. Only absolute paths are considered, and every
+ * slot is protected by a sequence counter.
+ */
+
+#define _GNU_SOURCE /* CLOCK_MONOTONIC_COARSE */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "routes.h"
+#include "seqlock.h"
+#include "logger.h"
+
+struct sip_route {
+	unsigned seq;
+	uint64_t hash; 				/* 0 if slot unused */
+	long expires; 				/* ns */
+};
+
+static struct sip_route routes[SIP_ROUTE_SLOTS];
+static struct sip_route_stats counters;
+
+static long sip_route_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Hash the key for pathname and op: the whole path, or the path up to its
+ * last slash for directory-keyed operations.
+ *
+ * @return Hash, or 0 if the call can't be routed.
+ */
+static uint64_t sip_route_hash(const char *pathname, int op) {
+	uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+	size_t len;
+
+	if (pathname[0] != '/')
+		return 0;
+
+	if (op == SIP_ROUTE_UNLINKAT)
+		len = strrchr(pathname, '/') - pathname;
+	else
+		len = strlen(pathname);
+
+	hash ^= (uint64_t) op;
+	hash *= 1099511628211ULL;
+
+	while (len--) {
+		hash ^= (unsigned char) *pathname++;
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+/**
+ * Check whether a call should skip the native attempt and be delegated
+ * directly.
+ *
+ * @param const char* pathname Path passed to the wrapper.
+ * @param int op One of the SIP_ROUTE_* operations.
+ * @return 1 if there is a live route, otherwise 0.
+ */
+int sip_route_lookup(const char *pathname, int op) {
+	uint64_t hash = sip_route_hash(pathname, op);
+	long now;
+	int i;
+
+	if (hash == 0)
+		return 0;
+
+	now = sip_route_now();
+
+	for (i = 0; i < SIP_ROUTE_MAX_PROBE; i++) {
+		struct sip_route *slot = &routes[(hash + i) & (SIP_ROUTE_SLOTS - 1)];
+		unsigned start = sip_seq_read_begin(&slot->seq);
+		struct sip_route copy = *slot;
+
+		if (!sip_seq_read_valid(&slot->seq, start))
+			continue;
+		if (copy.hash == 0)
+			return 0;
+		if (copy.hash == hash) {
+			if (now > copy.expires)
+				return 0;
+			__atomic_add_fetch(&counters.saved, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Remember that a native call on pathname failed for lack of permissions and
+ * had to be delegated.
+ */
+void sip_route_learn(const char *pathname, int op) {
+	uint64_t hash = sip_route_hash(pathname, op);
+	struct sip_route *slot = NULL;
+	long now;
+	int i;
+
+	if (hash == 0)
+		return;
+
+	now = sip_route_now();
+
+	/* Reuse the key's slot, a free slot or an expired one; else evict the
+	   home slot. */
+	for (i = 0; i < SIP_ROUTE_MAX_PROBE && slot == NULL; i++) {
+		struct sip_route *cand = &routes[(hash + i) & (SIP_ROUTE_SLOTS - 1)];
+
+		if (cand->hash == 0 || cand->hash == hash || now > cand->expires)
+			slot = cand;
+	}
+	if (slot == NULL)
+		slot = &routes[hash & (SIP_ROUTE_SLOTS - 1)];
+
+	if (!sip_seq_write_begin(&slot->seq))
+		return;
+	slot->hash = hash;
+	slot->expires = now + SIP_ROUTE_TTL_NS;
+	sip_seq_write_end(&slot->seq);
+
+	__atomic_add_fetch(&counters.learned, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get a snapshot of the route counters.
+ */
+void sip_route_stats(struct sip_route_stats *stats) {
+	stats->learned = __atomic_load_n(&counters.learned, __ATOMIC_RELAXED);
+	stats->saved = __atomic_load_n(&counters.saved, __ATOMIC_RELAXED);
+}
+
+/**
+ * Report the route counters when the process exits.
+ */
+__attribute__((destructor))
+static void sip_route_report() {
+	struct sip_route_stats stats;
+
+	sip_route_stats(&stats);
+
+	if (stats.learned > 0) {
+		sip_info("Delegation routes: %lu learned, %lu native attempts saved.\n",
+				 stats.learned, stats.saved);
+	}
+}
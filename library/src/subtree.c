@@ -0,0 +1,429 @@
+/**
+ * Subtree offload for low integrity processes.
+ *
+ * rm -r, chmod -R and chown -R walk a tree with fts and make one call per
+ * file. On a tree a LOW process may not modify, every one of those calls
+ * fails natively and is then delegated on its own. The call pattern alone
+ * doesn't say what the traversal will do next (find -delete walks the same
+ * way but spares most files), so the intent is taken from the command line
+ * instead: when the library is loaded into one of these tools, the operands
+ * it can't change natively are handed to the daemon with one SYS_subtree
+ * request each, before the tool starts walking.
+ *
+ * Only invocations whose effect is the same on every file are offloaded:
+ * rm -r with -f (a removed operand is then not an error), chmod -R with an
+ * octal mode and chown/chgrp -R without -H/-L. Any other option turns the
+ * offload off. What the daemon refuses is left in place for the tool to
+ * find; files of an operand that was completed are recorded, so the tool's
+ * own calls on them are answered without another round trip.
+ *
+ * mkdir -p is offloaded the same way: when the deepest directory of an
+ * operand that exists is one the process can't write, each directory below
+ * it would need its own delegated mkdirat, since the daemon creates them
+ * with its own owner. They are created with one compound request instead.
+ */
+
+#define _GNU_SOURCE /* AT_EACCESS */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "subtree.h"
+#include "delegate.h"
+#include "dlhelper.h"
+#include "fdtable.h"
+#include "dircache.h"
+#include "logger.h"
+
+/* mkdir -p: a compound of mkdirat steps, not a SYS_subtree request */
+#define SIP_SUBTREE_PARENTS -1
+
+struct sip_subtree_tool {
+	const char *name;
+	int op; 						/* SIP_SUBTREE_* */
+	const char *shortopts; 			/* options that don't change the effect */
+	const char *longopts[8];
+};
+
+static const struct sip_subtree_tool tools[] = {
+	{ "rm", SIP_SUBTREE_REMOVE, "fdrRv",
+	  { "--force", "--recursive", "--dir", "--verbose", "--preserve-root", "--no-preserve-root" } },
+	{ "chmod", SIP_SUBTREE_CHMOD, "cfvR",
+	  { "--changes", "--silent", "--quiet", "--verbose", "--recursive", "--preserve-root", "--no-preserve-root" } },
+	{ "chown", SIP_SUBTREE_CHOWN, "cfvRhP",
+	  { "--changes", "--silent", "--quiet", "--verbose", "--recursive", "--preserve-root", "--no-preserve-root",
+		"--no-dereference" } },
+	{ "chgrp", SIP_SUBTREE_CHOWN, "cfvRhP",
+	  { "--changes", "--silent", "--quiet", "--verbose", "--recursive", "--preserve-root", "--no-preserve-root",
+		"--no-dereference" } },
+	{ "mkdir", SIP_SUBTREE_PARENTS, "pv",
+	  { "--parents", "--verbose" } },
+};
+
+/* Operation requested on the command line. */
+struct sip_subtree_cmd {
+	int op;
+	mode_t mode;
+	uid_t owner;
+	gid_t group;
+	int flags; 						/* SIP_SUBTREE_DIR_SETID */
+};
+
+/* Operands completed by the daemon. Only written by the constructor. */
+static struct sip_subtree_root {
+	char path[PATH_MAX]; 			/* canonical */
+	size_t len;
+} roots[SIP_SUBTREE_ROOTS];
+
+static int nroots = 0;
+static struct sip_subtree_cmd done;
+
+/* Parse an octal mode for chmod. GNU chmod keeps the set-ID bits of
+   directories unless the mode has five digits or more. */
+static int sip_parse_mode(const char *arg, struct sip_subtree_cmd *cmd) {
+	size_t len = strspn(arg, "01234567");
+	unsigned long mode;
+
+	if (len == 0 || arg[len] != '\0' || (mode = strtoul(arg, NULL, 8)) > 07777)
+		return -1;
+
+	cmd->mode = mode;
+	cmd->flags = len < 5 ? SIP_SUBTREE_DIR_SETID : 0;
+	return 0;
+}
+
+static int sip_parse_id(const char *name, int group, unsigned int *id) {
+	struct passwd *pw;
+	struct group *gr;
+	char *end;
+
+	if (group && (gr = getgrnam(name)) != NULL) {
+		*id = gr->gr_gid;
+		return 0;
+	}
+	if (!group && (pw = getpwnam(name)) != NULL) {
+		*id = pw->pw_uid;
+		return 0;
+	}
+
+	*id = strtoul(name, &end, 10);
+	return name[0] >= '0' && name[0] <= '9' && *end == '\0' ? 0 : -1;
+}
+
+/* Parse OWNER, OWNER:GROUP or :GROUP for chown, or GROUP for chgrp. The
+   forms that take the owner's login group or use '.' are not handled. */
+static int sip_parse_owner(const char *arg, int chgrp, struct sip_subtree_cmd *cmd) {
+	char spec[256], *colon;
+
+	cmd->owner = -1;
+	cmd->group = -1;
+
+	if (strlen(arg) >= sizeof(spec))
+		return -1;
+	if (chgrp)
+		return sip_parse_id(arg, 1, (unsigned int *) &cmd->group);
+
+	strcpy(spec, arg);
+	if ((colon = strchr(spec, ':')) == NULL)
+		return strchr(spec, '.') ? -1 : sip_parse_id(spec, 0, (unsigned int *) &cmd->owner);
+
+	*colon = '\0';
+	if (colon[1] == '\0' || (spec[0] != '\0' && sip_parse_id(spec, 0, (unsigned int *) &cmd->owner) < 0))
+		return -1;
+	return sip_parse_id(colon + 1, 1, (unsigned int *) &cmd->group);
+}
+
+static int sip_is_option(const struct sip_subtree_tool *tool, const char *arg, int *recursive, int *force) {
+	int i;
+
+	if (arg[1] == '-') {
+		for (i = 0; i < 8 && tool->longopts[i]; i++) {
+			if (strcmp(arg, tool->longopts[i]) == 0)
+				break;
+		}
+		if (i == 8 || tool->longopts[i] == NULL)
+			return 0;
+		*recursive |= strcmp(arg, "--recursive") == 0 || strcmp(arg, "--parents") == 0;
+		*force |= strcmp(arg, "--force") == 0;
+		return 1;
+	}
+
+	for (arg++; *arg; arg++) {
+		if (strchr(tool->shortopts, *arg) == NULL)
+			return 0;
+		*recursive |= *arg == 'R' || (*arg == 'r' && tool->op == SIP_SUBTREE_REMOVE) ||
+					  (*arg == 'p' && tool->op == SIP_SUBTREE_PARENTS);
+		*force |= *arg == 'f' && tool->op == SIP_SUBTREE_REMOVE;
+	}
+
+	return 1;
+}
+
+/**
+ * Check whether the command line is one we offload and parse it.
+ *
+ * @param char** operands Set to the files operated on.
+ * @return Number of operands, or -1 if the command is not offloaded.
+ */
+static int sip_parse_cmd(int argc, char **argv, struct sip_subtree_cmd *cmd, char **operands) {
+	const struct sip_subtree_tool *tool = NULL;
+	const char *name, *spec = NULL;
+	int i, count = 0, endopts = 0, recursive = 0, force = 0;
+
+	if (argc < 1 || argv == NULL || argv[0] == NULL)
+		return -1;
+
+	name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+
+	for (i = 0; i < sizeof(tools) / sizeof(tools[0]); i++) {
+		if (strcmp(name, tools[i].name) == 0)
+			tool = &tools[i];
+	}
+	if (tool == NULL)
+		return -1;
+
+	/* Options may come after operands, as with getopt_long(3). */
+	for (i = 1; i < argc; i++) {
+		if (!endopts && strcmp(argv[i], "--") == 0) {
+			endopts = 1;
+		} else if (!endopts && argv[i][0] == '-' && argv[i][1] != '\0') {
+			if (!sip_is_option(tool, argv[i], &recursive, &force))
+				return -1;
+		} else if ((tool->op == SIP_SUBTREE_CHMOD || tool->op == SIP_SUBTREE_CHOWN) && spec == NULL) {
+			spec = argv[i];
+		} else if (count == SIP_SUBTREE_ROOTS) {
+			return -1;
+		} else {
+			operands[count++] = argv[i];
+		}
+	}
+
+	if (!recursive || (tool->op == SIP_SUBTREE_REMOVE && !force))
+		return -1;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->op = tool->op;
+
+	if (tool->op == SIP_SUBTREE_CHMOD && (spec == NULL || sip_parse_mode(spec, cmd) < 0))
+		return -1;
+	if (tool->op == SIP_SUBTREE_CHOWN &&
+		(spec == NULL || sip_parse_owner(spec, strcmp(tool->name, "chgrp") == 0, cmd) < 0))
+		return -1;
+
+	return count;
+}
+
+/**
+ * Check whether an operand is worth offloading: a directory (not a symlink
+ * to one) that the process can't change natively.
+ *
+ * @param char* resolved Set to the canonical path of the operand.
+ */
+static int sip_needs_offload(const char *operand, const struct sip_subtree_cmd *cmd, char *resolved) {
+	char path[PATH_MAX];
+	struct stat sbuf;
+	size_t len = strlen(operand);
+	const char *base;
+
+	if (len == 0 || len >= PATH_MAX)
+		return 0;
+
+	/* rm refuses "." and ".."; leave them to it. */
+	strcpy(path, operand);
+	while (len > 1 && path[len - 1] == '/')
+		path[--len] = '\0';
+	base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	if (strcmp(base, ".") == 0 || strcmp(base, "..") == 0)
+		return 0;
+
+	if (sip_real_fstatat(AT_FDCWD, path, &sbuf, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(sbuf.st_mode))
+		return 0;
+	if (realpath(path, resolved) == NULL || strcmp(resolved, "/") == 0)
+		return 0;
+
+	switch (cmd->op) {
+		case SIP_SUBTREE_REMOVE:
+			return sip_real(faccessat)(AT_FDCWD, path, W_OK|X_OK, AT_EACCESS) < 0;
+		case SIP_SUBTREE_CHMOD:
+			return sbuf.st_uid != geteuid();
+		default:
+			return sbuf.st_uid != geteuid() || (cmd->owner != (uid_t) -1 && cmd->owner != sbuf.st_uid);
+	}
+}
+
+/**
+ * Create the directories of a mkdir -p operand that don't exist yet, if the
+ * deepest one that does is not writable by the process. Up to SIP_MAX_STEPS
+ * directories are created per compound request; one that appears in the
+ * meantime doesn't stop the rest (SIP_STEP_EXIST_OK). The mode is that of
+ * mkdir -p without -m.
+ *
+ * @return 1 if directories were created, 0 otherwise.
+ */
+static int sip_offload_parents(const char *operand) {
+	struct sip_compound compound;
+	struct sip_compound_result *result;
+	size_t ends[SIP_SUBTREE_MAX_DEPTH];
+	char path[PATH_MAX];
+	struct stat sbuf;
+	size_t len = strlen(operand);
+	int i, missing = 0, created = 0;
+	char saved;
+
+	if (len == 0 || len >= PATH_MAX)
+		return 0;
+
+	strcpy(path, operand);
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+
+	/* Walk up to the deepest directory that exists, noting where the path
+	   of each missing one ends. */
+	for (;;) {
+		saved = path[len];
+		path[len] = '\0';
+		i = sip_real_fstatat(AT_FDCWD, path, &sbuf, 0);
+		path[len] = saved;
+
+		if (i == 0)
+			break;
+		if (errno != ENOENT || missing == SIP_SUBTREE_MAX_DEPTH)
+			return 0;
+
+		ends[missing++] = len;
+
+		while (len > 0 && path[len - 1] != '/')
+			len--;
+		while (len > 1 && path[len - 1] == '/')
+			len--;
+		if (len == 0)
+			break;
+	}
+
+	if (missing == 0)
+		return 0;
+
+	saved = path[len];
+	path[len] = '\0';
+	i = sip_real(faccessat)(AT_FDCWD, len > 0 ? path : ".", W_OK|X_OK, AT_EACCESS);
+	path[len] = saved;
+
+	if (i == 0 || errno != EACCES)
+		return 0;
+
+	while (missing > 0) {
+		SIP_PREPARE_RES(response);
+
+		sip_compound_init(&compound);
+		for (i = 0; i < SIP_MAX_STEPS && missing > 0; i++) {
+			len = ends[--missing];
+			saved = path[len];
+			path[len] = '\0';
+			sip_compound_mkdirat(&compound, SIP_STEP_EXIST_OK, AT_FDCWD, path, 0777);
+			path[len] = saved;
+		}
+
+		if (sip_delegate_compound(&compound, &response, NULL, 0) == -1)
+			break;
+
+		result = (struct sip_compound_result *) response.buf;
+		for (i = 0; i < result->steps; i++)
+			created += result->rv[i] == 0;
+
+		sip_info("Offloaded mkdir -p %s: %d directories created\n", operand, created);
+
+		if (response.rv == -1)
+			break;
+	}
+
+	return created > 0;
+}
+
+/**
+ * Library constructor. glibc passes the program's arguments to constructors
+ * of loaded objects, which is all we need to recognize the command.
+ */
+__attribute__((constructor))
+static void sip_subtree_init(int argc, char **argv, char **envp) {
+	struct sip_subtree_result result;
+	struct sip_subtree_cmd cmd;
+	char *operands[SIP_SUBTREE_ROOTS];
+	char resolved[PATH_MAX];
+	int i, count, changed = 0;
+
+	/* A library replaced by the LOW one leaves the command to it. */
+	if (!SIP_IS_LOWI || !sip_wrappers_active() || (count = sip_parse_cmd(argc, argv, &cmd, operands)) <= 0)
+		return;
+
+	for (i = 0; i < count; i++) {
+		if (cmd.op == SIP_SUBTREE_PARENTS) {
+			changed |= sip_offload_parents(operands[i]);
+			continue;
+		}
+
+		if (!sip_needs_offload(operands[i], &cmd, resolved))
+			continue;
+
+		SIP_PREPARE_RES(response);
+
+		if (sip_delegate_subtree(&response, AT_FDCWD, resolved, cmd.op, cmd.mode, cmd.owner, cmd.group, cmd.flags) < 0 ||
+			response.size != sizeof(result))
+			continue;
+
+		memcpy(&result, response.buf, sizeof(result));
+		sip_info("Offloaded %s: %lu files, %lu left to the command\n", resolved, result.nodes, result.failed);
+
+		changed |= result.nodes > result.failed;
+
+		if (response.rv == 0) {
+			strcpy(roots[nroots].path, resolved);
+			roots[nroots].len = strlen(resolved);
+			nroots++;
+		}
+	}
+
+	done = cmd;
+
+	if (changed)
+		sip_dircache_invalidate();
+}
+
+/**
+ * Check whether a chmod or chown of a file was already carried out by the
+ * daemon as part of an offloaded operand. The file must still be in the
+ * state the call asks for, so files added to the tree since are not
+ * mistaken for done.
+ *
+ * @param int flags Flags of the call (AT_SYMLINK_NOFOLLOW).
+ * @param int op SIP_SUBTREE_CHMOD or SIP_SUBTREE_CHOWN.
+ * @return 1 if the call can be reported as successful, 0 otherwise.
+ */
+int sip_subtree_done(int dirfd, const char *pathname, int flags, int op, mode_t mode, uid_t owner, gid_t group) {
+	char resolved[PATH_MAX];
+	struct stat sbuf;
+	int i;
+
+	if (nroots == 0 || op != done.op || sip_fd_abs_path(dirfd, pathname, resolved) == NULL)
+		return 0;
+
+	for (i = 0; i < nroots; i++) {
+		if (strncmp(resolved, roots[i].path, roots[i].len) == 0 &&
+			(resolved[roots[i].len] == '\0' || resolved[roots[i].len] == '/'))
+			break;
+	}
+	if (i == nroots || sip_real_fstatat(dirfd, pathname, &sbuf, flags & AT_SYMLINK_NOFOLLOW) < 0)
+		return 0;
+
+	if (op == SIP_SUBTREE_CHMOD)
+		return (sbuf.st_mode & 07777) == (mode & 07777);
+
+	return (owner == (uid_t) -1 || sbuf.st_uid == owner) && (group == (gid_t) -1 || sbuf.st_gid == group);
+}
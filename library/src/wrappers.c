@@ -9,9 +9,12 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/syscall.h>
+#include <sys/time.h>
 #include <utime.h>
+#include <time.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,13 +26,20 @@
 #include "common.h"
 #include "logger.h"
 #include "level.h"
+#include "fdtable.h"
+#include "routes.h"
+#include "dircache.h"
+#include "subtree.h"
 #include "util.h"
 #include "redirect.h"
-#include "bridge.h"
+#include "delegate.h"
 #include "packets.h"
 
 // TODO: POSSIBLY ENABLE REDIRECTION IF WE HAVE TIME TO TEST
 
+/* Explicit form of a NULL times argument to utimensat(2) and futimens(3). */
+static const struct timespec sip_utime_now[2] = {{0, UTIME_NOW}, {0, UTIME_NOW}};
+
 /**
  * Wrapper for faccessat(2). Enforces the following policy:
  *
@@ -42,55 +52,41 @@
  */
 sip_wrapper(int, faccessat, int dirfd, const char *pathname, int mode, int flags) {
 
- 	char *redirected_path = strdup(pathname), *temp_path;
-
- 	if (redirected_path == NULL) {
- 		sip_error("faccessat aborted: out of memory.\n");
- 	   	return -1;
- 	}
-
  	/* Redirect pathname before call if appropriate */
  	// if(SIP_LV_LOW) {
-	// 		redirected_path = sip_convert_to_redirected_path(redirected_path);
+	// 		pathname = sip_convert_to_redirected_path(pathname);
 	// }
 
 	if (SIP_IS_HIGHI) {
 		int read_or_exec = (mode & R_OK) || (mode & X_OK);
 
-		if (SIP_LV_LOW == sip_path_to_level(redirected_path) && read_or_exec) {
+		if (SIP_LV_LOW == sip_pathat_to_level(dirfd, pathname) && read_or_exec) {
 
-			sip_info("Denied read/exec permissions on low integrity file %s\n", redirected_path);
+			sip_info("Denied read/exec permissions on low integrity file %s\n", pathname);
 			errno = EACCES;
 			return -1;
 		}
 	}
 
-	_faccessat = sip_find_sym("faccessat");
-
-	int rv = _faccessat(dirfd, redirected_path, mode, flags);
+	int routed = SIP_IS_LOWI && sip_route_lookup(pathname, SIP_ROUTE_FACCESSAT);
+	int rv = routed ? sip_route_native_skipped() : sip_real(faccessat)(dirfd, pathname, mode, flags);
 
 	if (rv == -1 && errno == EACCES && SIP_IS_LOWI) {
 
-		sip_info("Delegating faccessat on %s\n", redirected_path);
+		sip_info("Delegating faccessat on %s\n", pathname);
 
-		temp_path = redirected_path;
-		redirected_path = sip_abs_path(dirfd, redirected_path); /* to avoid passing dirfd to helper */
-		free(temp_path);
+		if (!routed)
+			sip_route_learn(pathname, SIP_ROUTE_FACCESSAT);
 
-		SIP_PREPARE_REQ(faccessat, request);
-		
-		strncpy(request.pathname, redirected_path, PATH_MAX);
-		request.mode = mode;
-		request.flags = flags;
+		SIP_PREPARE_RES(response);
 
-		SIP_PREPARE_RES(response);		
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+		if (sip_delegate_faccessat(&response, dirfd, pathname, mode, flags) == 0) {
 			rv = response.rv;
 			errno = response.err;
+		} else if (routed) {
+			/* The daemon is out of reach: make the call that was skipped. */
+			rv = sip_real(faccessat)(dirfd, pathname, mode, flags);
 		}
-
-		free(redirected_path);
 	}
 
 	return rv;
@@ -120,44 +116,39 @@ sip_wrapper(int, access, const char *pathname, int mode) {
  */
 sip_wrapper(int, fchmodat, int dirfd, const char *pathname, mode_t mode, int flags) {
 
- 	char *redirected_path = strdup(pathname), *temp_path;
-
- 	if (redirected_path == NULL) {
- 		sip_error("fchmodat aborted: out of memory.\n");
- 	   	return -1;
- 	}
-
  	/* Redirect pathname before call if appropriate */
 	// if (SIP_LV_LOW) {
- 	// 		redirected_path = sip_convert_to_redirected_path(redirected_path);
+ 	// 		pathname = sip_convert_to_redirected_path(pathname);
 	// }
 
-	_fchmodat = sip_find_sym("fchmodat");
-	
-	int rv = _fchmodat(dirfd, redirected_path, mode, flags);
+	int routed = SIP_IS_LOWI && sip_route_lookup(pathname, SIP_ROUTE_FCHMODAT);
+	int rv = routed ? sip_route_native_skipped() : sip_real(fchmodat)(dirfd, pathname, mode, flags);
 
 	if (rv == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
 
-		sip_info("Delegating fchmodat on %s\n", redirected_path);
+		/* Already done by an offloaded chmod -R (see subtree.c). */
+		if (sip_subtree_done(dirfd, pathname, flags, SIP_SUBTREE_CHMOD, mode, -1, -1))
+			return 0;
+
+		sip_info("Delegating fchmodat on %s\n", pathname);
 
-		temp_path = redirected_path;
-		redirected_path = sip_abs_path(dirfd, redirected_path); /* to avoid passing dirfd to helper */
-		free(temp_path);
+		if (!routed)
+			sip_route_learn(pathname, SIP_ROUTE_FCHMODAT);
 
-		SIP_PREPARE_REQ(fchmodat, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.pathname, redirected_path, PATH_MAX);
-		request.mode = mode;
-		request.flags = flags;
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_fchmodat(&response, dirfd, pathname, mode, flags) == 0) {
 			rv = response.rv;
 			errno = response.err;
+		} else if (routed) {
+			/* The daemon is out of reach: make the call that was skipped. */
+			rv = sip_real(fchmodat)(dirfd, pathname, mode, flags);
 		}
-
-		free(redirected_path);
 	}
 
+	if (rv == 0)
+		sip_dircache_invalidate();
+
 	return rv;
 }
 
@@ -169,18 +160,29 @@ sip_wrapper(int, chmod, const char *pathname, mode_t mode) {
 }
 
 /**
- * Basic wrapper for fchmod(2). Redirects to fchmodat(2).
+ * Wrapper for fchmod(2). Enforces the same policy as fchmodat(2); the call is
+ * made on the descriptor and converted to a path only when delegating.
  */
 sip_wrapper(int, fchmod, int fd, mode_t mode) {
-	char* path = sip_fd_to_path(fd);
 
-	if (path == NULL)
-		return -1;
+	int rv = sip_real(fchmod)(fd, mode);
 
-	int res = fchmodat(AT_FDCWD, path, mode, 0);
+	if (rv == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
 
-	free(path);
-	return res;
+		sip_info("Delegating fchmod with descriptor %d\n", fd);
+
+		SIP_PREPARE_RES(response);
+
+		if (sip_delegate_fchmodat(&response, fd, "", mode, 0) == 0) {
+			rv = response.rv;
+			errno = response.err;
+		}
+	}
+
+	if (rv == 0)
+		sip_dircache_invalidate();
+
+	return rv;
 }
 
 /**
@@ -197,7 +199,7 @@ sip_wrapper(int, fchmod, int fd, mode_t mode) {
  */
 sip_wrapper(int, fchownat, int dirfd, const char *pathname, uid_t owner, gid_t group, int flags) {
 
-	int flevel = sip_path_to_level(pathname);
+	int flevel = sip_pathat_to_level(dirfd, pathname);
 	int ulevel = sip_uid_to_level(owner);
 	int glevel = sip_gid_to_level(group);
 
@@ -212,62 +214,88 @@ sip_wrapper(int, fchownat, int dirfd, const char *pathname, uid_t owner, gid_t g
 		return -1;
 	}
 
- 	char *redirected_path = strdup(pathname), *temp_path;
-
- 	if (redirected_path == NULL) {
- 		sip_error("fchownat aborted: out of memory.\n");
- 	   	return -1;
- 	}
-
  	/* Redirect pathname before call if appropriate */
     //  if(SIP_LV_LOW) {
-	// 		redirected_path = sip_convert_to_redirected_path(redirected_path);
+	// 		pathname = sip_convert_to_redirected_path(pathname);
 	// 	}
 
-	_fchownat = sip_find_sym("fchownat");
-
-	int rv = _fchownat(dirfd, redirected_path, owner, group, flags);
+	int routed = SIP_IS_LOWI && sip_route_lookup(pathname, SIP_ROUTE_FCHOWNAT);
+	int rv = routed ? sip_route_native_skipped() : sip_real(fchownat)(dirfd, pathname, owner, group, flags);
 
 	if (rv == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
+
+		/* Already done by an offloaded chown -R (see subtree.c). */
+		if (sip_subtree_done(dirfd, pathname, flags, SIP_SUBTREE_CHOWN, 0, owner, group))
+			return 0;
 		
-		sip_info("Delegating fchownat on %s\n", redirected_path);
+		sip_info("Delegating fchownat on %s\n", pathname);
 
-		temp_path = redirected_path;
-		redirected_path = sip_abs_path(dirfd, redirected_path); /* to avoid passing dirfd to helper */
-		free(temp_path);
+		if (!routed)
+			sip_route_learn(pathname, SIP_ROUTE_FCHOWNAT);
 
-		SIP_PREPARE_REQ(fchownat, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.pathname, redirected_path, PATH_MAX);
-		request.owner = owner;
-		request.group = group;
-		request.flags = flags;
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_fchownat(&response, dirfd, pathname, owner, group, flags) == 0) {
 			rv = response.rv;
 			errno = response.err;
+		} else if (routed) {
+			/* The daemon is out of reach: make the call that was skipped. */
+			rv = sip_real(fchownat)(dirfd, pathname, owner, group, flags);
 		}
-
-		free(redirected_path);
 	}
 
+	if (rv == 0)
+		sip_dircache_invalidate();
+
 	return rv;
 }
 
 /**
- * Wrapper for fchown(2). Redirects to fchownat(2).
+ * Wrapper for fchown(2). Enforces the same policy as fchownat(2), taking the
+ * file level from fstat on the descriptor. The descriptor is converted to a
+ * path only when delegating.
  */
 
 sip_wrapper(int, fchown, int fd, uid_t owner, gid_t group) {
-	char* path = sip_fd_to_path(fd);
 
-	if (path == NULL)
+	struct stat sbuf;
+
+	if (sip_real_fstat(fd, &sbuf) == -1)
 		return -1;
 
-	int res = fchownat(AT_FDCWD, path, owner, group, 0);
+	int flevel = sip_stat_buf_to_level(&sbuf);
+	int ulevel = sip_uid_to_level(owner);
+	int glevel = sip_gid_to_level(group);
 
-	free(path);
-	return res;
+	if (sip_level_min(glevel, ulevel) > flevel) {
+		sip_info("Blocked attempt to upgrade file with descriptor %d\n", fd);
+		errno = EACCES;
+		return -1;
+	}
+	else if (sip_level_min(glevel, ulevel) < flevel && SIP_IS_LOWI) {
+		sip_info("Blocked attempt to downgrade file with descriptor %d\n", fd);
+		errno = EACCES;
+		return -1;
+	}
+
+	int rv = sip_real(fchown)(fd, owner, group);
+
+	if (rv == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
+
+		sip_info("Delegating fchown with descriptor %d\n", fd);
+
+		SIP_PREPARE_RES(response);
+
+		if (sip_delegate_fchownat(&response, fd, "", owner, group, 0) == 0) {
+			rv = response.rv;
+			errno = response.err;
+		}
+	}
+
+	if (rv == 0)
+		sip_dircache_invalidate();
+
+	return rv;
 }
 
 /**
@@ -298,9 +326,7 @@ sip_wrapper(int, chown, const char *file, uid_t owner, gid_t group) {
  */
 
 sip_wrapper(uid_t, getgid, void) {
-	_getgid = sip_find_sym("getgid");
-
-	gid_t group = _getgid();
+	gid_t group = sip_real(getgid)();
 
 	if (group == SIP_UNTRUSTED_USERID) {
 		return SIP_TRUSTED_GROUP_GID;
@@ -320,9 +346,7 @@ sip_wrapper(uid_t, getgid, void) {
  */
 
 sip_wrapper(int, getresgid, gid_t *rgid, gid_t *egid, gid_t *sgid) {
-	_getresgid = sip_find_sym("getresgid");
-
-	int rv = _getresgid(rgid, egid, sgid);
+	int rv = sip_real(getresgid)(rgid, egid, sgid);
 
 	if (rv == 0) {
 		if (*rgid == SIP_UNTRUSTED_USERID) 
@@ -349,9 +373,7 @@ sip_wrapper(int, getresgid, gid_t *rgid, gid_t *egid, gid_t *sgid) {
  */
 
 sip_wrapper(uid_t, getuid, void) {
-	_getuid = sip_find_sym("getuid");
-
-	uid_t user = _getuid();
+	uid_t user = sip_real(getuid)();
 
 	if (user == SIP_UNTRUSTED_USERID) {
 		return SIP_REAL_USERID;
@@ -371,9 +393,7 @@ sip_wrapper(uid_t, getuid, void) {
  */
 
 sip_wrapper(int, getresuid, uid_t *ruid, uid_t *euid, uid_t *suid) {
-	_getresuid = sip_find_sym("getresuid");
-
-	int rv = _getresuid(ruid, euid, suid);
+	int rv = sip_real(getresuid)(ruid, euid, suid);
 
 	if (rv == 0) {
 		if (*ruid == SIP_UNTRUSTED_USERID) 
@@ -401,9 +421,7 @@ sip_wrapper(int, getresuid, uid_t *ruid, uid_t *euid, uid_t *suid) {
 
 sip_wrapper(int, getgroups, int size, gid_t list[]) {
 
-	_getgroups = sip_find_sym("getgroups");
-
-	int rv = _getgroups(size, list), i;
+	int rv = sip_real(getgroups)(size, list), i;
 
 	if (rv > 0 && size > 0) {
 		/* If any of the GIDs in list match the untrusted GID, substitute with
@@ -418,26 +436,122 @@ sip_wrapper(int, getgroups, int size, gid_t list[]) {
 	return rv;
 }
 
+/**
+ * Wrappers for the setuid(2) family. Enforces the following policy:
+ *
+ * PROCESS LEVEL | ACTION
+ * ---------------------------------------------------------------------------
+ * ALL           | On success, refresh the cached integrity level of the
+ *               | process (see sip_level()).
+ * ---------------------------------------------------------------------------
+ */
+sip_wrapper(int, setuid, uid_t uid) {
+	int rv = sip_real(setuid)(uid);
+
+	if (rv == 0)
+		sip_level_refresh();
+	return rv;
+}
+
+sip_wrapper(int, setreuid, uid_t ruid, uid_t euid) {
+	int rv = sip_real(setreuid)(ruid, euid);
+
+	if (rv == 0)
+		sip_level_refresh();
+	return rv;
+}
+
+sip_wrapper(int, setresuid, uid_t ruid, uid_t euid, uid_t suid) {
+	int rv = sip_real(setresuid)(ruid, euid, suid);
+
+	if (rv == 0)
+		sip_level_refresh();
+	return rv;
+}
+
+sip_wrapper(int, setgid, gid_t gid) {
+	int rv = sip_real(setgid)(gid);
+
+	if (rv == 0)
+		sip_level_refresh();
+	return rv;
+}
+
+sip_wrapper(int, setregid, gid_t rgid, gid_t egid) {
+	int rv = sip_real(setregid)(rgid, egid);
+
+	if (rv == 0)
+		sip_level_refresh();
+	return rv;
+}
+
+sip_wrapper(int, setresgid, gid_t rgid, gid_t egid, gid_t sgid) {
+	int rv = sip_real(setresgid)(rgid, egid, sgid);
+
+	if (rv == 0)
+		sip_level_refresh();
+	return rv;
+}
+
 /**
  * Wrapper for execve(2). Enforces the following policy:
  *
  * PROCESS LEVEL | ACTION
  * ---------------------------------------------------------------------------
- * HIGH          | Deny if file to be executed is untrusted.
+ * HIGH          | Deny if file to be executed is untrusted. The file is opened
+ *               | once and the checked descriptor is executed with fexecve.
  * ---------------------------------------------------------------------------
  */
 
 sip_wrapper(int, execve, const char *filename, char *const argv[], char *const envp[]) {
 
-	if (SIP_IS_HIGHI && SIP_LV_LOW == sip_path_to_level(filename)) {
-		sip_info("Blocking attempt to execute low integrity file %s\n", filename);
-		errno = EACCES;
+	/* Credentials may have changed behind our back (e.g. in a vfork child),
+	   so re-read them before making a policy decision. A vfork child can't
+	   cache its level (see sip_level_refresh()); use it directly. */
+	int level = sip_level_refresh();
+
+	if (SIP_LV_HIGH == level) {
+		struct stat sbuf;
+		int err;
+
+		/* Check and execute the same file: open it, check the level on the
+		   descriptor, then execute the descriptor. */
+		int fd = sip_real(openat)(AT_FDCWD, filename, O_PATH | O_CLOEXEC);
+
+		if (fd == -1)
+			return -1;
+
+		if (sip_real_fstat(fd, &sbuf) == -1) {
+			err = errno;
+			sip_real(close)(fd);
+			errno = err;
+			return -1;
+		}
+
+		if (SIP_LV_LOW == sip_stat_buf_to_level(&sbuf)) {
+			sip_info("Blocking attempt to execute low integrity file %s\n", filename);
+			sip_real(close)(fd);
+			errno = EACCES;
+			return -1;
+		}
+
+		fexecve(fd, argv, envp);
+
+		/* A script can't be run from a close-on-exec descriptor: the
+		   interpreter gets /dev/fd/N and finds it closed. Keep the checked
+		   descriptor open across the exec and try again. */
+		if (errno == ENOENT && sip_real(fcntl)(fd, F_SETFD, 0) == 0)
+			fexecve(fd, argv, envp);
+
+		/* Anything else (e.g. ENOSYS without execveat) denies the exec:
+		   executing by name would run a file that was never checked. */
+		err = errno;
+		sip_real(close)(fd);
+		errno = err;
 		return -1;
 	}
 
-	_execve = sip_find_sym("execve");
-
-	return _execve(filename, argv, envp);
+	return sip_real(execve)(filename, argv, envp);
 }
 
 /**
@@ -454,45 +568,43 @@ sip_wrapper(int, execve, const char *filename, char *const argv[], char *const e
  */
 sip_wrapper(int, __fxstatat, int ver, int dirfd, const char *pathname, struct stat *statbuf, int flags) {
 
- 	char *redirected_path = strdup(pathname), *temp_path;
-
-	if (redirected_path == NULL) {
-		sip_error("__fxstatat aborted: out of memory.\n");
-		return -1;
-	}
-
  	/* Redirect pathname before call if appropriate */
     //  if(SIP_LV_LOW) {	
-	// 		redirected_path = sip_convert_to_redirected_path(redirected_path);
+	// 		pathname = sip_convert_to_redirected_path(pathname);
 	// 	}
 
-	___fxstatat = sip_find_sym("__fxstatat");
-
-	int rv = ___fxstatat(ver, dirfd, redirected_path, statbuf, flags);
+	int routed = SIP_IS_LOWI && sip_route_lookup(pathname, SIP_ROUTE_FSTATAT);
+	int rv = routed ? sip_route_native_skipped() : sip_real(__fxstatat)(ver, dirfd, pathname, statbuf, flags);
 
 	if (rv == -1 && errno == EACCES && SIP_IS_LOWI) {
 
-		sip_info("Delegating __fxstatat on %s\n", redirected_path);
+		/* Entries of a directory listed by the daemon moments ago. */
+		if (sip_dircache_stat(dirfd, pathname, flags, statbuf))
+			return 0;
+
+		sip_info("Delegating __fxstatat on %s\n", pathname);
 
-		temp_path = redirected_path;
-		redirected_path = sip_abs_path(dirfd, redirected_path); /* to avoid passing dirfd to helper */
-		free(temp_path);
+		if (!routed)
+			sip_route_learn(pathname, SIP_ROUTE_FSTATAT);
 
-		SIP_PREPARE_REQ(fstatat, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.pathname, redirected_path, PATH_MAX);
-		request.flags = flags;
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_fstatat(&response, dirfd, pathname, flags) == 0) {
 			rv = response.rv;
 			errno = response.err;
 
 			if (rv >= 0) { /* stat buf will be in response.buf */
-				memcpy(statbuf, response.buf, sizeof(struct stat));
+				if (response.size == sizeof(struct stat)) {
+					memcpy(statbuf, response.buf, sizeof(struct stat));
+				} else {
+					rv = -1;
+					errno = EIO;
+				}
 			}
+		} else if (routed) {
+			/* The daemon is out of reach: make the call that was skipped. */
+			rv = sip_real(__fxstatat)(ver, dirfd, pathname, statbuf, flags);
 		}
-
-		free(redirected_path);
 	}
 
 	return rv;
@@ -508,18 +620,14 @@ sip_wrapper(int, __xstat, int ver, const char *pathname, struct stat *statbuf) {
 }
 
 /**
- * Wrapper for fstat(2). Redirects to fstatat(2).
+ * Wrapper for fstat(2). Holding the descriptor is enough to stat the file, so
+ * the call never needs to be delegated and goes straight to libc.
  *
  * NOTE: __fxstat is the name libc uses internally for fstat.
  */
 
 sip_wrapper(int, __fxstat, int ver, int fd, struct stat *statbuf) {
-	char* path = sip_fd_to_path(fd);
-
-	if (path == NULL)
-		return -1;
-
-	return __fxstatat(ver, AT_FDCWD, path, statbuf, 0);
+	return sip_real(__fxstat)(ver, fd, statbuf);
 }
 
 /**
@@ -542,39 +650,31 @@ sip_wrapper(int, __lxstat, int ver, const char *pathname, struct stat *statbuf)
  */
 sip_wrapper(int, statvfs, const char *path, struct statvfs *buf) {
 
-	/* Create copy of path we can modify */
-	char* redirected_path = strdup(path), *temp_path;
-
 	// if (SIP_IS_LOWI) {
-	//		redirected_path = sip_convert_to_redirected_path(redirected_path); 
+	//		path = sip_convert_to_redirected_path(path); 
 	// }
 
-	_statvfs = sip_find_sym("statvfs");
-
-    int res = _statvfs(redirected_path, buf);
+    int res = sip_real(statvfs)(path, buf);
 
 	if (res == -1 && errno == EACCES && SIP_IS_LOWI) {
 		
-		sip_info("Delegating statvfs on %s\n", redirected_path);
-
-		temp_path = redirected_path;
-		redirected_path = sip_abs_path(AT_FDCWD, redirected_path); /* handle relative paths */
-		free(temp_path);
+		sip_info("Delegating statvfs on %s\n", path);
 
-		SIP_PREPARE_REQ(statvfs, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.path, redirected_path, PATH_MAX);
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_statvfs(&response, AT_FDCWD, path) == 0) {
 			res = response.rv;
 			errno = response.err;
 
 			if (res >= 0) { /* statvfs buf will be in response.buf */
-				memcpy(buf, response.buf, sizeof(struct statvfs));
+				if (response.size == sizeof(struct statvfs)) {
+					memcpy(buf, response.buf, sizeof(struct statvfs));
+				} else {
+					res = -1;
+					errno = EIO;
+				}
 			}
 		}
-
-		free(redirected_path);
 	}
 
 	return res;
@@ -585,18 +685,34 @@ sip_wrapper(int, statvfs, const char *path, struct statvfs *buf) {
  *
  * PROCESS LEVEL | ACTION
  * ---------------------------------------------------------------------------
- * ALL           | Forward to statvfs.
+ * LOW           | Delegate as statvfs if call fails due to lack of permissions.
  * ---------------------------------------------------------------------------
  */
 sip_wrapper(int, fstatvfs, int fd, struct statvfs *buf) {
-	char* path = sip_fd_to_path(fd);
 
-	if (path == NULL) {
-		return -1;
+	int res = sip_real(fstatvfs)(fd, buf);
+
+	if (res == -1 && errno == EACCES && SIP_IS_LOWI) {
+
+		sip_info("Delegating fstatvfs with descriptor %d\n", fd);
+
+		SIP_PREPARE_RES(response);
+
+		if (sip_delegate_statvfs(&response, fd, "") == 0) {
+			res = response.rv;
+			errno = response.err;
+
+			if (res >= 0) { /* statvfs buf will be in response.buf */
+				if (response.size == sizeof(struct statvfs)) {
+					memcpy(buf, response.buf, sizeof(struct statvfs));
+				} else {
+					res = -1;
+					errno = EIO;
+				}
+			}
+		}
 	}
 
-	int res = statvfs(path, buf);
-	free(path);
 	return res;
 }
 
@@ -610,30 +726,23 @@ sip_wrapper(int, fstatvfs, int fd, struct statvfs *buf) {
  */
 sip_wrapper(int, linkat, int olddirfd, const char *oldpath, int newdirfd, const char *newpath, int flags) {
 
-	_linkat = sip_find_sym("linkat");
-
-	int res = _linkat(olddirfd, oldpath, newdirfd, newpath, flags);
+	int res = sip_real(linkat)(olddirfd, oldpath, newdirfd, newpath, flags);
 
 	if(res == -1 && errno == EACCES && SIP_IS_LOWI) {
 		
 		sip_info("Delegating linkat with oldpath %s, newpath %s\n", oldpath, newpath);
 
-		/* convert paths to abs. paths to avoid passing dirfds */
-		oldpath = sip_abs_path(olddirfd, oldpath);
-		newpath = sip_abs_path(newdirfd, newpath);
-
-		SIP_PREPARE_REQ(linkat, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.oldpath, oldpath, PATH_MAX);
-		strncpy(request.newpath, newpath, PATH_MAX);
-		request.flags = flags;
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_linkat(&response, olddirfd, oldpath, newdirfd, newpath, flags) == 0) {
 			res = response.rv;
-			errno = response.err;	
+			errno = response.err;
 		}
 	}
 
+	if (res == 0)
+		sip_dircache_invalidate();
+
 	return res;
 }
 
@@ -661,38 +770,27 @@ sip_wrapper(int, link, const char *oldpath, const char *newpath) {
  */
 sip_wrapper(int, mkdirat, int dirfd, const char *pathname, mode_t mode) {
 
-	/* Create copy of pathname we can modify */
-	char* redirected_path = strdup(pathname), *temp_path;
-
 	// if (SIP_IS_LOWI) {
-	// 		redirected_path = sip_convert_to_redirected_path(redirected_path);
+	// 		pathname = sip_convert_to_redirected_path(pathname);
 	// }
 
-	_mkdirat = sip_find_sym("mkdirat");
-	
-	int rv = _mkdirat(dirfd, redirected_path, mode);
+	int rv = sip_real(mkdirat)(dirfd, pathname, mode);
 
 	if (rv == -1 && errno == EACCES && SIP_IS_LOWI) {
 		
-		sip_info("Delegating mkdirat with path %s\n", redirected_path);
+		sip_info("Delegating mkdirat with path %s\n", pathname);
 
-		temp_path = redirected_path;
-		redirected_path = sip_abs_path(dirfd, redirected_path); /* handle relative paths */
-		free(temp_path);
-
-		SIP_PREPARE_REQ(mkdirat, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.pathname, redirected_path, PATH_MAX);
-		request.mode = mode;
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_mkdirat(&response, dirfd, pathname, mode) == 0) {
 			rv = response.rv;
-			errno = response.err;	
+			errno = response.err;
 		}
-
-		free(redirected_path);
 	}
 
+	if (rv == 0)
+		sip_dircache_invalidate();
+
 	return rv;
 }
 
@@ -720,42 +818,30 @@ sip_wrapper(int, mkdir, const char *pathname, mode_t mode) {
  */
 sip_wrapper(int, __xmknodat, int ver, int dirfd, const char *pathname, mode_t mode, dev_t *dev) {
 
-	char* redirected_path = strdup(pathname), *temp_path;
-
 	// if (SIP_IS_LOWI) {
-	// 	redirected_path = sip_get_redirected_path(redirected_path);
+	// 	pathname = sip_get_redirected_path(pathname);
 	// }
 
-	___xmknodat = sip_find_sym("__xmknodat");
-
-	int rv = ___xmknodat(ver, dirfd, redirected_path, mode, dev);
+	int rv = sip_real(__xmknodat)(ver, dirfd, pathname, mode, dev);
 
 	if (rv == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
 		
-		sip_info("Delegating __xmknodat with path %s\n", redirected_path);
-
-		temp_path = redirected_path;
-		redirected_path = sip_abs_path(dirfd, redirected_path); /* handle relative paths */
-		free(temp_path);
+		sip_info("Delegating __xmknodat with path %s\n", pathname);
 
-		SIP_PREPARE_REQ(mknodat, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.pathname, redirected_path, PATH_MAX);
-		request.mode = mode;
 
 		/* dev parameter only used when type is S_IFCHR or S_IFBLK */
-		if ((mode & S_IFCHR) || (mode & S_IFBLK)) {
-			memcpy(&request.dev, dev, sizeof(dev_t));
-		}
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+		dev_t devno = ((mode & S_IFCHR) || (mode & S_IFBLK)) ? *dev : 0;
+
+		if (sip_delegate_mknodat(&response, dirfd, pathname, mode, devno) == 0) {
 			rv = response.rv;
-			errno = response.err;	
+			errno = response.err;
 		}
-
-		free(redirected_path);
 	}
 
+	if (rv == 0)
+		sip_dircache_invalidate();
+
 	return rv;
 }
 
@@ -798,6 +884,141 @@ sip_wrapper(int, open, const char *__file, int __oflag, ...) {
 	return res;
 }
 
+/**
+ * Open the file behind a checked descriptor again with the real flags,
+ * through /proc/self/fd/N, so the open reaches the file that was checked.
+ *
+ * @return New descriptor, or -1 with errno set. fd is left open.
+ */
+static int sip_high_reopen(int fd, int dirfd, const char *pathname, int flags, struct stat *sbuf) {
+	struct stat opened;
+	char proc[32];
+	int file;
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	file = sip_real(openat)(AT_FDCWD, proc, flags & ~(O_CREAT | O_EXCL | O_NOFOLLOW | O_TRUNC), 0);
+
+	/* Without /proc, open by name and make sure it's the same file */
+	if (file == -1 && errno == ENOENT) {
+		file = sip_real(openat)(dirfd, pathname, flags & ~(O_CREAT | O_TRUNC), 0);
+
+		if (file != -1 && (sip_real_fstat(file, &opened) == -1 ||
+		    opened.st_dev != sbuf->st_dev || opened.st_ino != sbuf->st_ino)) {
+			sip_real(close)(file);
+			file = -1;
+			errno = EACCES;
+		}
+	}
+
+	return file;
+}
+
+/**
+ * openat(2) for high integrity processes. The file is opened once, with
+ * O_NONBLOCK and O_NOCTTY added and O_TRUNC left out, and its level is checked
+ * on the new descriptor. A denied open thus neither waits on a FIFO or a
+ * device, nor takes a terminal as controlling terminal, nor truncates the
+ * file. Once the check has passed, O_NONBLOCK is cleared again unless it was
+ * asked for, and O_TRUNC is applied.
+ *
+ * A FIFO opened without O_NONBLOCK has to wait for the other end, so once
+ * checked it is opened again with the real flags (see sip_high_reopen()). So
+ * is a file whose open O_NONBLOCK makes fail where the caller would have
+ * waited (a FIFO opened for writing without a reader, a file under a lease);
+ * its level is checked on an O_PATH descriptor.
+ *
+ * @return New descriptor, or -1 with errno set.
+ */
+static int sip_high_openat(int dirfd, const char *pathname, int flags, mode_t mode) {
+	struct stat sbuf;
+	int fd, file, err;
+
+	int wait = !(flags & (O_NONBLOCK | O_PATH)), reopen = 0;
+
+	fd = sip_real(openat)(dirfd, pathname, (flags & ~O_TRUNC) | O_NONBLOCK | O_NOCTTY, mode);
+
+	if (fd == -1 && (errno == ENXIO || errno == EWOULDBLOCK) && wait) {
+		fd = sip_real(openat)(dirfd, pathname, O_PATH | O_CLOEXEC | (flags & (O_NOFOLLOW | O_DIRECTORY)), 0);
+		reopen = 1;
+	}
+
+	if (fd == -1)
+		return -1;
+
+	if (sip_real_fstat(fd, &sbuf) == -1)
+		goto fail;
+
+	if (SIP_LV_LOW == sip_stat_buf_to_level(&sbuf)) {
+		sip_info("Denied read/write/exec permissions on low integrity file %s\n", pathname);
+		errno = EACCES;
+		goto fail;
+	}
+
+	if (wait && S_ISFIFO(sbuf.st_mode))
+		reopen = 1;
+
+	if (reopen) {
+		/* O_PATH|O_NOFOLLOW resolves a symlink where the open would fail */
+		if (S_ISLNK(sbuf.st_mode)) {
+			errno = ELOOP;
+			goto fail;
+		}
+
+		if ((file = sip_high_reopen(fd, dirfd, pathname, flags, &sbuf)) == -1)
+			goto fail;
+
+		sip_real(close)(fd);
+		fd = file;
+	} else if (wait) {
+		/* F_SETFL ignores the access mode and creation flags */
+		if (sip_real(fcntl)(fd, F_SETFL, flags) == -1)
+			goto fail;
+	}
+
+	if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY && S_ISREG(sbuf.st_mode)) {
+		if (ftruncate(fd, 0) == -1)
+			goto fail;
+	}
+
+	sip_fd_record(fd, dirfd, pathname, flags, &sbuf);
+	return fd;
+
+fail:
+	err = errno;
+	sip_real(close)(fd);
+	errno = err;
+	return -1;
+}
+
+/**
+ * Delegate openat(2) for a low integrity process. The new descriptor is
+ * recorded with its metadata: the process may not be able to reach the path
+ * itself, so the descriptor table couldn't check it later.
+ *
+ * @param int* res Receives the new descriptor, or -1 with errno set.
+ * @return -1 if the request can't be delivered (errno and res are left
+ *         alone), 0 otherwise.
+ */
+static int sip_delegate_open(int dirfd, const char *pathname, int flags, mode_t mode, int *res) {
+	struct stat sbuf;
+	int err = errno;
+
+	SIP_PREPARE_RES(response);
+
+	if (sip_delegate_openat(&response, dirfd, pathname, flags, mode) == -1) {
+		errno = err;
+		return -1;
+	}
+
+	*res = response.rv;
+	errno = response.err;
+
+	if (*res >= 0)
+		sip_fd_record(*res, dirfd, pathname, flags, sip_real_fstat(*res, &sbuf) == 0 ? &sbuf : NULL);
+
+	return 0;
+}
+
 /**
  * Wrapper for open(2). Enforces the following policy:
  *
@@ -821,22 +1042,22 @@ sip_wrapper(int, openat, int dirfd, const char * __file, int __oflag, ...) {
 	if (__oflag & O_CREAT || __oflag & O_TMPFILE)
 		mode = va_arg(args, mode_t);
 
-	/* If a high integrity process tries to open a low integrity file, deny */
-	if(SIP_IS_HIGHI) {
-
-		if(SIP_LV_LOW == sip_path_to_level(__file)) {
-			sip_info("Denied read/write/exec permissions on low integrity file %s\n", __file);
-			errno = EACCES;
-			return -1;
-		}
-	}
-
 	/* Destory va list */
 	va_end(args);
 
-	_openat = sip_find_sym("openat");
+	/* If a high integrity process tries to open a low integrity file, deny */
+	if(SIP_IS_HIGHI)
+		return sip_high_openat(dirfd, __file, __oflag, mode);
 
-	int res = _openat(dirfd, __file, __oflag, mode);
+	/* Opens that may create the file always try natively first: a route
+	   learned from a denied read would make the daemon create it, with its
+	   own owner, where the process could have created it itself. */
+	int creates = (__oflag & O_CREAT) || (__oflag & O_TMPFILE) == O_TMPFILE;
+	int routed = SIP_IS_LOWI && !creates && sip_route_lookup(__file, SIP_ROUTE_OPENAT_KEY(__oflag));
+	int res = routed ? sip_route_native_skipped() : sip_real(openat)(dirfd, __file, __oflag, mode);
+
+	if (res >= 0)
+		sip_fd_record(res, dirfd, __file, __oflag, NULL);
 
 	/* If process is low integrity and request fails due to lack of permissions,
 	   delegate to helper. */
@@ -844,26 +1065,163 @@ sip_wrapper(int, openat, int dirfd, const char * __file, int __oflag, ...) {
 		
 		sip_info("Delegating openat on %s\n", __file);
 
-		char* abspath = sip_abs_path(dirfd, __file); /* to avoid passing dirfd to helper */
+		if (!routed && !creates)
+			sip_route_learn(__file, SIP_ROUTE_OPENAT_KEY(__oflag));
 
-		SIP_PREPARE_REQ(openat, request);
-		
-		strncpy(request.file, abspath, PATH_MAX);
-		request.mode = mode;
-		request.flags = __oflag;
+		/* If the daemon is out of reach, make the call that was skipped. */
+		if (sip_delegate_open(dirfd, __file, __oflag, mode, &res) == -1 && routed &&
+			(res = sip_real(openat)(dirfd, __file, __oflag, mode)) >= 0)
+			sip_fd_record(res, dirfd, __file, __oflag, NULL);
+	}
 
-		SIP_PREPARE_RES(response);
+	return res;
+}
 
-		if (sip_delegate_call_fd(&request, &response) == 0) {
-			res = response.rv;
-			errno = response.err;
-		}
+/* The HIGH build keeps no descriptor table, so these are not needed there. */
+#if !defined(SIP_LIB_LEVEL) || SIP_LIB_LEVEL != SIP_LV_HIGH
+/**
+ * Wrappers for close(2), dup(2), dup2(2), dup3(2) and fcntl(2). These keep the
+ * descriptor table used by the fd-based wrappers up to date:
+ *
+ * PROCESS
+ * ---------------------------------------------------------------------------
+ * Forget closed descriptors; copy the entry of the old descriptor to the new
+ * one when a descriptor is duplicated.
+ * ---------------------------------------------------------------------------
+ */
+sip_wrapper(int, close, int fd) {
+	sip_fd_forget(fd);
+
+	return sip_real(close)(fd);
+}
+
+sip_wrapper(int, dup, int oldfd) {
+	int newfd = sip_real(dup)(oldfd);
+
+	if (newfd >= 0)
+		sip_fd_record_dup(oldfd, newfd, 0);
+
+	return newfd;
+}
+
+sip_wrapper(int, dup2, int oldfd, int newfd) {
+	int rv = sip_real(dup2)(oldfd, newfd);
+
+	if (rv >= 0)
+		sip_fd_record_dup(oldfd, rv, 0);
+
+	return rv;
+}
+
+sip_wrapper(int, dup3, int oldfd, int newfd, int flags) {
+	int rv = sip_real(dup3)(oldfd, newfd, flags);
+
+	if (rv >= 0)
+		sip_fd_record_dup(oldfd, rv, flags & O_CLOEXEC);
+
+	return rv;
+}
+
+sip_wrapper(int, fcntl, int fd, int cmd, ...) {
+	va_list args;
+	void *arg;
+
+	/* The third argument is an int, a pointer or absent depending on cmd;
+	   pass it through as-is. */
+	va_start(args, cmd);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	int rv = sip_real(fcntl)(fd, cmd, arg);
+
+	if (rv >= 0 && (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC))
+		sip_fd_record_dup(fd, rv, cmd == F_DUPFD_CLOEXEC);
+
+	return rv;
+}
+#endif
+
+/* The HIGH build never delegates, so its directory streams are all real. */
+#if !defined(SIP_LIB_LEVEL) || SIP_LIB_LEVEL != SIP_LV_HIGH
+/**
+ * Wrapper for opendir(3). Enforces the following policy:
+ *
+ * PROCESS LEVEL | ACTION
+ * ---------------------------------------------------------------------------
+ * LOW           | If the directory can't be read, list it through the daemon
+ *               | and return an emulated stream (see dircache.c).
+ * ---------------------------------------------------------------------------
+ */
+sip_wrapper(DIR *, opendir, const char *name) {
+	DIR *dirp = sip_real(opendir)(name);
+
+	if (dirp == NULL && errno == EACCES && SIP_IS_LOWI) {
 
-		free(abspath); /* dynamically allocated by sip_abs_path */
+		sip_info("Delegating opendir on %s\n", name);
+
+		if ((dirp = sip_dir_open(AT_FDCWD, name)) == NULL)
+			errno = EACCES;
 	}
 
-	return res;
+	return dirp;
+}
+
+/**
+ * Wrappers for readdir(3), readdir64(3), closedir(3), rewinddir(3),
+ * telldir(3), seekdir(3) and dirfd(3):
+ *
+ * PROCESS
+ * ---------------------------------------------------------------------------
+ * Serve emulated streams from their listing; pass the rest to libc.
+ * ---------------------------------------------------------------------------
+ */
+sip_wrapper(struct dirent *, readdir, DIR *dirp) {
+	if (sip_dir_is_emulated(dirp))
+		return sip_dir_read(dirp);
+	return sip_real(readdir)(dirp);
+}
+
+sip_wrapper(struct dirent64 *, readdir64, DIR *dirp) {
+	if (sip_dir_is_emulated(dirp))
+		return sip_dir_read64(dirp);
+	return sip_real(readdir64)(dirp);
+}
+
+sip_wrapper(int, closedir, DIR *dirp) {
+	if (sip_dir_is_emulated(dirp))
+		return sip_dir_close(dirp);
+	return sip_real(closedir)(dirp);
+}
+
+sip_wrapper(void, rewinddir, DIR *dirp) {
+	if (sip_dir_is_emulated(dirp))
+		sip_dir_rewind(dirp);
+	else
+		sip_real(rewinddir)(dirp);
+}
+
+sip_wrapper(long, telldir, DIR *dirp) {
+	if (sip_dir_is_emulated(dirp))
+		return sip_dir_tell(dirp);
+	return sip_real(telldir)(dirp);
+}
+
+sip_wrapper(void, seekdir, DIR *dirp, long loc) {
+	if (sip_dir_is_emulated(dirp))
+		sip_dir_seek(dirp, loc);
+	else
+		sip_real(seekdir)(dirp, loc);
+}
+
+/* Emulated streams have no descriptor behind them. */
+sip_wrapper(int, dirfd, DIR *dirp) {
+	if (sip_dir_is_emulated(dirp)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return sip_real(dirfd)(dirp);
 }
+#endif
 
 /**
  * Wrapper for readlinkat(2). Enforces the following policy:
@@ -877,24 +1235,12 @@ sip_wrapper(int, openat, int dirfd, const char * __file, int __oflag, ...) {
  */
 sip_wrapper(ssize_t, readlinkat, int dirfd, const char *pathname, char *buf, size_t bufsiz) {
 
-    /* To avoid compiler warnings, created a copy of pathname we can modify */
-    char *redirected_path = strdup(pathname);
-
-    if (redirected_path == NULL) {
-    	sip_error("readlinkat aborted: out of memory.\n");
-    	return -1;
-    }
-
     /* Redirect pathname before call if appropriate */
  	// if(SIP_LV_LOW) {
-	// 	redirected_path = sip_convert_to_redirected_path(redirected_path);
+	// 	pathname = sip_convert_to_redirected_path(pathname);
 	// }
 
-    _readlinkat = sip_find_sym("readlinkat");
-
-    int res = _readlinkat(dirfd, redirected_path, buf, bufsiz);
-    
-    free(redirected_path); 	/* clean up after strdup */
+    int res = sip_real(readlinkat)(dirfd, pathname, buf, bufsiz);
 
     if(res > 0 && sip_is_redirected(buf)) {
     	char* orig_path = sip_revert_path(buf);
@@ -928,25 +1274,17 @@ sip_wrapper(int, renameat2, int olddirfd, const char *oldpath, int newdirfd, con
 		
 		sip_info("Delegating renameat2 with oldpath %s, newpath %s\n", oldpath, newpath);
 
-		/* convert paths to abs. paths to avoid passing dir fds */
-		char* oldpathfull = sip_abs_path(olddirfd, oldpath);
-		char* newpathfull = sip_abs_path(newdirfd, newpath);
-
-		SIP_PREPARE_REQ(renameat2, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.oldpath, oldpathfull, PATH_MAX);
-		strncpy(request.newpath, newpathfull, PATH_MAX);
-		request.flags = flags;
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_renameat2(&response, olddirfd, oldpath, newdirfd, newpath, flags) == 0) {
 			res = response.rv;
-			errno = response.err;	
+			errno = response.err;
 		}
-
-		free(oldpathfull);
-		free(newpathfull);
 	}
 
+	if (res == 0)
+		sip_dircache_invalidate();
+
 	return res;
 }
 
@@ -992,9 +1330,7 @@ sip_wrapper(int, rmdir, const char *pathname) {
 	//	pathname = sip_convert_to_redirected_path(pathname); 
 	// }
 
-    _rmdir = sip_find_sym("rmdir");
-
-    return _rmdir(pathname);
+    return sip_real(rmdir)(pathname);
 }
 
 /**
@@ -1007,29 +1343,23 @@ sip_wrapper(int, rmdir, const char *pathname) {
  */
 sip_wrapper(int, symlinkat, const char *target, int newdirfd, const char *linkpath) {
 
-    _symlinkat = sip_find_sym("symlinkat");
-
-    int res = _symlinkat(target, newdirfd, linkpath);
+    int res = sip_real(symlinkat)(target, newdirfd, linkpath);
 
     if (res == -1 && errno == EACCES && SIP_IS_LOWI) {
 		
 		sip_info("Delegating symlinkat with target %s, linkpath %s\n", target, linkpath);
 
-		char* linkpathfull = sip_abs_path(newdirfd, linkpath); /* handle rel. paths */
-
-		SIP_PREPARE_REQ(symlinkat, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.target, target, PATH_MAX);
-		strncpy(request.linkpath, linkpathfull, PATH_MAX);
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_symlinkat(&response, target, newdirfd, linkpath) == 0) {
 			res = response.rv;
-			errno = response.err;	
+			errno = response.err;
 		}
-
-		free(linkpathfull);
 	}
 
+    if (res == 0)
+    	sip_dircache_invalidate();
+
     return res;
 }
 
@@ -1063,29 +1393,30 @@ sip_wrapper(int, unlinkat, int dirfd, const char *pathname, int flags) {
 	// 	pathname = sip_convert_to_redirected_path(pathname); 
 	// }
 
-    _unlinkat = sip_find_sym("unlinkat");
-
-    int res = _unlinkat(dirfd, pathname, flags);
+    int routed = SIP_IS_LOWI && sip_route_lookup(pathname, SIP_ROUTE_UNLINKAT);
+    int res = routed ? sip_route_native_skipped() : sip_real(unlinkat)(dirfd, pathname, flags);
 
     if (res == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
 
 		sip_info("Delegating unlinkat with pathname %s\n", pathname);
 
-		char* abspathname = sip_abs_path(dirfd, pathname); /* handle rel. paths */
+		if (!routed)
+			sip_route_learn(pathname, SIP_ROUTE_UNLINKAT);
 
-		SIP_PREPARE_REQ(unlinkat, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.pathname, abspathname, PATH_MAX);
-		request.flags = flags;
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_unlinkat(&response, dirfd, pathname, flags) == 0) {
 			res = response.rv;
-			errno = response.err;	
+			errno = response.err;
+		} else if (routed) {
+			/* The daemon is out of reach: make the call that was skipped. */
+			res = sip_real(unlinkat)(dirfd, pathname, flags);
 		}
-
-		free(abspathname);
     }
 
+    if (res == 0)
+    	sip_dircache_invalidate();
+
     return res;
 }
 
@@ -1117,27 +1448,26 @@ sip_wrapper(int, utime, const char *path, const struct utimbuf *times) {
 	//	path = sip_get_redirected_path(path);
 	// }
 
-    _utime = sip_find_sym("utime");
-
-    int rv = _utime(path, times);
+    int rv = sip_real(utime)(path, times);
 
     if (rv == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
     	
     	sip_info("Delegating utime with path %s\n", path);
 
-		char* pathfull = sip_abs_path(AT_FDCWD, path); /* handle rel. paths */
-
-		SIP_PREPARE_REQ(utime, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.path, pathfull, PATH_MAX);
-		memcpy(&request.times, times, sizeof(struct utimbuf));
-		
-		if (sip_delegate_call(&request, &response) == 0) {
-			rv = response.rv;
-			errno = response.err;	
+
+		/* NULL times means "now"; spell it out for the helper */
+		struct utimbuf now;
+
+		if (times == NULL) {
+			now.actime = now.modtime = time(NULL);
+			times = &now;
 		}
 
-		free(pathfull);
+		if (sip_delegate_utime(&response, AT_FDCWD, path, *times) == 0) {
+			rv = response.rv;
+			errno = response.err;
+		}
     }
 
     return rv;
@@ -1159,27 +1489,27 @@ sip_wrapper(int, utimes, const char *filename, const struct timeval times[2]) {
 	// 	filename = sip_convert_to_redirected_path(filename);
 	// }
 
-    _utimes = sip_find_sym("utimes");
-
-    int rv = _utimes(filename, times);
+    int rv = sip_real(utimes)(filename, times);
 
     if (rv == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
     	
     	sip_info("Delegating utimes with filename %s\n", filename);
 
-		char* filenamefull = sip_abs_path(AT_FDCWD, filename); /* handle rel. paths */
-
-		SIP_PREPARE_REQ(utimes, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.filename, filenamefull, PATH_MAX);
-		memcpy(&request.times, times, 2 * sizeof(struct timeval));
-		
-		if (sip_delegate_call(&request, &response) == 0) {
-			rv = response.rv;
-			errno = response.err;	
+
+		/* NULL times means "now"; spell it out for the helper */
+		struct timeval now[2];
+
+		if (times == NULL) {
+			gettimeofday(&now[0], NULL);
+			now[1] = now[0];
+			times = now;
 		}
 
-		free(filenamefull);
+		if (sip_delegate_utimes(&response, AT_FDCWD, filename, times) == 0) {
+			rv = response.rv;
+			errno = response.err;
+		}
     }
 
     return rv;
@@ -1201,28 +1531,18 @@ sip_wrapper(int, utimensat, int dirfd, const char *pathname, const struct timesp
 	// 	pathname = sip_get_redirected_path(pathname);
 	// }
 
-    _utimensat = sip_find_sym("utimensat");
-
-    int rv = _utimensat(dirfd, pathname, times, flags);
+    int rv = sip_real(utimensat)(dirfd, pathname, times, flags);
 
     if (rv == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
     	
     	sip_info("Delegating utimensat with pathname %s\n", pathname);
 
-		char* pathnamefull = sip_abs_path(dirfd, pathname); /* handle rel. paths */
-
-		SIP_PREPARE_REQ(utimensat, request);
 		SIP_PREPARE_RES(response);
-		strncpy(request.pathname, pathnamefull, PATH_MAX);
-		memcpy(&request.times, times, 2 * sizeof(struct timespec));
-		request.flags = flags;
-		
-		if (sip_delegate_call(&request, &response) == 0) {
+
+		if (sip_delegate_utimensat(&response, dirfd, pathname, times ? times : sip_utime_now, flags) == 0) {
 			rv = response.rv;
-			errno = response.err;	
+			errno = response.err;
 		}
-
-		free(pathnamefull);
     }
 
     return rv;
@@ -1240,9 +1560,7 @@ sip_wrapper(int, utimensat, int dirfd, const char *pathname, const struct timesp
  */
 sip_wrapper(int, futimens, int fd, const struct timespec times[2]) {
 
-    _futimens = sip_find_sym("futimens");
-
-    int rv = _futimens(fd, times);
+    int rv = sip_real(futimens)(fd, times);
 
     if (rv == -1 && (errno == EACCES || errno == EPERM) && SIP_IS_LOWI) {
     	
@@ -1251,28 +1569,11 @@ sip_wrapper(int, futimens, int fd, const struct timespec times[2]) {
     	/* NOTE: glibc uses utimensat internally to implement this call.
     	   We convert to an equivalent utimensat call here so as to avoid
     	   passing the fd to the helper. */
-    	char* pathname = sip_fd_to_path(fd);
-
-  		// if (SIP_IS_LOWI) {
-  		//  char* temp_path = pathname;
-		// 	pathname = sip_convert_to_redirected_path(pathname);
-		// 	free(temp_path);
-		// }
-
-    	if (pathname != NULL) {
-    		
-    		SIP_PREPARE_REQ(utimensat, request);
-			SIP_PREPARE_RES(response);
-			strncpy(request.pathname, pathname, PATH_MAX);
-			memcpy(&request.times, times, 2 * sizeof(struct timespec));
-			request.flags = 0;
-			
-			if (sip_delegate_call(&request, &response) == 0) {
-				rv = response.rv;
-				errno = response.err;	
-			}
+    	SIP_PREPARE_RES(response);
 
-    		free(pathname);
+    	if (sip_delegate_utimensat(&response, fd, "", times ? times : sip_utime_now, 0) == 0) {
+    		rv = response.rv;
+    		errno = response.err;
     	}
     }
 
@@ -1290,27 +1591,22 @@ sip_wrapper(int, futimens, int fd, const struct timespec times[2]) {
  */
 sip_wrapper(int, bind, int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 
-    _bind = sip_find_sym("bind");
-
-    int rv = _bind(sockfd, addr, addrlen);
+    int rv = sip_real(bind)(sockfd, addr, addrlen);
 
     if (rv == -1 && errno == EACCES && SIP_IS_LOWI) {
     	
     	if (addr->sa_family == AF_LOCAL) { /* AF_LOCAL = AF_UNIX = PF_LOCAL... */
 			
-			sip_info("Delegating bind with sockfd %s\n", sockfd);
+			sip_info("Delegating bind with sockfd %d\n", sockfd);
 
 			/* NOTE: the sockfd is not passed to the helper. It is expected that
 			   the helper creates a new socket, binds it to the given address,
 			   and returns the descriptor for the new socket. */
-			SIP_PREPARE_REQ(bind, request);
 			SIP_PREPARE_RES(response);
-			memcpy(&request.addr, addr, sizeof(struct sockaddr));
-			request.addrlen = addrlen;
 
 			/* Need to set socktype so server can create socket of appropriate
 			   type. Query using getsockopt. */
-			int socktype, optlen = sizeof(int);		
+			int socktype, optlen = sizeof(int);
 
 			if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &socktype, &optlen) < 0) {
 				sip_error("Couldn't get socket type for %d -- aborting.\n", sockfd);
@@ -1318,9 +1614,7 @@ sip_wrapper(int, bind, int sockfd, const struct sockaddr *addr, socklen_t addrle
 				return -1;
 			}
 
-			request.socktype = socktype;
-			
-			if (sip_delegate_call_fd(&request, &response) == 0) {
+			if (sip_delegate_bind(&response, *addr, socktype, addrlen) == 0) {
 				rv = response.rv;
 				errno = response.err;
 
@@ -1347,24 +1641,19 @@ sip_wrapper(int, bind, int sockfd, const struct sockaddr *addr, socklen_t addrle
  */
 sip_wrapper(int, connect, int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 
-    _connect = sip_find_sym("connect");
-
-    int rv = _connect(sockfd, addr, addrlen);
+    int rv = sip_real(connect)(sockfd, addr, addrlen);
 
     if (rv == -1 && errno == EACCES && SIP_IS_LOWI) {
     	
     	if (addr->sa_family == AF_LOCAL && sip_is_named_sock(addr, addrlen)) {
     		
-    		sip_info("Delegating connect with sockfd %s\n", sockfd);
+    		sip_info("Delegating connect with sockfd %d\n", sockfd);
 
 			/* NOTE: the sockfd is not passed to the helper. It is expected that
 			   the helper creates a new socket, connects it to the given address,
 			   and returns the descriptor for the new socket. */
-			SIP_PREPARE_REQ(connect, request);
 			SIP_PREPARE_RES(response);
-			memcpy(&request.addr, addr, sizeof(struct sockaddr));
-			request.addrlen = addrlen;
-			
+
 			/* Need to set socktype so server can create socket of appropriate
 			   type. Query using getsockopt. */
 			int socktype, optlen = sizeof(int);
@@ -1375,9 +1664,7 @@ sip_wrapper(int, connect, int sockfd, const struct sockaddr *addr, socklen_t add
 				return -1;
 			}
 
-			request.socktype = socktype;
-
-			if (sip_delegate_call_fd(&request, &response) == 0) {
+			if (sip_delegate_connect(&response, *addr, socktype, addrlen) == 0) {
 				rv = response.rv;
 				errno = response.err;
 
@@ -1404,9 +1691,7 @@ sip_wrapper(int, connect, int sockfd, const struct sockaddr *addr, socklen_t add
  */
 sip_wrapper(int, accept4, int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
 
-    _accept4 = sip_find_sym("accept4");
-
-    int newfd = _accept4(sockfd, addr, addrlen, flags);
+    int newfd = sip_real(accept4)(sockfd, addr, addrlen, flags);
 
     /* SO_PEERCRED only available for UNIX domain sockets -- don't check
      * peer creds for sockets with other domains. */
@@ -1442,6 +1727,7 @@ deny:
     }
 
 allow:
+    sip_fd_forget(newfd);
     return newfd;
 }
 
@@ -1462,9 +1748,7 @@ sip_wrapper(int, accept, int sockfd, struct sockaddr *addr, socklen_t *addrlen)
  * ---------------------------------------------------------------------------
  */
 sip_wrapper(int, msgget, key_t key, int msgflg) {
-	_msgget = sip_find_sym("msgget");
-
-	int msgid = _msgget(key, msgflg);
+	int msgid = sip_real(msgget)(key, msgflg);
 
 	if (msgid >= 0) {
 		struct msqid_ds msq;
@@ -1500,9 +1784,7 @@ sip_wrapper(int, msgget, key_t key, int msgflg) {
  * ---------------------------------------------------------------------------
  */
 sip_wrapper(int, shmget, key_t key, size_t size, int shmflg) {
-	_shmget = sip_find_sym("shmget");
-
-	int shmid = _shmget(key, size, shmflg);
+	int shmid = sip_real(shmget)(key, size, shmflg);
 
 	if (shmid >= 0) {
 		struct shmid_ds shm;
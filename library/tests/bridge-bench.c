@@ -0,0 +1,142 @@
+/**
+ * Benchmark for the delegation transports. Sends delegated fstatat and
+ * faccessat requests for one path to the daemon and reports the round trip
+ * time per call, once over the socket and once over shared-memory rings.
+ * Each transport is measured in a child started with SIP_TRANSPORT set.
+ *
+ * Usage: bridge_bench [-n CALLS] [-t THREADS] [PATH]
+ */
+
+#define _GNU_SOURCE /* setenv(3) */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "packets.h"
+#include "bridge.h"
+
+#define DEFAULT_CALLS 100000
+
+static const char *path = "/etc/passwd"; 	/* must be absolute */
+static long calls = DEFAULT_CALLS;
+static int threads = 1;
+static int failures = 0;
+
+/**
+ * Encode a request with the path followed by int fields (see packets.h).
+ * The path must be absolute.
+ */
+static void encode(char *packet, int callno, const int *values, int count) {
+	struct sip_header head;
+	unsigned short len = strlen(path) + 1;
+	char *pos = packet + sizeof(head);
+
+	*pos++ = -1; 	/* absolute path: no directory descriptor */
+	memcpy(pos, &len, sizeof(len));
+	memcpy(pos + sizeof(len), path, len);
+	pos += sizeof(len) + len;
+	memcpy(pos, values, count * sizeof(int));
+	pos += count * sizeof(int);
+
+	head.callno = callno;
+	head.size = pos - packet;
+	head.id = 0;
+	head.nfds = 0;
+	memcpy(packet, &head, sizeof(head));
+}
+
+static void run(int callno, const int *values, int count) {
+	struct sip_response response;
+	char packet[SIP_MAX_PACKET];
+	long i;
+
+	for (i = 0; i < calls / threads; i++) {
+		encode(packet, callno, values, count);
+		if (sip_delegate_call(packet, NULL, 0, &response) == -1 || response.rv != 0)
+			__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void *run_stat(void *arg) {
+	int flags = 0;
+
+	run(SYS_fstatat, &flags, 1);
+	return NULL;
+}
+
+static void *run_access(void *arg) {
+	int mode_flags[2] = { R_OK, 0 };
+
+	run(SYS_faccessat, mode_flags, 2);
+	return NULL;
+}
+
+static void measure(const char *name, void *(*fn)(void *)) {
+	struct timespec start, end;
+	pthread_t tids[threads];
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, fn, NULL);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("  %-10s %10.1f ns/call\n", name,
+		   ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / calls);
+}
+
+int main(int argc, char** argv) {
+	const char *transports[] = { "socket", "ring" };
+	int opt, i, status;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+			case 'n': calls = atol(optarg); break;
+			case 't': threads = atoi(optarg); break;
+			default:
+				printf("Usage: bridge_bench [-n CALLS] [-t THREADS] [PATH]\n");
+				return 1;
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	if (calls <= 0 || threads <= 0) {
+		printf("Usage: bridge_bench [-n CALLS] [-t THREADS] [PATH]\n");
+		return 1;
+	}
+
+	/* Child: measure the transport we were started with. */
+	if (strcmp(argv[0], "bridge_bench-run") == 0) {
+		measure("fstatat", run_stat);
+		measure("faccessat", run_access);
+		if (failures)
+			printf("  %d calls failed\n", failures);
+		return failures != 0;
+	}
+
+	for (i = 0; i < 2; i++) {
+		printf("%s (%ld calls, %d threads, %s):\n", transports[i], calls, threads, path);
+		fflush(stdout);
+
+		if ((pid = fork()) == 0) {
+			setenv("SIP_TRANSPORT", transports[i], 1);
+			argv[0] = "bridge_bench-run";
+			execv("/proc/self/exe", argv);
+			perror("execv failed");
+			_exit(1);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			printf("  failed\n");
+	}
+
+	return 0;
+}
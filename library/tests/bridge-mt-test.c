@@ -0,0 +1,58 @@
+/**
+ * Test for concurrent delegation over one connection. Several threads send
+ * SYS_delegatortest calls at the same time, each with its own errno value,
+ * and check that every response they get back carries their value.
+ *
+ * If the test succeeds, it prints "0 mismatched responses".
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include "packets.h"
+#include "bridge.h"
+
+#define THREADS 8
+#define CALLS 10000
+
+static int mismatches = 0;
+static int failures = 0;
+
+static void *run(void *arg) {
+	struct sip_response response;
+	struct {
+		struct sip_header head;
+		int err; 	/* the only field of SYS_delegatortest */
+	} request;
+	int i, value = (int) (long) arg;
+
+	for (i = 0; i < CALLS; i++) {
+		request.head.callno = SYS_delegatortest;
+		request.head.size = sizeof(request);
+		request.head.nfds = 0;
+		request.err = value;
+
+		if (sip_delegate_call(&request, NULL, 0, &response) == -1)
+			__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+		else if (response.rv != 0 || response.err != value)
+			__atomic_add_fetch(&mismatches, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char** argv) {
+	pthread_t tids[THREADS];
+	long i;
+
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&tids[i], NULL, run, (void *) (i + 1));
+	for (i = 0; i < THREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	printf("%d calls, %d failed, %d mismatched responses\n", THREADS * CALLS, failures, mismatches);
+	return mismatches || failures;
+}
@@ -15,13 +15,17 @@
 int main(int argc, char** argv) {
 
 	struct sip_response response;
-	struct sip_request_test request;
+	struct {
+		struct sip_header head;
+		int err; 	/* the only field of SYS_delegatortest */
+	} request;
 
 	request.head.callno = SYS_delegatortest;
-	request.head.size = sizeof(struct sip_request_test);
+	request.head.size = sizeof(request);
+	request.head.nfds = 0;
 	request.err = 42;
 
-	int rv = sip_delegate_call(&request, &response);
+	int rv = sip_delegate_call(&request, NULL, 0, &response);
 
 	if (rv == -1) {
 		printf("failed to send request :(\n");
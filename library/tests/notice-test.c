@@ -0,0 +1,82 @@
+/**
+ * Test for invalidation notices. Client A (this process) creates a file in
+ * the given directory and stats it twice through the daemon, so that the
+ * second stat is answered from its result cache. Client B (a child, which
+ * gets a connection of its own) then removes the file, and A stats it once
+ * more.
+ *
+ * Run as an untrusted user, with a benign directory it can't write or
+ * search, e.g. tests/files/protected after tests/init.sh.
+ *
+ * If the test succeeds, the last stat fails with ENOENT well within the
+ * result TTL, and it prints "1 cache hit(s), 1 result(s) invalidated".
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "packets.h"
+#include "delegate.h"
+#include "resultcache.h"
+
+/**
+ * Stat path through the daemon and report the result.
+ */
+static void stat_file(const char *path, const char *who) {
+	struct sip_response response;
+
+	if (sip_delegate_fstatat(&response, AT_FDCWD, path, 0) == -1)
+		printf("%s: failed to send request :(\n", who);
+	else if (response.rv == -1)
+		printf("%s: stat failed: %s\n", who, strerror(response.err));
+	else
+		printf("%s: stat succeeded.\n", who);
+}
+
+int main(int argc, char** argv) {
+	struct sip_result_cache_stats stats;
+	struct sip_response response;
+	char dir[PATH_MAX], path[PATH_MAX + 32];
+	pid_t pid;
+
+	if (argc != 2 || realpath(argv[1], dir) == NULL) {
+		printf("Usage: %s <protected directory>\n", argv[0]);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/notice-test.txt", dir);
+
+	if (sip_delegate_openat(&response, AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC, 0600) == -1 ||
+		response.rv == -1) {
+		printf("A: failed to create %s :(\n", path);
+		return 1;
+	}
+	close(response.rv);
+
+	stat_file(path, "A");
+	stat_file(path, "A");
+
+	fflush(stdout);
+	if ((pid = fork()) == 0) {
+		if (sip_delegate_unlinkat(&response, AT_FDCWD, path, 0) == -1)
+			printf("B: failed to send request :(\n");
+		else
+			printf("B: unlink %s.\n", response.rv == 0 ? "succeeded" : strerror(response.err));
+		fflush(stdout);
+		_exit(0);
+	}
+	waitpid(pid, NULL, 0);
+
+	stat_file(path, "A");
+
+	sip_result_cache_stats(&stats);
+	printf("%lu cache hit(s), %lu result(s) invalidated\n", stats.hits, stats.invalidations);
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define ITERATIONS 10000
+
+/* Heap allocator entry points exported by glibc. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocations = 0;
+
+/* Definitions in the executable take precedence over those in libc, so these
+   also count allocations made by the preloaded wrapper library. */
+void *malloc(size_t size) {
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+/**
+ * Counts the heap allocations made while running common filesystem calls
+ * through the wrapper library. No call in the loop needs delegation, so the
+ * expected result is 0 allocations.
+ *
+ * Usage: LD_PRELOAD=libsipwrap.so ./alloc_test
+ */
+int main(int argc, char** argv) {
+	struct stat sbuf;
+	unsigned long before;
+	int i, fd;
+
+	fd = open("./files/benign-file.txt", O_RDONLY);
+
+	if (fd < 0) {
+		perror("open failed");
+		return 1;
+	}
+
+	before = allocations;
+
+	for (i = 0; i < ITERATIONS; i++) {
+		close(open("./files/benign-file.txt", O_RDONLY));
+		access("./files/benign-file.txt", R_OK);
+		stat("./files/benign-file.txt", &sbuf);
+		fstat(fd, &sbuf);
+		fchmod(fd, sbuf.st_mode & 07777);
+	}
+
+	printf("%lu heap allocations in %d iterations.\n", allocations - before, ITERATIONS);
+
+	close(fd);
+	return 0;
+}
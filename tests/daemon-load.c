@@ -0,0 +1,473 @@
+/**
+ * Load test for the daemon. Opens many client connections and keeps them
+ * open, as the untrusted processes of a parallel build would, then measures
+ * the latency of test requests spread over the connections and the time to
+ * answer one request on every connection at once. The daemon's memory and
+ * thread count are reported before, during and after. The daemon must be
+ * running; its PID is taken from the connection.
+ *
+ * With -f, the clients instead make real file system calls in DIR, which
+ * must be writable by the daemon: every client creates a directory, renames
+ * it, opens it and removes it, all clients at once, for REQUESTS / CLIENTS
+ * rounds. Run it against a daemon started with SIP_DAEMON_URING=on and
+ * one without to compare the io_uring engine with synchronous handlers.
+ *
+ * Clients ask for invalidation notices, as the library does; -N makes them
+ * ask for none. Notices are counted and otherwise ignored.
+ *
+ * With -s, STUCK more clients send test requests until the daemon takes no
+ * more, and never read the responses. The other clients should be served
+ * as if they weren't there; a response that doesn't come within
+ * RECEIVE_TIMEOUT seconds ends the run.
+ *
+ * Usage: daemon_load [-c CLIENTS] [-n REQUESTS] [-f DIR] [-N] [-s STUCK]
+ */
+
+#define _GNU_SOURCE /* struct ucred */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "common.h"
+#include "packets.h"
+
+#define DEFAULT_CLIENTS 10000
+#define DEFAULT_REQUESTS 20000
+#define RECEIVE_TIMEOUT 5 	/* seconds, with -s */
+#define STUCK_WAIT_MS 100 	/* a stuck client is full once the daemon takes nothing for this long */
+
+/* Whether a receive failed because the response didn't come in time. */
+#define TIMED_OUT(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+
+static unsigned int hello_flags = SIP_HELLO_NOTICES;
+static unsigned long notices; 	/* notices received */
+static struct timeval receive_timeout; 	/* none unless -s */
+
+static double elapsed_us(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Print the memory and thread count of the daemon from /proc/PID/status.
+ */
+static void report_daemon(pid_t pid, const char *when) {
+	char path[64], line[256];
+	FILE *status;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+	if ((status = fopen(path, "r")) == NULL) {
+		perror(path);
+		return;
+	}
+
+	printf("daemon %s:", when);
+	while (fgets(line, sizeof(line), status) != NULL) {
+		if (strncmp(line, "VmRSS:", 6) == 0 || strncmp(line, "VmSize:", 7) == 0 ||
+			strncmp(line, "Threads:", 8) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			printf("  %s", line);
+		}
+	}
+	printf("\n");
+
+	fclose(status);
+}
+
+/**
+ * Connect to the daemon and agree on the protocol version.
+ *
+ * @return The socket, or -1 on failure.
+ */
+static int connect_daemon() {
+	struct sockaddr_un addr;
+	struct sip_hello hello = { SIP_PROTO_MAGIC, SIP_PROTO_VERSION, SIP_PROTO_VERSION, hello_flags };
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), SIP_DAEMON_COMMUNICATION_PATH "/all");
+
+	if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout)) < 0 ||
+		connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		send(fd, &hello, sizeof(hello), 0) != sizeof(hello) ||
+		recv(fd, &hello, sizeof(hello), 0) != sizeof(hello) || hello.min_version != SIP_PROTO_VERSION) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Send a test request; the daemon answers it without a syscall. */
+static int send_test(int fd, unsigned int id) {
+	char packet[sizeof(struct sip_header) + sizeof(int)];
+	struct sip_header head = { SYS_delegatortest, sizeof(packet), id, 0 };
+	int err = 0;
+
+	memcpy(packet, &head, sizeof(head));
+	memcpy(packet + sizeof(head), &err, sizeof(err));
+
+	return send(fd, packet, sizeof(packet), 0) == sizeof(packet) ? 0 : -1;
+}
+
+static int receive_test(int fd, unsigned int id) {
+	struct sip_response response;
+
+	do {
+		if (recv(fd, &response, sizeof(response), 0) < (ssize_t) offsetof(struct sip_response, buf))
+			return -1;
+	} while (response.id == SIP_NOTICE_ID && ++notices);
+
+	if (response.id == id && response.rv == 0)
+		return 0;
+
+	errno = EPROTO;
+	return -1;
+}
+
+/* Append a PATH field with an absolute path (see packets.h). */
+static char *put_path(char *pos, const char *path) {
+	unsigned short len = strlen(path) + 1;
+
+	*pos++ = -1;
+	memcpy(pos, &len, sizeof(len));
+	memcpy(pos + sizeof(len), path, len);
+	return pos + sizeof(len) + len;
+}
+
+static char *put_val(char *pos, const void *val, size_t size) {
+	memcpy(pos, val, size);
+	return pos + size;
+}
+
+/* File system calls made with -f, in order. */
+enum { FILE_MKDIR, FILE_RENAME, FILE_OPEN, FILE_RMDIR, FILE_OPS };
+static const char *file_op_names[FILE_OPS] = { "mkdirat", "renameat2", "openat", "unlinkat" };
+
+/* Send file system call op of client i in dir. */
+static int send_file_op(int fd, int op, const char *dir, long i) {
+	char packet[SIP_MAX_PACKET], from[PATH_MAX], to[PATH_MAX];
+	char *pos = packet + sizeof(struct sip_header);
+	struct sip_header head = { 0, 0, op + 1, 0 };
+	mode_t mode = 0755;
+	unsigned int rename_flags = 0;
+	int flags;
+
+	snprintf(from, sizeof(from), "%s/load-%ld", dir, i);
+	snprintf(to, sizeof(to), "%s/load-%ld.moved", dir, i);
+
+	switch (op) {
+		case FILE_MKDIR:
+			head.callno = SYS_mkdirat;
+			pos = put_path(pos, from);
+			pos = put_val(pos, &mode, sizeof(mode));
+			break;
+		case FILE_RENAME:
+			head.callno = SYS_renameat2;
+			pos = put_path(pos, from);
+			pos = put_path(pos, to);
+			pos = put_val(pos, &rename_flags, sizeof(rename_flags));
+			break;
+		case FILE_OPEN:
+			head.callno = SYS_openat;
+			flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+			pos = put_path(pos, to);
+			pos = put_val(pos, &flags, sizeof(flags));
+			pos = put_val(pos, &mode, sizeof(mode));
+			break;
+		case FILE_RMDIR:
+			head.callno = SYS_unlinkat;
+			flags = AT_REMOVEDIR;
+			pos = put_path(pos, to);
+			pos = put_val(pos, &flags, sizeof(flags));
+			break;
+	}
+
+	head.size = pos - packet;
+	memcpy(packet, &head, sizeof(head));
+
+	return send(fd, packet, head.size, 0) == head.size ? 0 : -1;
+}
+
+/* Receive the response to a file system call; descriptors are closed. */
+static int receive_file_op(int fd, int op) {
+	struct sip_response response;
+	struct msghdr msg = {0};
+	struct iovec iov = { &response, sizeof(response) };
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(SIP_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	int fds[SIP_MAX_FDS], nfds, i;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	/* Notices come without descriptors. */
+	do {
+		msg.msg_control = u.buf;
+		msg.msg_controllen = sizeof(u.buf);
+
+		if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) < (ssize_t) offsetof(struct sip_response, buf))
+			return -1;
+	} while (response.id == SIP_NOTICE_ID && ++notices);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+			for (i = 0; i < nfds; i++)
+				close(fds[i]);
+		}
+	}
+
+	if (response.id == op + 1 && response.rv >= 0)
+		return 0;
+
+	errno = EPROTO;
+	return -1;
+}
+
+static int report_stalled(int failed) {
+	printf("No response within %d s: the daemon stopped serving the other clients.\n", RECEIVE_TIMEOUT);
+	return failed;
+}
+
+/**
+ * Send test requests on a non-blocking client until the daemon takes no
+ * more of them, without reading any response.
+ *
+ * @return Number of requests sent.
+ */
+static long fill_stuck(int fd) {
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	long sent = 0;
+
+	while (1) {
+		if (send_test(fd, sent + 1) == 0)
+			sent++;
+		else if (!TIMED_OUT(errno) || poll(&pfd, 1, STUCK_WAIT_MS) <= 0)
+			return sent;
+	}
+}
+
+/**
+ * Make the file system calls of -f: each call on every client at once.
+ *
+ * @return Number of calls that failed.
+ */
+static int run_file_ops(int *fds, long clients, long rounds, const char *dir) {
+	struct timespec start, end;
+	double spent[FILE_OPS] = { 0 }, total = 0;
+	long r, i;
+	int op, failed = 0;
+
+	for (r = 0; r < rounds; r++) {
+		for (op = 0; op < FILE_OPS; op++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (i = 0; i < clients; i++) {
+				if (send_file_op(fds[i], op, dir, i) == -1)
+					failed++;
+			}
+			for (i = 0; i < clients; i++) {
+				if (receive_file_op(fds[i], op) == -1 && ++failed && TIMED_OUT(errno))
+					return report_stalled(failed);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			spent[op] += elapsed_us(&start, &end);
+		}
+	}
+
+	for (op = 0; op < FILE_OPS; op++) {
+		printf("%-10s %ld calls, one per client at once: %.1f ms (%.0f calls/s)\n", file_op_names[op],
+			   clients * rounds, spent[op] / 1e3, clients * rounds / (spent[op] / 1e6));
+		total += spent[op];
+	}
+	printf("all        %ld calls: %.1f ms (%.0f calls/s)\n", FILE_OPS * clients * rounds, total / 1e3,
+		   FILE_OPS * clients * rounds / (total / 1e6));
+
+	return failed;
+}
+
+/**
+ * Send test requests: one at a time, then one on every client at once.
+ *
+ * @return Number of requests that failed.
+ */
+static int run_tests(int *fds, long clients, long requests, double *latency) {
+	struct timespec start, end, t0, t1;
+	double total = 0;
+	int failed = 0;
+	long i;
+
+	/* One request at a time, spread over the connections. */
+	for (i = 0; i < requests; i++) {
+		int fd = fds[(i * 7919) % clients];
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if ((send_test(fd, i + 1) == -1 || receive_test(fd, i + 1) == -1) && ++failed && TIMED_OUT(errno))
+			return report_stalled(failed);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		latency[i] = elapsed_us(&t0, &t1);
+		total += latency[i];
+	}
+
+	qsort(latency, requests, sizeof(double), compare_doubles);
+	printf("%ld requests, one at a time: avg %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		   requests, total / requests, latency[requests / 2], latency[requests * 99 / 100],
+		   latency[requests - 1]);
+
+	/* One request on every connection at once. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < clients; i++) {
+		if (send_test(fds[i], i + 1) == -1)
+			failed++;
+	}
+	for (i = 0; i < clients; i++) {
+		if (receive_test(fds[i], i + 1) == -1 && ++failed && TIMED_OUT(errno))
+			return report_stalled(failed);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%ld requests, one per client at once: %.1f ms (%.1f us/request)\n", clients,
+		   elapsed_us(&start, &end) / 1e3, elapsed_us(&start, &end) / clients);
+
+	return failed;
+}
+
+int main(int argc, char **argv) {
+	struct timespec start, end;
+	struct rlimit limit;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	long clients = DEFAULT_CLIENTS, requests = DEFAULT_REQUESTS, stuck = 0, sent = 0, i;
+	double *latency;
+	int *fds, *stuck_fds, opt, failed = 0;
+	char *dir = NULL;
+
+	while ((opt = getopt(argc, argv, "c:n:f:Ns:")) != -1) {
+		switch (opt) {
+			case 'c':
+				clients = atol(optarg);
+				break;
+			case 'n':
+				requests = atol(optarg);
+				break;
+			case 'f':
+				dir = optarg;
+				break;
+			case 'N':
+				hello_flags = 0;
+				break;
+			case 's':
+				stuck = atol(optarg);
+				receive_timeout.tv_sec = RECEIVE_TIMEOUT;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-c CLIENTS] [-n REQUESTS] [-f DIR] [-N] [-s STUCK]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (clients < 1 || requests < 1 || stuck < 0) {
+		fprintf(stderr, "Need at least one client and one request.\n");
+		return 1;
+	}
+
+	/* One descriptor per client, plus a few. */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < clients + stuck + 16) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	fds = calloc(clients, sizeof(int));
+	stuck_fds = calloc(stuck + 1, sizeof(int));
+	latency = calloc(requests, sizeof(double));
+
+	if (fds == NULL || stuck_fds == NULL || latency == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	if ((fds[0] = connect_daemon()) < 0 || getsockopt(fds[0], SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		perror("Failed to connect to daemon");
+		return 1;
+	}
+
+	report_daemon(cred.pid, "with 1 client");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 1; i < clients; i++) {
+		if ((fds[i] = connect_daemon()) < 0) {
+			fprintf(stderr, "Connection %ld failed: %s\n", i, strerror(errno));
+			clients = i;
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%ld clients connected in %.1f ms\n", clients, elapsed_us(&start, &end) / 1e3);
+	report_daemon(cred.pid, "with all clients");
+
+	for (i = 0; i < stuck; i++) {
+		if ((stuck_fds[i] = connect_daemon()) < 0 || fcntl(stuck_fds[i], F_SETFL, O_NONBLOCK) < 0) {
+			if (TIMED_OUT(errno))
+				return report_stalled(1);
+			perror("Failed to connect stuck client");
+			return 1;
+		}
+		sent += fill_stuck(stuck_fds[i]);
+	}
+
+	if (stuck > 0) {
+		printf("%ld stuck clients sent %ld requests and read no responses\n", stuck, sent);
+		report_daemon(cred.pid, "with stuck clients");
+	}
+
+	if (dir != NULL)
+		failed = run_file_ops(fds, clients, requests > clients ? requests / clients : 1, dir);
+	else
+		failed = run_tests(fds, clients, requests, latency);
+
+	report_daemon(cred.pid, "under load");
+
+	if (hello_flags & SIP_HELLO_NOTICES)
+		printf("%lu notices received\n", notices);
+
+	for (i = 1; i < clients; i++)
+		close(fds[i]);
+	for (i = 0; i < stuck; i++)
+		close(stuck_fds[i]);
+
+	/* Let the daemon notice the hangups. */
+	sleep(1);
+	report_daemon(cred.pid, "after hangups");
+
+	close(fds[0]);
+
+	if (failed)
+		printf("%d requests failed\n", failed);
+
+	return failed != 0;
+}
@@ -0,0 +1,146 @@
+#define _GNU_SOURCE /* renameat2(2) */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "level.h"
+#include "test-util.h"
+
+#define SWAP_SECONDS 1
+
+static void blocked(int sig) {
+	printf("open blocked :(\n");
+	exit(1);
+}
+
+/**
+ * Open path with flags and report the result.
+ */
+static void try_open(const char *path, int flags, const char *what) {
+	int fd;
+
+	printf("Attempting to open %s %s.\n", path, what);
+
+	alarm(5);
+	if ((fd = open(path, flags)) < 0) {
+		perror("Error opening file");
+	} else {
+		printf("File opened successfully!\n");
+		close(fd);
+	}
+	alarm(0);
+}
+
+/**
+ * Open ./files/swap.txt for SWAP_SECONDS while another process keeps
+ * exchanging it with ./files/swap-untrusted.txt.
+ *
+ * @return Number of opens that returned the untrusted file.
+ */
+static int race_swap(int *opened, int *denied) {
+	int fd, ready[2], untrusted = 0;
+	time_t end;
+	pid_t pid;
+	char c;
+
+	if (pipe(ready) < 0 || (pid = fork()) < 0)
+		return -1;
+
+	if (pid == 0) {
+		renameat2(AT_FDCWD, "./files/swap.txt", AT_FDCWD, "./files/swap-untrusted.txt", RENAME_EXCHANGE);
+		write(ready[1], "x", 1);
+		while (1)
+			renameat2(AT_FDCWD, "./files/swap.txt", AT_FDCWD, "./files/swap-untrusted.txt", RENAME_EXCHANGE);
+	}
+
+	read(ready[0], &c, 1);
+	*opened = *denied = 0;
+
+	for (end = time(NULL) + SWAP_SECONDS; time(NULL) <= end; ) {
+		if ((fd = open("./files/swap.txt", O_RDONLY)) < 0) {
+			(*denied)++;
+			continue;
+		}
+		(*opened)++;
+		untrusted += SIP_LV_LOW == sip_fd_to_level(fd);
+		close(fd);
+	}
+
+	close(ready[0]);
+	close(ready[1]);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+	/* Leave the benign file at ./files/swap.txt */
+	if (SIP_LV_LOW == sip_path_to_level("./files/swap.txt"))
+		renameat2(AT_FDCWD, "./files/swap.txt", AT_FDCWD, "./files/swap-untrusted.txt", RENAME_EXCHANGE);
+
+	return untrusted;
+}
+
+/**
+ * Opens for a benign process. The level is checked on the opened descriptor
+ * before the open can have any effect. Run as a benign user from the tests
+ * directory, after init.sh.
+ *
+ * Expected Result: The untrusted FIFO, the untrusted file opened with
+ * O_TRUNC and the symlink to the untrusted file are denied at once, and the
+ * untrusted file keeps its contents. Reading the benign FIFO waits for its
+ * writer. While ./files/swap.txt is swapped, some opens succeed and some
+ * are denied, but none returns the untrusted file.
+ */
+int main(int argc, char **argv) {
+	struct stat sbuf;
+	char c;
+	int fd, opened, denied, untrusted;
+	pid_t pid;
+	uid_t uid = geteuid();
+	int ulevel = sip_uid_to_level(uid);
+
+	printf("Running with UID %d (%s)\n", uid, level_to_string(ulevel));
+
+	signal(SIGALRM, blocked);
+
+	try_open("./files/untrusted-fifo", O_RDONLY, "for reading");
+	try_open("./files/untrusted-file.txt", O_WRONLY | O_TRUNC, "for writing with O_TRUNC");
+
+	if (stat("./files/untrusted-file.txt", &sbuf) == 0)
+		printf("./files/untrusted-file.txt has %ld bytes.\n", (long) sbuf.st_size);
+
+	try_open("./files/untrusted-link", O_RDONLY, "for reading");
+
+	printf("Attempting to read ./files/benign-fifo.\n");
+	fflush(stdout);
+
+	if ((pid = fork()) == 0) {
+		sleep(1);
+		fd = open("./files/benign-fifo", O_WRONLY);
+		write(fd, "x", 1);
+		_exit(0);
+	}
+
+	alarm(5);
+	if ((fd = open("./files/benign-fifo", O_RDONLY)) < 0) {
+		perror("Error opening file");
+	} else {
+		printf("Read %zd byte(s) from the writer.\n", read(fd, &c, 1));
+		close(fd);
+	}
+	alarm(0);
+	waitpid(pid, NULL, 0);
+
+	printf("Opening ./files/swap.txt for %d second(s) while it is swapped.\n", SWAP_SECONDS);
+	fflush(stdout);
+
+	untrusted = race_swap(&opened, &denied);
+	printf("%d opens succeeded, %d were denied, %d returned the untrusted file.\n", opened, denied, untrusted);
+
+	return 0;
+}
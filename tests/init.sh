@@ -16,4 +16,20 @@ chown sekar:trusted_group files/benign-file-no-downgrade.txt
 chown sekar:untrusted files/untrusted-file.txt
 
 # Set perms
-chmod u+rw,o-rwx,g-rwx files/benign-file.txt # Force delegation when opened for reading
\ No newline at end of file
+chmod u+rw,o-rwx,g-rwx files/benign-file.txt # Force delegation when opened for reading
+
+# Magic link test: a directory untrusted processes can't search
+rm -rf files/protected
+mkdir files/protected
+cp -f files/template files/protected/benign-file.txt
+chown -R sekar:sekar files/protected
+chmod 700 files/protected
+
+# High integrity open test
+rm -f files/benign-fifo files/untrusted-fifo files/untrusted-link
+mkfifo files/benign-fifo files/untrusted-fifo
+ln -s untrusted-file.txt files/untrusted-link
+cp -f files/template files/swap.txt
+cp -f files/template files/swap-untrusted.txt
+chown sekar:sekar files/benign-fifo files/swap.txt
+chown sekar:untrusted files/untrusted-fifo files/swap-untrusted.txt
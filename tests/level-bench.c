@@ -0,0 +1,63 @@
+#define _GNU_SOURCE /* syscall(2) */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "level.h"
+#include "common.h"
+
+#define DEFAULT_ITERATIONS 10000000
+
+/**
+ * Integrity level lookup as it was done before the level was cached: one
+ * getuid syscall per query.
+ */
+static int uncached_level() {
+	long uid = syscall(SYS_getuid32);
+
+	if (uid == SIP_UNTRUSTED_USERID)
+		return SIP_LV_LOW;
+
+	return SIP_LV_HIGH;
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Microbenchmark for sip_level(). Compares the cost of a cached level lookup
+ * with the cost of the getuid syscall it replaces.
+ *
+ * Usage: level_bench [ITERATIONS]
+ */
+int main(int argc, char** argv) {
+	long i, iterations = DEFAULT_ITERATIONS;
+	volatile int sink = 0;
+	struct timespec start, end;
+	double syscall_ns, cached_ns;
+
+	if (argc > 1)
+		iterations = atol(argv[1]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		sink += uncached_level();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	syscall_ns = elapsed_ns(&start, &end) / iterations;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		sink += sip_level();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	cached_ns = elapsed_ns(&start, &end) / iterations;
+
+	printf("%ld iterations\n", iterations);
+	printf("getuid syscall: %8.2f ns/call\n", syscall_ns);
+	printf("sip_level():    %8.2f ns/call\n", cached_ns);
+	printf("saving:         %8.2f ns/call\n", syscall_ns - cached_ns);
+
+	return 0;
+}
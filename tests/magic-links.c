@@ -0,0 +1,69 @@
+#define _GNU_SOURCE /* O_PATH */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "level.h"
+#include "test-util.h"
+
+#define PROTECTED "/files/protected/benign-file.txt"
+
+/**
+ * Open path for reading and report the result.
+ */
+static void try_open(const char *path) {
+	int fd;
+
+	printf("Attempting to open %s for reading.\n", path);
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("Error opening file");
+	} else {
+		printf("File opened for reading successfully!\n");
+		close(fd);
+	}
+}
+
+/**
+ * Open a file in a directory untrusted processes can't search, first by its
+ * path, then through /proc/self/root, /proc/self/fd/0 and
+ * /proc/thread-self/cwd. Each open fails natively and is delegated. Run as
+ * an untrusted user from the tests directory, after init.sh.
+ *
+ * Expected Result: The first open succeeds. The others fail with "Too many
+ * levels of symbolic links": the daemon doesn't follow magic links, which
+ * it would resolve in its own context.
+ */
+int main(int argc, char **argv) {
+	char cwd[PATH_MAX], path[PATH_MAX + 64];
+	int fd;
+	uid_t uid = geteuid();
+	int ulevel = sip_uid_to_level(uid);
+
+	printf("Running with UID %d (%s)\n", uid, level_to_string(ulevel));
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL || (fd = open("./files", O_PATH | O_DIRECTORY)) < 0) {
+		perror("Error opening ./files");
+		return 1;
+	}
+
+	try_open("." PROTECTED);
+
+	snprintf(path, sizeof(path), "/proc/self/root%s" PROTECTED, cwd);
+	try_open(path);
+
+	/* Standard input now refers to ./files */
+	dup2(fd, 0);
+	try_open("/proc/self/fd/0/protected/benign-file.txt");
+
+	if (chdir("./files") < 0) {
+		perror("Error changing to ./files");
+		return 1;
+	}
+	try_open("/proc/thread-self/cwd/protected/benign-file.txt");
+
+	return 0;
+}
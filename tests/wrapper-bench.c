@@ -0,0 +1,116 @@
+#define _GNU_SOURCE /* setenv(3) */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define DEFAULT_ITERATIONS 200000
+#define BENCH_FILE "/tmp/sip-wrapper-bench.txt"
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Time the hot file-system calls in the current process and print ns/op.
+ */
+static int run(long iterations) {
+	struct timespec start, end;
+	struct stat sbuf;
+	long i;
+	int fd;
+
+	if ((fd = open(BENCH_FILE, O_CREAT | O_WRONLY, 0644)) < 0) {
+		perror("open " BENCH_FILE);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		close(openat(AT_FDCWD, BENCH_FILE, O_RDONLY));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("  openat+close %10.1f ns/op\n", elapsed_ns(&start, &end) / iterations);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		faccessat(AT_FDCWD, BENCH_FILE, R_OK, 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("  faccessat    %10.1f ns/op\n", elapsed_ns(&start, &end) / iterations);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		stat(BENCH_FILE, &sbuf);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("  stat         %10.1f ns/op\n", elapsed_ns(&start, &end) / iterations);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		fstat(fd, &sbuf);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("  fstat        %10.1f ns/op\n", elapsed_ns(&start, &end) / iterations);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		chmod(BENCH_FILE, 0644);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("  chmod        %10.1f ns/op\n", elapsed_ns(&start, &end) / iterations);
+
+	close(fd);
+	unlink(BENCH_FILE);
+	return 0;
+}
+
+/**
+ * Compares the per-call overhead of wrapper libraries, e.g. the combined
+ * libsipwrap.so against libsipwrap-high.so. Each library is measured in a
+ * child started with LD_PRELOAD set to it; "none" runs without a preload.
+ * A colon-separated LIBRARY such as libsipwrap-low.so:libsipwrap.so measures
+ * what a process started by the launcher pays.
+ *
+ * Usage: wrapper_bench [-n ITERATIONS] LIBRARY...
+ */
+int main(int argc, char** argv) {
+	long iterations = DEFAULT_ITERATIONS;
+	char count[32];
+	int i, status;
+	pid_t pid;
+
+	if (argc == 3 && strcmp(argv[1], "-run") == 0)
+		return run(atol(argv[2]));
+
+	if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+		iterations = atol(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc < 2 || iterations <= 0) {
+		printf("Usage: wrapper_bench [-n ITERATIONS] LIBRARY...\n");
+		return 1;
+	}
+
+	snprintf(count, sizeof(count), "%ld", iterations);
+
+	for (i = 1; i < argc; i++) {
+		printf("%s (%ld iterations):\n", argv[i], iterations);
+		fflush(stdout);
+
+		if ((pid = fork()) == 0) {
+			if (strcmp(argv[i], "none") == 0)
+				unsetenv("LD_PRELOAD");
+			else
+				setenv("LD_PRELOAD", argv[i], 1);
+			execl("/proc/self/exe", "wrapper_bench", "-run", count, (char *) NULL);
+			perror("execl failed");
+			_exit(1);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			printf("  failed\n");
+	}
+
+	return 0;
+}